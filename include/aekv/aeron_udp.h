@@ -0,0 +1,31 @@
+#ifndef __rai_aekv__aeron_udp_h__
+#define __rai_aekv__aeron_udp_h__
+
+/* udp transport bindings for the media driver, selected by name with
+ * AERON_UDP_CHANNEL_TRANSPORT_BINDINGS_MEDIA, the driver finds the symbol
+ * with dlsym(), so the executable is linked with -rdynamic:
+ *
+ *   aekv_udp_mmsg : recvmmsg() batches, UDP_GRO on recv and UDP_SEGMENT on
+ *                   send when the kernel has them (linux >= 5.0)
+ *   aekv_udp_uring : io_uring, a ring per transport poller with multishot
+ *                    recvmsg into a provided buffer ring, the duty cycle
+ *                    reaps completions without syscalls, sends are linked
+ *                    sqes submitted together (linux >= 6.0, else default)
+ */
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct aeron_udp_channel_transport_bindings_stct;
+struct aeron_udp_transport_poller_stct;
+extern struct aeron_udp_channel_transport_bindings_stct aekv_udp_mmsg;
+extern struct aeron_udp_channel_transport_bindings_stct aekv_udp_uring;
+/* the ring fd of an aekv_udp_uring poller, readable when recvs complete,
+ * the multishot recvs drain its transport fds, so a poll waits on the ring
+ * instead, -1 when the poller fell back to the default */
+int aekv_udp_uring_poller_fd( struct aeron_udp_transport_poller_stct *poller );
+
+#ifdef __cplusplus
+}
+#endif
+#endif
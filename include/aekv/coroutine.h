@@ -3,6 +3,9 @@
 
 /* derived from: https://github.com/cloudwu/coroutine */
 
+#include <stddef.h>
+#include <stdint.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -14,6 +17,11 @@ enum {
   COROUTINE_SUSPEND = 3
 };
 
+enum {
+  COROUTINE_SHARED_STACK   = 0, /* one stack, copied out and in on switch */
+  COROUTINE_SEPARATE_STACK = 1  /* pooled mmap stack per coroutine, no copy */
+};
+
 struct schedule_s;
 struct coroutine_s;
 typedef struct schedule_s schedule_t;
@@ -21,7 +29,10 @@ typedef struct coroutine_s coroutine_t;
 
 typedef void ( *coroutine_func_t )( coroutine_t *, void *ud );
 
-schedule_t * coroutine_open( void );
+/* stack_size is the shared stack, or each stack in separate mode, it is
+ * reserved and committed as used, zero is 10MB shared or 256K separate */
+schedule_t * coroutine_open( size_t stack_size );
+schedule_t * coroutine_open_mode( size_t stack_size,  int mode );
 void coroutine_close( schedule_t *sched );
 
 coroutine_t * coroutine_new( schedule_t *sched, coroutine_func_t f,
@@ -30,8 +41,44 @@ void coroutine_resume( coroutine_t *co );
 int  coroutine_status( coroutine_t *co );
 coroutine_t * coroutine_running( schedule_t *sched );
 void coroutine_yield( coroutine_t *co );
+/* wait until coroutine_wake(), not resumed by coroutine_run() until then */
+void coroutine_suspend( coroutine_t *co );
+void coroutine_wake( coroutine_t *co );
+/* park until a time, an fd event (EPOLLIN, ...) or cond( arg ) is true,
+ * wait_fd returns the events or -1 when fd can't be added to epoll */
+void coroutine_sleep_ns( coroutine_t *co,  uint64_t ns );
+int  coroutine_wait_fd( coroutine_t *co,  int fd,  int events );
+void coroutine_wait_cond( coroutine_t *co,  int ( *cond )( void * ),
+                          void *arg );
+/* resume each ready coroutine once, returns count resumed */
+int  coroutine_run( schedule_t *sched );
+/* wake parked coroutines, blocks up to timeout_ms (-1 forever) when none are
+ * ready and none wait on a cond, returns count woken */
+int  coroutine_poll( schedule_t *sched,  int timeout_ms );
 const char *coroutine_name( coroutine_t *co );
 
+/* work stealing pool of threads, each with a separate stack schedule,
+ * idle workers steal unpinned coroutines from the others, the sleep, fd and
+ * cond waits only work within the worker a coroutine is running on, a
+ * coroutine_suspend() may be woken from any thread, it is requeued after
+ * its worker has switched off its stack, a wake while it is still running
+ * makes its next coroutine_suspend() return at once, idle workers park
+ * until a coroutine is pushed */
+struct coroutine_pool_s;
+typedef struct coroutine_pool_s coroutine_pool_t;
+
+/* nworkers zero is one per cpu */
+coroutine_pool_t * coroutine_pool_open( int nworkers,  size_t stack_size );
+/* worker >= 0 pins it to that worker, -1 lets it migrate */
+coroutine_t * coroutine_pool_new( coroutine_pool_t *pool, coroutine_func_t f,
+                                  void *user_data,  const char *name,
+                                  int worker );
+/* runs worker 0 on the caller, returns when all coroutines are dead */
+int  coroutine_pool_run( coroutine_pool_t *pool );
+void coroutine_pool_close( coroutine_pool_t *pool );
+/* index of worker calling, -1 when not in a pool */
+int  coroutine_pool_worker( void );
+
 #ifdef __cplusplus
 }
 #endif
@@ -5,21 +5,27 @@ extern "C" {
 typedef struct aeron_stct                    aeron_t;
 typedef struct aeron_context_stct            aeron_context_t;
 typedef struct aeron_client_conductor_stct   aeron_client_conductor_t;
-typedef struct aeron_publication_stct        aeron_publication_t;
+typedef struct aeron_exclusive_publication_stct aeron_exclusive_publication_t;
 typedef struct aeron_subscription_stct       aeron_subscription_t;
 typedef struct aeron_fragment_assembler_stct aeron_fragment_assembler_t;
 typedef struct aeron_header_stct             aeron_header_t;
+typedef struct aeron_image_stct              aeron_image_t;
 typedef struct aeron_client_registering_resource_stct
   aeron_async_add_subscription_t;
 typedef struct aeron_client_registering_resource_stct
-  aeron_async_add_publication_t;
+  aeron_async_add_exclusive_publication_t;
+struct hdr_histogram;
 }
 
+#include <stdio.h>
 #include <raikv/ev_net.h>
 #include <raikv/kv_msg.h>
 #include <raikv/kv_pubsub.h>
 #include <raikv/route_ht.h>
 #include <raikv/uint_ht.h>
+#ifdef __SSE4_1__
+#include <smmintrin.h>
+#endif
 
 namespace rai {
 namespace aekv {
@@ -248,19 +254,147 @@ struct AeronPatternSubMap {
   void print( void ) noexcept;
 };
 
+/* aekv message types, in KvMsg::msg_type above the raikv KV_MSG types */
+enum AeronMsgType {
+  AERON_MSG_SUBJ_ID    = 0x40, /* the next publish defines a subject id */
+  AERON_MSG_PUB_ID     = 0x41, /* publish to a subject id */
+  AERON_MSG_SUBJ_RESET = 0x42, /* request peer to redefine its subject ids */
+  AERON_MSG_REPLAY_END = 0x43  /* a full cycle of the sender subs was sent */
+};
+/* payload of AERON_MSG_SUBJ_ID, follows KvMsg header */
+struct AeronSubjIdMsg {
+  uint32_t id;      /* id of subject in next KV_MSG_PUBLISH */
+  uint16_t epoch,   /* epoch of sender subject ids */
+           pad;
+};
+/* payload of AERON_MSG_REPLAY_END, follows KvMsg header */
+struct AeronReplayEndMsg {
+  uint64_t start_seqno; /* seqno of the first msg of the cycle */
+};
+/* payload of AERON_MSG_PUB_ID, follows KvMsg header, reply and data follow */
+struct AeronPubIdMsg {
+  uint32_t id,       /* id of subject */
+           msg_size; /* length of data */
+  uint16_t epoch,    /* epoch of sender subject ids */
+           replylen; /* length of reply */
+  uint8_t  msg_enc;  /* encoding of data */
+  char     code;     /* pub type */
+  uint8_t  pad[ 2 ];
+};
+/* sender subject id table element */
+struct AeronSubjRoute {
+  uint32_t hash,       /* hash of subject */
+           id,         /* id assigned to subject */
+           prefix_sig; /* prefixes routed when id was defined */
+  uint16_t len;        /* length of subject string */
+  char     value[ 2 ]; /* the subject string */
+  bool equals( const void *s,  uint16_t l ) const {
+    return l == this->len && ::memcmp( s, this->value, l ) == 0;
+  }
+  void copy( const void *s,  uint16_t l ) {
+    ::memcpy( this->value, s, l );
+  }
+  /* signature of pattern prefix lengths present in a publish */
+  static uint32_t make_sig( uint8_t prefix_cnt,  const uint8_t *prefix ) {
+    uint32_t sig = prefix_cnt;
+    for ( uint8_t i = 0; i < prefix_cnt; i++ )
+      sig = ( sig * 33 ) ^ prefix[ i ];
+    return sig;
+  }
+};
+/* receiver subject id element, defined by a session */
+struct AeronSubjEntry {
+  uint32_t hash;       /* hash of subject */
+  uint16_t len;        /* length of subject */
+  uint8_t  prefix_cnt; /* count of prefix hashes following subject */
+  char     value[ 1 ]; /* subject string, then prefix_cnt KvPrefHash */
+
+  kv::KvPrefHash *prefix_array( void ) {
+    return (kv::KvPrefHash *) (void *) &this->value[ this->len ];
+  }
+};
+
+/* bloom filter of subject and pattern prefix hashes, advertised by hello */
+struct AeronBloom {
+  static const uint32_t BLOOM_BITS  = 4096,
+                        BLOOM_WORDS = BLOOM_BITS / 64;
+  uint64_t bits[ BLOOM_WORDS ];
+
+  void zero( void ) {
+    ::memset( this->bits, 0, sizeof( this->bits ) );
+  }
+  /* two bit positions from a subject hash */
+  static uint32_t h1( uint32_t h ) { return h % BLOOM_BITS; }
+  static uint32_t h2( uint32_t h ) {
+    return ( ( h * 0x9e3779b1U ) >> 20 ) % BLOOM_BITS;
+  }
+  void add( uint32_t h ) {
+    this->bits[ h1( h ) / 64 ] |= (uint64_t) 1 << ( h1( h ) % 64 );
+    this->bits[ h2( h ) / 64 ] |= (uint64_t) 1 << ( h2( h ) % 64 );
+  }
+  bool maybe( uint32_t h ) const {
+    return ( this->bits[ h1( h ) / 64 ] >> ( h1( h ) % 64 ) &
+             this->bits[ h2( h ) / 64 ] >> ( h2( h ) % 64 ) & 1 ) != 0;
+  }
+  /* if subject or any of the prefixes may be subscribed */
+  bool maybe_pub( uint32_t h,  uint8_t prefix_cnt,
+                  const uint32_t *hash ) const {
+    if ( this->maybe( h ) )
+      return true;
+    for ( uint8_t i = 0; i < prefix_cnt; i++ )
+      if ( this->maybe( hash[ i ] ) )
+        return true;
+    return false;
+  }
+  void merge( const AeronBloom &b ) {
+    for ( uint32_t i = 0; i < BLOOM_WORDS; i++ )
+      this->bits[ i ] |= b.bits[ i ];
+  }
+};
+/* heartbeat payload, follows the KvMsg header of KV_MSG_HELLO */
+struct AeronHello {
+  uint64_t   ping;      /* stamp of peer pinged, zero if none */
+  AeronBloom bloom;     /* subjects and prefixes subscribed by sender */
+  uint64_t   send_ns,   /* realtime of sender when hello created */
+             echo_ns,   /* send_ns of the last hello recvd from ping peer */
+             echo_recv; /* realtime of sender when that hello was recvd */
+};
+
 enum SessionState {
   SESSION_NEW      = 1, /* set initially, cleared after subs are sent */
   SESSION_DATALOSS = 2, /* when seqno is missing */
   SESSION_TIMEOUT  = 4, /* when timer expires after no heartbeats */
-  SESSION_BYE      = 8  /* if session closes */
+  SESSION_BYE      = 8, /* if session closes */
+  SESSION_RESTORED = 16 /* loaded from snapshot, routes not yet confirmed */
+};
+
+/* message classes counted by AeronSessionStats */
+enum AeronStatType {
+  AERON_STAT_PUB   = 0, /* KV_MSG_PUBLISH and AERON_MSG_PUB_ID */
+  AERON_STAT_FRAG  = 1, /* KV_MSG_FRAGMENT */
+  AERON_STAT_SUB   = 2, /* sub, unsub, psub, punsub */
+  AERON_STAT_HELLO = 3, /* KV_MSG_HELLO */
+  AERON_STAT_OTHER = 4, /* bye, subject id and replay control */
+  AERON_STAT_TYPES = 5
+};
+/* traffic counters of a session */
+struct AeronSessionStats {
+  uint64_t msg_count[ AERON_STAT_TYPES ],  /* msgs recvd by type */
+           byte_count[ AERON_STAT_TYPES ], /* bytes recvd by type */
+           gap_count,                      /* times seqno skipped */
+           gap_seqno,                      /* count of seqnos missing */
+           frag_drop,                      /* fragments not reassembled */
+           subj_drop;                      /* pubs with unknown subject id */
+
+  static AeronStatType type( uint8_t msg_type ) noexcept;
+  void zero( void ) { ::memset( (void *) this, 0, sizeof( *this ) ); }
 };
 
 struct AeronSession {
-  AeronSession  * next,        /* link in MyPeers::list or MyPeers::free_list */
-                * back,
-                * next_id,     /* link in session_idx[] collision chain */
-                * last_id;
+  AeronSession  * next,        /* link in MyPeers::list */
+                * back;
   kv::KvFragAsm * frag;
+  AeronSubjEntry ** subj_ids;  /* subject ids defined by session */
   const uint64_t  stamp;       /* identifies session uniquely */
   uint64_t        last_active, /* time in ns of last message recvd */
                   last_seqno,  /* seqno of last message recvd */
@@ -269,7 +403,29 @@ struct AeronSession {
   const uint32_t  id;          /* id is index into sessions[] */
   uint32_t        sub_count,   /* count of subscriptions */
                   psub_count,  /* count of pattern subs */
-                  state;       /* state of session, bits of SessionState */
+                  state,       /* state of session, bits of SessionState */
+                  has_bloom,   /* if bloom was recvd with hello */
+                  subj_size,   /* size of subj_ids[] */
+                  subj_pending;/* subject id defined by next publish */
+  uint16_t        subj_epoch,  /* epoch of subj_ids[] */
+                  subj_reset;  /* epoch when reset was requested */
+  AeronBloom      bloom;       /* subs of session, from hello and sub msgs */
+  AeronSessionStats stats;     /* counters of msgs recvd */
+  hdr_histogram * lat_hist;    /* one way latency, sender stamp to recv */
+  uint64_t        hello_ns,    /* send_ns of last hello, echoed by ping */
+                  hello_recv,  /* my realtime when hello_ns recvd */
+                  clock_samples; /* count of ping round trips */
+  int64_t         clock_offset,/* peer realtime - my realtime */
+                  rtt_ns,      /* smoothed round trip of pings */
+                  rtt_min;     /* slowly aged minimum round trip */
+  uint64_t        last_live,   /* mono ns of last liveness sample */
+                  ping_ns,     /* mono ns when I last pinged session */
+                  resync_seqno,/* first seqno recvd after restore, zero when
+                                  the restored routes are not being confirmed */
+                  resync_ns;   /* mono ns of that frame or the last confirm */
+  double          hb_mean,     /* ewma of liveness inter-arrival ns */
+                  hb_var;      /* ewma variance of inter-arrival */
+  uint32_t        hb_count;    /* count of inter-arrival samples */
 
   void     set( SessionState fl )        { this->state |= (uint32_t) fl; }
   uint32_t test( SessionState fl ) const { return this->state & (uint32_t) fl; }
@@ -277,96 +433,272 @@ struct AeronSession {
   void     clear( SessionState fl )      { this->state &= ~(uint32_t) fl; }
 
   void * operator new( size_t, void *ptr ) { return ptr; }
-  AeronSession( uint32_t i,  uint64_t stmp = 0,  uint64_t seq = 0,
-                AeronSession *nid = 0 )
-    : next( 0 ), back( 0 ), next_id( nid ), last_id( 0 ), frag( 0 ),
-      stamp( stmp ), last_active( 0 ), last_seqno( seq ), delta_seqno( 1 ),
+  AeronSession( uint32_t i,  uint64_t stmp = 0,  uint64_t seq = 0 )
+    : next( 0 ), back( 0 ), frag( 0 ),
+      subj_ids( 0 ), stamp( stmp ), last_active( 0 ), last_seqno( seq ), delta_seqno( 1 ),
       pub_count( 0 ), id( i ), sub_count( 0 ), psub_count( 0 ),
-      state( SESSION_NEW ) {
-    if ( nid != NULL )
-      nid->last_id = this;
+      state( SESSION_NEW ), has_bloom( 0 ), subj_size( 0 ),
+      subj_pending( 0 ), subj_epoch( 0 ), subj_reset( 0 ), lat_hist( 0 ),
+      hello_ns( 0 ), hello_recv( 0 ), clock_samples( 0 ), clock_offset( 0 ),
+      rtt_ns( 0 ), rtt_min( 0 ), last_live( 0 ), ping_ns( 0 ),
+      resync_seqno( 0 ), resync_ns( 0 ), hb_mean( 0 ),
+      hb_var( 0 ),
+      hb_count( 0 ) {
+    this->stats.zero();
+  }
+  /* count a msg recvd */
+  void count_msg( uint8_t msg_type,  uint32_t size ) {
+    AeronStatType t = AeronSessionStats::type( msg_type );
+    this->stats.msg_count[ t ]++;
+    this->stats.byte_count[ t ] += size;
+  }
+  /* NTP style sample: t1 my send, t2 peer recv, t3 peer send, t4 my recv */
+  void clock_sample( uint64_t t1,  uint64_t t2,  uint64_t t3,
+                     uint64_t t4 ) noexcept;
+  /* sample hello or data inter-arrival for the failure detector, sampled at
+     most twice per heartbeat interval, data suppresses hellos */
+  void live_arrival( uint64_t now_ns ) noexcept;
+  /* phi accrual suspicion that session is lost, -log10( P(still alive) ) */
+  double phi( uint64_t now_ns ) const noexcept;
+  /* add ns from sender stamp to recv to lat_hist */
+  void record_latency( uint64_t lat_ns ) noexcept;
+  /* lookup subject id defined by session */
+  AeronSubjEntry *get_subj( uint32_t sid,  uint16_t epoch ) const {
+    if ( epoch != this->subj_epoch || sid >= this->subj_size )
+      return NULL;
+    return this->subj_ids[ sid ];
+  }
+  /* define subject id from the publish which follows AERON_MSG_SUBJ_ID */
+  void set_subj( uint32_t sid,  kv::KvSubMsg &msg ) noexcept;
+  /* free subject ids, when epoch changes or session is lost */
+  void release_subj( void ) noexcept;
+};
+
+/* open addressing index of sessions by the full stamp, linear probing over
+   buckets of one cache line, so a lookup usually touches one line */
+struct AeronSessionTab {
+  static const uint32_t BUCKET_SLOTS = 4;
+  struct Bucket {
+    uint64_t       stamp[ BUCKET_SLOTS ];   /* zero when slot is empty */
+    AeronSession * session[ BUCKET_SLOTS ];
+  };
+  Bucket * buckets; /* aligned to cache line */
+  uint32_t mask,    /* bucket count - 1, count is a power of 2 */
+           count;   /* count of sessions indexed */
+
+  AeronSessionTab() : buckets( 0 ), mask( 0 ), count( 0 ) {}
+  static uint32_t home( uint64_t stamp,  uint32_t mask ) {
+    return (uint32_t) ( ( stamp * 0x9e3779b97f4a7c15ULL ) >> 32 ) & mask;
+  }
+  /* bits 0 -> 3 set for slots in bucket equal to stamp */
+  static uint32_t match( const Bucket &b,  uint64_t stamp ) {
+#ifdef __SSE4_1__
+    __m128i k  = _mm_set1_epi64x( (long long) stamp ),
+            lo = _mm_load_si128( (const __m128i *) (const void *) &b.stamp[ 0 ] ),
+            hi = _mm_load_si128( (const __m128i *) (const void *) &b.stamp[ 2 ] );
+    return (uint32_t)
+      _mm_movemask_pd( _mm_castsi128_pd( _mm_cmpeq_epi64( lo, k ) ) ) |
+      ( (uint32_t)
+      _mm_movemask_pd( _mm_castsi128_pd( _mm_cmpeq_epi64( hi, k ) ) ) << 2 );
+#else
+    uint32_t m = 0;
+    for ( uint32_t i = 0; i < BUCKET_SLOTS; i++ )
+      if ( b.stamp[ i ] == stamp )
+        m |= 1U << i;
+    return m;
+#endif
+  }
+  /* find session by stamp, stamp zero is never indexed */
+  AeronSession *find( uint64_t stamp ) const {
+    if ( this->count == 0 || stamp == 0 )
+      return NULL;
+    for ( uint32_t b = home( stamp, this->mask ); ; b = ( b + 1 ) & this->mask ) {
+      const Bucket & bk = this->buckets[ b ];
+      uint32_t m = match( bk, stamp );
+      if ( m != 0 )
+        return bk.session[ __builtin_ctz( m ) ];
+      /* an empty slot ends the probe, deletes shift entries back */
+      if ( match( bk, 0 ) != 0 )
+        return NULL;
+    }
+  }
+  uint64_t &slot_stamp( uint32_t n ) {
+    return this->buckets[ n / BUCKET_SLOTS ].stamp[ n % BUCKET_SLOTS ];
+  }
+  AeronSession *&slot_session( uint32_t n ) {
+    return this->buckets[ n / BUCKET_SLOTS ].session[ n % BUCKET_SLOTS ];
   }
+  /* index session by its stamp, grows table when more than half full */
+  bool insert( AeronSession *s ) noexcept;
+  /* remove stamp from index */
+  void remove( uint64_t stamp ) noexcept;
+  bool resize( uint32_t nbuckets ) noexcept;
+  void release( void ) noexcept;
+};
+
+/* an mmap'd slab of sessions, sessions never move so ids are stable */
+struct AeronSessionChunk {
+  void   * mem;   /* mapping of sessions */
+  size_t   size;  /* size of mapping */
 };
 
 struct MyPeers {
   kv::DLinkList<AeronSession>
-                    list,           /* ordered list, hd = last active */
-                    free_list;      /* free sessions */
-  kv::UIntHashTab * session_idx;    /* idx of sessions[] */
+                    list;           /* live sessions, not ordered */
+  AeronSessionTab   session_tab;    /* idx of sessions by stamp */
   AeronSession    * last_session,   /* last sessions[] used */
-                 ** sessions;       /* array of sessions */
-  uint32_t          session_size,   /* size of net_ses[] array */
-                    ping_idx;       /* ping peers */
+                 ** sessions;       /* array of sessions, live or free */
+  uint64_t        * live_map;       /* bit set for each live sessions[] id */
+  uint32_t          session_size,   /* size of sessions[] array */
+                    new_count,      /* live sessions with SESSION_NEW */
+                    restored_count, /* live sessions with SESSION_RESTORED */
+                    ping_needed,    /* live sessions with ping_ns zero */
+                    ping_idx,       /* next id to ping */
+                    free_word,      /* lowest live_map[] word with a free id */
+                    map_hi,         /* live_map[] words up to highest live id */
+                    chunk_cnt;      /* count of chunks[] */
+  AeronSessionChunk * chunks;       /* slabs that hold sessions[] */
+  bool              huge_pages;     /* map slabs with hugepages if avail */
   AeronSession      dummy_session;  /* a null session */
   uint64_t          last_check_ns;  /* last timeout check */
+  double            phi_threshold;  /* phi where session is suspect */
+  AeronBloom        peer_bloom;     /* union of session blooms */
+  bool              bloom_dirty,    /* if peer_bloom needs merge_bloom() */
+                    bloom_all;      /* a session without bloom, match all */
   MyPeers() noexcept;
 
-  static uint32_t hash( uint64_t stamp ) { /* hash of stamp */
-    return (uint32_t) stamp ^ (uint32_t) ( stamp >> 32 );
+  /* if any session may be subscribed to the subject or the prefixes */
+  bool maybe_pub( uint32_t h,  uint8_t prefix_cnt,  const uint32_t *hash ) {
+    if ( this->bloom_dirty )
+      this->merge_bloom();
+    return this->bloom_all ||
+           this->peer_bloom.maybe_pub( h, prefix_cnt, hash );
+  }
+  /* add sub hash to session bloom, until the next hello replaces it */
+  void add_bloom( AeronSession &session,  uint32_t h ) {
+    if ( session.has_bloom ) {
+      session.bloom.add( h );
+      this->peer_bloom.add( h );
+    }
+  }
+  void merge_bloom( void ) noexcept;
+  /* SESSION_NEW until the session pings me, which shows that it receives my
+     publication, subject ids are not used while any session is new */
+  void set_new( AeronSession &s ) {
+    if ( ! s.test( SESSION_NEW ) ) {
+      s.set( SESSION_NEW );
+      this->new_count++;
+    }
+  }
+  void clear_new( AeronSession &s ) {
+    if ( s.test( SESSION_NEW ) ) {
+      s.clear( SESSION_NEW );
+      this->new_count--;
+    }
+  }
+  /* SESSION_RESTORED until the replay of the session's subs confirms the
+     routes loaded from the snapshot */
+  void set_restored( AeronSession &s ) {
+    if ( ! s.test( SESSION_RESTORED ) ) {
+      s.set( SESSION_RESTORED );
+      this->restored_count++;
+    }
   }
-  /* find session and update last seqno seen */
+  void clear_restored( AeronSession &s ) {
+    if ( s.test( SESSION_RESTORED ) ) {
+      s.clear( SESSION_RESTORED );
+      this->restored_count--;
+    }
+  }
+
+  /* find session and update last seqno seen, recency is last_active only,
+     the list is not reordered per message */
   AeronSession *update_session( uint64_t stamp,  uint64_t seqno ) {
     if ( this->last_session->stamp == stamp )
       return this->update_last( seqno );
-    size_t   pos;
-    uint32_t h = hash( stamp ), id;
-    if ( this->session_idx->find( h, pos, id ) ) {
-      this->last_session = this->sessions[ id ];
-      while ( this->last_session->stamp != stamp ) {
-        this->last_session = this->last_session->next_id;
-        if ( this->last_session == NULL )
-          return this->new_session( stamp, seqno, h, pos, this->sessions[ id ]);
-      }
-      this->list.pop( this->last_session );
-      this->list.push_hd( this->last_session );
-      return this->update_last( seqno );
-    }
-    return this->new_session( stamp, seqno, h, pos, NULL );
+    AeronSession *s = this->session_tab.find( stamp );
+    if ( s == NULL )
+      return this->new_session( stamp, seqno );
+    this->last_session = s;
+    return this->update_last( seqno );
   }
   /* update the last_session seen */
   AeronSession *update_last( uint64_t seqno ) {
-    this->last_session->delta_seqno = seqno - this->last_session->last_seqno;
-    if ( this->last_session->delta_seqno != 1 )
-      this->last_session->set( SESSION_DATALOSS );
+    AeronSession & s = *this->last_session;
+    s.delta_seqno = seqno - s.last_seqno;
+    /* a restored session skipped the seqnos sent while I was not running,
+       the first frame is not a gap, its routes are kept and confirmed by
+       the replay of its subs which starts after this seqno */
+    if ( s.test( SESSION_RESTORED ) && s.resync_seqno == 0 )
+      s.resync_seqno = seqno;
+    else if ( s.delta_seqno != 1 )
+      s.set( SESSION_DATALOSS );
     else
-      this->last_session->clear( SESSION_TIMEOUT );
-    this->last_session->last_seqno = seqno; 
-    return this->last_session;
-  }
-  /* allocate new session and insert into session_idx[] */
-  AeronSession *new_session( uint64_t stamp,  uint64_t seqno,
-                             uint32_t h,  size_t pos,
-                             AeronSession *next_id ) noexcept;
+      s.clear( SESSION_TIMEOUT );
+    s.last_seqno = seqno;
+    return &s;
+  }
+  /* find session by stamp, without updating it */
+  AeronSession *find_session( uint64_t stamp ) {
+    return this->session_tab.find( stamp );
+  }
+  /* find or create session loaded from snapshot, mark it restored */
+  AeronSession *restore_session( uint64_t stamp,  uint64_t seqno ) noexcept;
+  /* allocate new session and insert into session_tab */
+  AeronSession *new_session( uint64_t stamp,  uint64_t seqno ) noexcept;
   /* unlink session and put on free list */
   void release_session( AeronSession &session ) noexcept;
-  /* check whether a session timed out */
-  AeronSession *check_timeout( uint64_t age_ns ) {
-    if ( age_ns > this->last_check_ns ) {
-      this->last_check_ns = age_ns;
-      if ( this->list.tl != NULL ) {
-        if ( this->list.tl->last_active < age_ns ) {
-          if ( this->list.tl->test( SESSION_TIMEOUT ) )
-            return this->list.tl;
-          this->list.tl->set( SESSION_TIMEOUT );
-        }
-      }
-    }
+  /* check whether a session timed out, phi accrual on hello arrivals with
+     max_ns as a ceiling, a session is returned after it is suspect twice */
+  AeronSession *check_timeout( uint64_t now_ns,  uint64_t max_ns ) noexcept;
+  /* session by id if it is live, for route ids */
+  AeronSession *get_session( uint32_t id ) const {
+    if ( id >= this->session_size ||
+         ( this->live_map[ id / 64 ] & ( (uint64_t) 1 << ( id % 64 ) ) ) == 0 )
+      return NULL;
+    return this->sessions[ id ];
+  }
+  /* a session not yet pinged, it needs a hello to send me its subs, new
+     sessions are at the head of the list, usually none are unpinged */
+  AeronSession *unpinged( void ) const {
+    if ( this->ping_needed == 0 )
+      return NULL;
+    for ( AeronSession *s = this->list.hd; s != NULL; s = s->next )
+      if ( s->ping_ns == 0 )
+        return s;
     return NULL;
   }
+  void set_pinged( AeronSession &s,  uint64_t now_ns ) {
+    if ( s.ping_ns == 0 )
+      this->ping_needed--;
+    s.ping_ns = now_ns;
+  }
+  /* round robin over live ids, skips a word of 64 ids at a time */
   uint64_t next_ping( void ) noexcept {
-    uint32_t j = this->ping_idx;
-    for ( uint32_t i = 0; i < this->session_size; i++ ) {
-      if ( j >= this->session_size )
-        j = 0;
-      if ( this->sessions[ j ] != NULL ) {
-        this->ping_idx = j + 1;
-        return this->sessions[ j ]->stamp;
-      }
-      j++;
+    if ( this->map_hi == 0 )
+      return 0;
+    uint32_t j = this->ping_idx, w;
+    if ( j >= this->map_hi * 64 )
+      j = 0;
+    w = j / 64;
+    uint64_t bits = this->live_map[ w ] & ( ~(uint64_t) 0 << ( j % 64 ) );
+    while ( bits == 0 ) {
+      if ( ++w == this->map_hi )
+        w = 0;
+      bits = this->live_map[ w ];
     }
-    return 0;
-  }
-  void print( void ) noexcept;
+    j = w * 64 + __builtin_ctzl( bits );
+    this->ping_idx = j + 1;
+    return this->sessions[ j ]->stamp;
+  }
+  /* pre-size the slab off the receive path, optionally with hugepages */
+  bool reserve( uint32_t count,  bool huge ) noexcept;
+  /* map a slab of at least count sessions, count is rounded up to 64 */
+  bool grow_sessions( uint32_t count ) noexcept;
+  void clear_live( uint32_t id ) noexcept;
+  void print( uint64_t now_ns ) noexcept;
+  /* one json object per session, for scripts */
+  void print_json( FILE *fp,  uint64_t now_ns ) noexcept;
   void release( void ) noexcept;
 };
 
@@ -375,13 +707,19 @@ struct MySubs {
   uint32_t        * subs;        /* array of subscription msgs */
   uint32_t          subs_free,   /* count of free message words */
                     subs_off,    /* end of subs[] words array */
-                    subs_size;   /* alloc words size of subs[] array */
+                    subs_size,   /* alloc words size of subs[] array */
+                    subs_gen,    /* incremented when subs change */
+                    bloom_gen,   /* subs_gen when bloom was built */
+                    gc_count;    /* incremented when subs[] is moved */
+  AeronBloom        bloom;       /* hashes of my subs, sent with hello */
   MySubs() noexcept;
   void gc( void ) noexcept;
   void upsert( kv::KvSubMsg &msg ) noexcept;
   void remove( kv::KvSubMsg &msg ) noexcept;
   void remove_pattern( kv::KvSubMsg &msg ) noexcept;
   uint32_t append( kv::KvSubMsg &msg ) noexcept;
+  /* bloom of hashes in subs[], rebuilt when subs change */
+  const AeronBloom &get_bloom( void ) noexcept;
   static uint32_t subs_align( uint32_t sz ) {
     return kv::align<uint32_t>( sz, 4 );
   }
@@ -389,6 +727,126 @@ struct MySubs {
   void release( void ) noexcept;
 };
 
+/* snapshot record types, replayed in order on startup */
+enum AeronSnapType {
+  AERON_SNAP_SUB       = 1, /* session subscribed to subject */
+  AERON_SNAP_UNSUB     = 2, /* session retired subject */
+  AERON_SNAP_PSUB      = 3, /* session subscribed to pattern */
+  AERON_SNAP_PUNSUB    = 4, /* session retired patterns matching prefix */
+  AERON_SNAP_DROP      = 5, /* session cleared of subs or released */
+  AERON_SNAP_MY_SUB    = 6, /* KvSubMsg upserted into my_subs */
+  AERON_SNAP_MY_UNSUB  = 7, /* KvSubMsg removed from my_subs */
+  AERON_SNAP_MY_PUNSUB = 8  /* pattern KvSubMsg removed from my_subs */
+};
+/* snapshot log record, aligned to 8 bytes */
+struct AeronSnapRec {
+  uint64_t stamp,      /* session stamp, zero for my_subs */
+           seqno;      /* last seqno of session when logged */
+  uint32_t hash,       /* hash of subject or pattern prefix */
+           len;        /* length of value[] */
+  uint16_t pref;       /* length of prefix, if pattern */
+  uint8_t  type,       /* AeronSnapType */
+           pad[ 5 ];
+  char     value[ 8 ]; /* subject, pattern + prefix or KvSubMsg */
+
+  static size_t alloc_size( uint32_t len ) {
+    return kv::align<size_t>( sizeof( AeronSnapRec ) - 8 + len, 8 );
+  }
+};
+/* snapshot file header, records follow */
+struct AeronSnapHdr {
+  uint64_t magic;      /* AERON_SNAP_MAGIC */
+  uint32_t version,    /* AERON_SNAP_VERSION */
+           hdr_size;   /* sizeof( AeronSnapHdr ), offset of first record */
+  uint64_t map_size,   /* size of file mapped */
+           end_off;    /* end of records written */
+};
+/* mmap file of subscription and peer state, log appended as routes change */
+struct AeronSnapshot {
+  char         * path,     /* file name */
+               * tmp_path; /* file name used while compacting */
+  AeronSnapHdr * hdr,      /* mapped file */
+               * old_hdr;  /* mapped file replaced by compact */
+  uint64_t       sync_off, /* end_off at the last sync() */
+                 sync_ns;  /* mono ns of the last sync() */
+  bool           loading;  /* true while replaying records */
+
+  void * operator new( size_t, void *ptr ) { return ptr; }
+  AeronSnapshot() : path( 0 ), tmp_path( 0 ), hdr( 0 ), old_hdr( 0 ),
+                    sync_off( 0 ), sync_ns( 0 ), loading( false ) {}
+  /* map file, create if not present, validate records present */
+  bool open( const char *fn,  size_t map_size ) noexcept;
+  /* append record, false if no space left */
+  bool append( AeronSnapType type,  uint64_t stamp,  uint64_t seqno,
+               uint32_t h,  const void *value,  uint32_t len,
+               uint16_t pref ) noexcept;
+  /* iterate records */
+  AeronSnapRec *first( void ) const {
+    return this->rec_at( this->hdr->hdr_size );
+  }
+  AeronSnapRec *next( AeronSnapRec *rec ) const {
+    return this->rec_at( (char *) (void *) rec - (char *) (void *) this->hdr +
+                         AeronSnapRec::alloc_size( rec->len ) );
+  }
+  AeronSnapRec *rec_at( uint64_t off ) const {
+    if ( off >= this->hdr->end_off )
+      return NULL;
+    return (AeronSnapRec *) (void *) &((char *) (void *) this->hdr)[ off ];
+  }
+  size_t map_size( void ) const { return this->hdr->map_size; }
+  size_t used( void ) const     { return this->hdr->end_off; }
+  /* start a new log in a tmp file, records are appended to it */
+  bool begin_compact( size_t map_size ) noexcept;
+  /* rename the tmp file to replace the old log */
+  void end_compact( void ) noexcept;
+  /* unmap the tmp file, keep the old log */
+  void abort_compact( void ) noexcept;
+  /* write the records appended since the last sync, then the header */
+  void sync( void ) noexcept;
+  void close( void ) noexcept;
+  static AeronSnapHdr *map_file( const char *fn,  size_t map_size,
+                                 bool create ) noexcept;
+  static void unmap_file( AeronSnapHdr *h ) noexcept;
+};
+
+/* an image of the subscription, one for each publisher session */
+struct AeronImage {
+  aeron_subscription_t * subscription; /* retained by, before sub is set */
+  aeron_image_t        * image;
+  int32_t                session_id;
+};
+
+/* resumed by EvAeron when the send queue drains or when a message arrives
+ * from the network, the awaitables of ev_aeron_coro.h are built on this */
+enum AeronWaitState {
+  AERON_WAIT_IDLE      = 0,
+  AERON_WAIT_PENDING   = 1,
+  AERON_WAIT_READY     = 2,
+  AERON_WAIT_CANCELLED = 3  /* bridge released while waiting */
+};
+struct AeronWaiter {
+  AeronWaiter   * next;
+  const char    * sub;    /* subject of message wait, NULL for send wait */
+  uint16_t        sublen;
+  uint32_t        h;      /* hash of sub */
+  int             state;  /* AeronWaitState */
+  kv::EvPublish * pub;    /* message matched, valid until on_wake() returns */
+  AeronWaiter() : next( 0 ), sub( 0 ), sublen( 0 ), h( 0 ),
+                  state( AERON_WAIT_IDLE ), pub( 0 ) {}
+  virtual void on_wake( void ) noexcept = 0;
+};
+/* free lists of frame sized blocks, size classes of 64 bytes, larger are
+ * malloced, each block is prefixed by the pool so delete can find it */
+struct AeronFramePool {
+  static const size_t FRAME_ALIGN   = 64,
+                      FRAME_CLASSES = 32; /* up to 2048 bytes pooled */
+  void * free_list[ FRAME_CLASSES ];
+  AeronFramePool() { ::memset( this->free_list, 0, sizeof( this->free_list ) ); }
+  void * alloc( size_t sz ) noexcept;
+  static void free( void *p,  size_t sz ) noexcept;
+  void release( void ) noexcept;
+};
+
 struct AeronSvcId {
   uint32_t pub_if,  sub_if;
   uint16_t pub_svc, sub_svc;
@@ -399,24 +857,50 @@ struct EvAeron : public kv::EvSocket, public kv::KvSendQueue,
   enum {
     AE_FLAG_INIT         = 1,
     AE_FLAG_SHUTDOWN     = 2,
-    AE_FLAG_BACKPRESSURE = 4
+    AE_FLAG_BACKPRESSURE = 4,
+    AE_FLAG_SUBJ_ID      = 8  /* send subject ids instead of subjects */
   };
 
   aeron_context_t                * context;
   aeron_t                        * aeron;
   aeron_client_conductor_t       * conductor;
-  aeron_publication_t            * pub;
+  aeron_exclusive_publication_t  * pub;
   aeron_subscription_t           * sub;
   aeron_fragment_assembler_t     * fragment_asm;
-  aeron_async_add_publication_t  * async_pub;
+  aeron_async_add_exclusive_publication_t
+                                 * async_pub;
   aeron_async_add_subscription_t * async_sub;
+  AeronImage                     * images;      /* images polled */
+  uint32_t                         image_count,
+                                   image_size;
+  int32_t                          pub_session_id; /* my image, not polled */
   AeronSubMap                      sub_tab;     /* active subscriptions */
   AeronPatternSubMap               pat_sub_tab; /* active wildcards */
   MyPeers                          my_peers;
   MySubs                           my_subs;
+  AeronSnapshot                  * snap;        /* warm restart state */
+  AeronSubMap                      resync_tab,  /* restored subs confirmed */
+                                   resync_pat_tab; /* and patterns */
+  uint32_t                         replay_off,  /* next my_subs.subs[] sent */
+                                   replay_left, /* words of subs[] to send */
+                                   replay_gc,   /* my_subs.gc_count at start */
+                                   replay_budget; /* subs sent per poll */
+  uint64_t                         replay_start;/* first seqno of the cycle,
+                                                   zero if no end is owed */
+  const char                     * stats_path;  /* session stats json file */
+  AeronWaiter                    * send_wait,   /* woken when sendq drains */
+                                 * msg_wait;    /* woken by subject match */
+  AeronFramePool                   frame_pool;  /* coroutine frames */
+  kv::RouteVec<AeronSubjRoute>     subj_tab;    /* subject ids sent */
+  uint32_t                         next_subj_id;
+  uint16_t                         subj_epoch;  /* incr when subj_tab reset */
   uint64_t                         next_timer_id,
                                    timer_id,
-                                   cur_mono_ns;
+                                   cur_mono_ns,
+                                   send_ns,     /* stamp of msgs sent */
+                                   last_send_ns,/* mono ns of last write */
+                                   last_hb_ns,  /* mono ns of last hello */
+                                   stats_ns;    /* when stats last written */
   uint32_t                         max_payload_len,
                                    timer_count,
                                    shutdown_count,
@@ -449,6 +933,10 @@ struct EvAeron : public kv::EvSocket, public kv::KvSendQueue,
                     const char *sub_channel,  int sub_stream_id ) noexcept;
   bool finish_init( void ) noexcept;
   void release_aeron( void ) noexcept;
+  bool add_image( aeron_subscription_t *subscription,  aeron_image_t *image,
+                  int32_t session_id ) noexcept;
+  void remove_image( aeron_image_t *image ) noexcept;
+  void release_images( void ) noexcept;
   static void poll_handler( void *clientd,  const uint8_t *buffer,
                             size_t length,  aeron_header_t *header );
   void on_poll_handler( const uint8_t *buffer,  size_t length,
@@ -467,13 +955,61 @@ struct EvAeron : public kv::EvSocket, public kv::KvSendQueue,
                     uint32_t src_fd,  uint32_t rcnt,  char src_type ) noexcept;
   virtual void on_connect( void ) noexcept;
 
+  void add_sub( AeronSession &session,  uint32_t h,  const char *sub,
+                uint16_t sublen,  const char *rep,  uint16_t replen ) noexcept;
+  void rem_sub( AeronSession &session,  uint32_t h,  const char *sub,
+                uint16_t sublen,  bool retired ) noexcept;
+  void add_psub( AeronSession &session,  uint32_t h,  const char *value,
+                 uint16_t len,  uint16_t pref ) noexcept;
+  void rem_psub( AeronSession &session,  uint32_t h,  const char *prefix,
+                 uint16_t preflen ) noexcept;
+  /* load snapshot from path and replay it, then log route changes to it */
+  bool open_snapshot( const char *path ) noexcept;
+  void close_snapshot( void ) noexcept;
+  void snap_log( AeronSnapType type,  AeronSession *session,  uint32_t h,
+                 const void *value,  uint32_t len,  uint16_t pref ) noexcept;
+  void snap_replay( AeronSnapRec &rec ) noexcept;
+  bool snap_state( void ) noexcept;
+  void compact_snapshot( void ) noexcept;
+  void send_hello( uint64_t peer ) noexcept;
+  bool publish_subj_id( kv::EvPublish &pub ) noexcept;
+  void on_pub_id( AeronSession &session,  const uint8_t *buffer,
+                  size_t length ) noexcept;
+  void reset_subj_ids( void ) noexcept;
+  /* start or extend the shared replay of my subs for a new peer */
   void publish_my_subs( void ) noexcept;
+  /* send the next replay_budget subs of the replay */
+  void replay_my_subs( void ) noexcept;
+  /* stop confirming the restored routes of session, the routes that were
+     not confirmed are removed if prune */
+  void end_resync( AeronSession &session,  bool prune ) noexcept;
+  void prune_restored( AeronSession &session ) noexcept;
+  void purge_resync( AeronSubMap &tab,  uint32_t id ) noexcept;
+  /* prune the restored sessions whose replay end was not recvd */
+  void check_resync( void ) noexcept;
   void send_dataloss( AeronSession &session ) noexcept;
   void clear_session( AeronSession &session ) noexcept;
   void clear_subs( AeronSession &session ) noexcept;
   void clear_pattern_subs( AeronSession &session ) noexcept;
   void clear_all_subs( void ) noexcept;
   void print_stats( void ) noexcept;
+  /* write session stats to stats_path, renamed into place */
+  void write_stats( void ) noexcept;
+  /* publish to peers without a local route, sent to all, the receivers
+   * route it, the message is copied to the sendq, false if the publication
+   * is not connected */
+  bool publish( const char *sub,  uint16_t sublen,  const char *reply,
+                uint16_t replylen,  const void *msg,  size_t msg_len,
+                uint8_t msg_enc ) noexcept;
+  /* advertise a subject to peers for message waits, like a local sub */
+  void subscribe( const char *sub,  uint16_t sublen ) noexcept;
+  void unsubscribe( const char *sub,  uint16_t sublen ) noexcept;
+  void wait_send( AeronWaiter &w ) noexcept;
+  void wait_msg( AeronWaiter &w,  const char *sub,  uint16_t sublen ) noexcept;
+  void cancel_wait( AeronWaiter &w ) noexcept;
+  void notify_send( void ) noexcept;
+  void notify_msg( kv::EvPublish &pub ) noexcept;
+  void cancel_all_waits( void ) noexcept;
   void start_shutdown( void ) noexcept;
   bool check_shutdown( void ) noexcept;
 };
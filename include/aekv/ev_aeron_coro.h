@@ -0,0 +1,135 @@
+#ifndef __rai_aekv__ev_aeron_coro_h__
+#define __rai_aekv__ev_aeron_coro_h__
+
+/* C++20 coroutines on EvAeron, they are resumed by the EvPoll thread from
+ * the send and recv paths of the bridge, no threads or stacks are used,
+ * this header needs -std=c++20, the rest of aekv builds with c++11 */
+#if __cplusplus >= 202002L && __has_include( <coroutine> )
+#include <stdlib.h>
+#include <coroutine>
+#include <aekv/ev_aeron.h>
+#include <raikv/ev_publish.h>
+
+namespace rai {
+namespace aekv {
+
+/* a detached task, runs when called until the first wait and is freed when
+ * done, the first parameter must be the EvAeron which allocates the frame,
+ * test/aeron_coro.cpp builds this:
+ *
+ *   AeronTask echo( EvAeron &ae ) {
+ *     for (;;) {
+ *       kv::EvPublish * m = co_await AeronNextMsg( ae, "ECHO", 4 );
+ *       if ( m == NULL )
+ *         break;
+ *       co_await AeronOffer( ae, (const char *) m->reply, m->reply_len,
+ *                            m->msg, m->msg_len, m->msg_enc );
+ *     }
+ *   }
+ */
+struct AeronTask {
+  struct promise_type {
+    template <class... Args>
+    static void *operator new( size_t sz,  EvAeron &ae,  Args &... ) noexcept {
+      return ae.frame_pool.alloc( sz );
+    }
+    static void operator delete( void *p,  size_t sz ) noexcept {
+      AeronFramePool::free( p, sz );
+    }
+    static AeronTask get_return_object_on_allocation_failure( void ) noexcept {
+      return AeronTask();
+    }
+    AeronTask get_return_object( void ) noexcept { return AeronTask(); }
+    std::suspend_never initial_suspend( void ) noexcept { return {}; }
+    std::suspend_never final_suspend( void ) noexcept { return {}; }
+    void return_void( void ) noexcept {}
+    void unhandled_exception( void ) noexcept { ::abort(); }
+  };
+};
+
+/* queue a publish, the subject, reply and msg are copied to the sendq when
+ * constructed, so they may point into a message of AeronNextMsg, then
+ * suspends until the publication is not back pressured, true if queued,
+ * false when not connected or the bridge was released */
+struct AeronOffer : public AeronWaiter {
+  EvAeron                & ae;
+  bool                     queued;
+  std::coroutine_handle<>  co;
+
+  AeronOffer( EvAeron &a,  const char *s,  uint16_t sl,  const void *m,
+              size_t ml,  uint8_t enc,  const char *r = NULL,
+              uint16_t rl = 0 ) noexcept
+    : ae( a ), queued( a.publish( s, sl, r, rl, m, ml, enc ) ) {}
+
+  bool await_ready( void ) const noexcept {
+    return ! this->queued ||
+           ! this->ae.test_ae( EvAeron::AE_FLAG_BACKPRESSURE );
+  }
+  void await_suspend( std::coroutine_handle<> h ) noexcept {
+    this->co = h;
+    this->ae.wait_send( *this );
+  }
+  bool await_resume( void ) const noexcept {
+    return this->queued && this->state != AERON_WAIT_CANCELLED;
+  }
+  /* woken after each write, wait again while still back pressured */
+  virtual void on_wake( void ) noexcept {
+    if ( this->state != AERON_WAIT_CANCELLED &&
+         this->ae.test_ae( EvAeron::AE_FLAG_BACKPRESSURE ) )
+      this->ae.wait_send( *this );
+    else
+      this->co.resume();
+  }
+};
+
+/* the next message recvd from peers on subject, the subject must be
+ * subscribed by a local route or by EvAeron::subscribe(), the message is
+ * valid until the coroutine waits again, NULL when the bridge is released */
+struct AeronNextMsg : public AeronWaiter {
+  EvAeron                & ae;
+  std::coroutine_handle<>  co;
+
+  AeronNextMsg( EvAeron &a,  const char *s,  uint16_t sl ) noexcept : ae( a ) {
+    this->sub    = s;
+    this->sublen = sl;
+  }
+  bool await_ready( void ) const noexcept { return false; }
+  void await_suspend( std::coroutine_handle<> h ) noexcept {
+    this->co = h;
+    this->ae.wait_msg( *this, this->sub, this->sublen );
+  }
+  kv::EvPublish *await_resume( void ) const noexcept { return this->pub; }
+  virtual void on_wake( void ) noexcept { this->co.resume(); }
+};
+
+/* publish with inbox as the reply and wait for the first message on inbox,
+ * the inbox is subscribed once with EvAeron::subscribe() and reused, NULL
+ * when not connected or the bridge is released, there is no timeout */
+struct AeronRequest : public AeronNextMsg {
+  const char * subject;
+  uint16_t     subject_len;
+  const void * msg;
+  size_t       msg_len;
+  uint8_t      msg_enc;
+
+  AeronRequest( EvAeron &a,  const char *s,  uint16_t sl,  const char *inbox,
+                uint16_t inbox_len,  const void *m,  size_t ml,
+                uint8_t enc ) noexcept
+    : AeronNextMsg( a, inbox, inbox_len ), subject( s ), subject_len( sl ),
+      msg( m ), msg_len( ml ), msg_enc( enc ) {}
+
+  bool await_suspend( std::coroutine_handle<> h ) noexcept {
+    this->co = h;
+    if ( ! this->ae.publish( this->subject, this->subject_len, this->sub,
+                             this->sublen, this->msg, this->msg_len,
+                             this->msg_enc ) )
+      return false; /* resume now, pub is NULL */
+    this->ae.wait_msg( *this, this->sub, this->sublen );
+    return true;
+  }
+};
+
+}
+}
+#endif
+#endif
@@ -0,0 +1,104 @@
+#ifndef __rai_aekv__ev_aeron_driver_h__
+#define __rai_aekv__ev_aeron_driver_h__
+
+extern "C" {
+typedef struct aeron_driver_stct         aeron_driver_t;
+typedef struct aeron_driver_context_stct aeron_driver_context_t;
+}
+
+#include <pthread.h>
+#include <raikv/ev_net.h>
+
+namespace rai {
+namespace aekv {
+
+struct EvAeron;
+struct EvAeronDriver;
+
+/* a driver udp socket in the EvPoll epoll set, readable runs the duty cycle,
+ * the driver owns the fd, it is not closed when removed, the ring fd of a
+ * uring poller is shared by its transports */
+struct EvAeronUdp : public kv::EvSocket {
+  EvAeronDriver & drv;
+  EvAeronUdp    * next; /* free list, removed socks are reused */
+  uint32_t        refs; /* transports using the fd */
+
+  void * operator new( size_t, void *ptr ) { return ptr; }
+  EvAeronUdp( kv::EvPoll &p,  uint8_t st,  EvAeronDriver &d ) noexcept
+    : kv::EvSocket( p, st ), drv( d ), next( 0 ), refs( 0 ) {}
+  /* EvSocket */
+  virtual void write( void ) noexcept final;
+  virtual void read( void ) noexcept final;
+  virtual void process( void ) noexcept final;
+  virtual void release( void ) noexcept final;
+};
+
+/* media driver hosted in process, shared threading mode with the duty cycle
+ * run by an EvPoll timer or by a thread, optionally pinned to a cpu, it must
+ * be started before EvAeron::start_aeron() so the client finds the cnc file */
+struct EvAeronDriver : public kv::EvSocket {
+  enum {
+    DRV_FLAG_RUNNING  = 1, /* driver started */
+    DRV_FLAG_THREAD   = 2, /* duty cycle on thr instead of the poll timer */
+    DRV_FLAG_STOP     = 4, /* termination hook or close, duty cycle ends */
+    DRV_FLAG_SHUTDOWN = 8  /* waiting for client to release before close */
+  };
+  aeron_driver_context_t * context;
+  aeron_driver_t         * driver;
+  EvAeron                * client;        /* closed before the driver */
+  EvAeronUdp            ** udp_tab;       /* transport fd -> udp sock */
+  EvAeronUdp             * udp_free;      /* removed udp socks */
+  uint32_t                 udp_size,      /* size of udp_tab[] */
+                           udp_count;     /* udp socks in poll */
+  uint8_t                  udp_sock_type;
+  pthread_t                thr;
+  int                      cpu;           /* thr affinity, -1 is any cpu */
+  uint64_t                 next_timer_id,
+                           timer_id,
+                           work_count,    /* duty cycles with work done */
+                           idle_count,    /* duty cycles without work */
+                           poll_us,       /* poll timer interval */
+                           max_poll_us;   /* idle limit, conductor timers */
+  uint32_t                 shutdown_count;
+  volatile uint32_t        drv_flags;
+
+  uint32_t test_drv( uint32_t fl ) const { return this->drv_flags & fl; }
+  void set_drv( uint32_t fl )   { __sync_fetch_and_or( &this->drv_flags, fl ); }
+  void clear_drv( uint32_t fl ) { __sync_fetch_and_and( &this->drv_flags, ~fl ); }
+
+  void * operator new( size_t, void *ptr ) { return ptr; }
+  EvAeronDriver( kv::EvPoll &p ) noexcept;
+  static EvAeronDriver *create_driver( kv::EvPoll &p ) noexcept;
+  /* dir NULL uses AERON_DIR or the default, use_thread runs the duty cycle
+     on a thread pinned to cpu when cpu >= 0, otherwise from the poll timer */
+  bool start_driver( const char *dir,  bool use_thread,  int cpu ) noexcept;
+  /* one duty cycle of the conductor, sender and receiver */
+  int  do_work( void ) noexcept;
+  /* duty cycles until idle or DRIVER_WORK_LIMIT, returns those with work */
+  uint32_t run_work( void ) noexcept;
+  /* replace the poll timer when the interval changes */
+  void set_poll_interval( uint64_t us ) noexcept;
+  /* the "evpoll" udp transport bindings, used in poll mode, which wrap the
+     media transport poller and add each transport fd to this->poll, or the
+     ring fd of an aekv_udp_uring poller, all removes the fd for any refs */
+  bool add_udp( int fd ) noexcept;
+  void remove_udp( int fd,  bool all = false ) noexcept;
+  void release_udp( void ) noexcept;
+  void stop_thread( void ) noexcept;
+  void release_driver( void ) noexcept;
+  static void *thread_main( void *me ) noexcept;
+  static void termination_hook( void *me );
+
+  /* EvSocket */
+  virtual void write( void ) noexcept final;
+  virtual void read( void ) noexcept final;
+  virtual void process( void ) noexcept final;
+  virtual void release( void ) noexcept final;
+  virtual bool timer_expire( uint64_t timer_id, uint64_t event_id ) noexcept;
+  virtual void process_shutdown( void ) noexcept final;
+  virtual void process_close( void ) noexcept final;
+};
+
+}
+}
+#endif
@@ -0,0 +1,391 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <aekv/ev_aeron.h>
+
+using namespace rai;
+using namespace aekv;
+using namespace kv;
+
+static const uint64_t AERON_SNAP_MAGIC   = 0x70616e73766b6561ULL; /* aekvsnap */
+static const uint32_t AERON_SNAP_VERSION = 1;
+static const size_t   AERON_SNAP_SIZE    = 16 * 1024 * 1024; /* initial size */
+
+/* map the snapshot file, create or truncate if create is true */
+AeronSnapHdr *
+AeronSnapshot::map_file( const char *fn,  size_t map_size,
+                         bool create ) noexcept
+{
+  struct stat st;
+  void * p;
+  int    fd = ::open( fn, O_RDWR | O_CREAT | ( create ? O_TRUNC : 0 ), 0666 );
+
+  if ( fd < 0 ) {
+    perror( fn );
+    return NULL;
+  }
+  if ( ::fstat( fd, &st ) != 0 ) {
+    perror( fn );
+    ::close( fd );
+    return NULL;
+  }
+  /* existing file is mapped at the size it was written */
+  if ( (size_t) st.st_size >= sizeof( AeronSnapHdr ) )
+    map_size = st.st_size;
+  else if ( ::ftruncate( fd, map_size ) != 0 ) {
+    perror( fn );
+    ::close( fd );
+    return NULL;
+  }
+  p = ::mmap( NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+  ::close( fd );
+  if ( p == MAP_FAILED ) {
+    perror( "mmap snapshot" );
+    return NULL;
+  }
+  AeronSnapHdr * h = (AeronSnapHdr *) p;
+  if ( h->magic != AERON_SNAP_MAGIC || h->version != AERON_SNAP_VERSION ||
+       h->hdr_size != sizeof( AeronSnapHdr ) || h->map_size != map_size ||
+       h->end_off < h->hdr_size || h->end_off > map_size ) {
+    if ( h->magic != 0 )
+      fprintf( stderr, "snapshot %s invalid, reset\n", fn );
+    h->magic    = AERON_SNAP_MAGIC;
+    h->version  = AERON_SNAP_VERSION;
+    h->hdr_size = sizeof( AeronSnapHdr );
+    h->map_size = map_size;
+    h->end_off  = sizeof( AeronSnapHdr );
+  }
+  return h;
+}
+
+void
+AeronSnapshot::unmap_file( AeronSnapHdr *h ) noexcept
+{
+  if ( h != NULL ) {
+    size_t sz = h->map_size;
+    ::msync( h, sz, MS_ASYNC );
+    ::munmap( h, sz );
+  }
+}
+/* open and check records, truncate the log at the first one invalid */
+bool
+AeronSnapshot::open( const char *fn,  size_t map_size ) noexcept
+{
+  size_t len = ::strlen( fn );
+  this->path = (char *) ::malloc( len * 2 + 6 );
+  if ( this->path == NULL )
+    return false;
+  this->tmp_path = &this->path[ len + 1 ];
+  ::memcpy( this->path, fn, len + 1 );
+  ::memcpy( this->tmp_path, fn, len );
+  ::memcpy( &this->tmp_path[ len ], ".tmp", 5 );
+
+  if ( (this->hdr = map_file( fn, map_size, false )) == NULL )
+    return false;
+  uint64_t off = this->hdr->hdr_size;
+  while ( off < this->hdr->end_off ) {
+    AeronSnapRec * rec = this->rec_at( off );
+    if ( off + sizeof( AeronSnapRec ) > this->hdr->end_off ||
+         off + AeronSnapRec::alloc_size( rec->len ) > this->hdr->end_off ||
+         rec->type < AERON_SNAP_SUB || rec->type > AERON_SNAP_MY_PUNSUB ||
+         ( rec->type < AERON_SNAP_MY_SUB && rec->len > 0xffff ) ) {
+      fprintf( stderr, "snapshot %s truncated at %lu\n", fn, off );
+      this->hdr->end_off = off;
+      break;
+    }
+    off += AeronSnapRec::alloc_size( rec->len );
+  }
+  return true;
+}
+
+bool
+AeronSnapshot::append( AeronSnapType type,  uint64_t stamp,  uint64_t seqno,
+                       uint32_t h,  const void *value,  uint32_t len,
+                       uint16_t pref ) noexcept
+{
+  uint64_t off = this->hdr->end_off,
+           sz  = AeronSnapRec::alloc_size( len );
+  if ( off + sz > this->hdr->map_size )
+    return false;
+  AeronSnapRec * rec = (AeronSnapRec *) (void *)
+                       &((char *) (void *) this->hdr)[ off ];
+  rec->stamp = stamp;
+  rec->seqno = seqno;
+  rec->hash  = h;
+  rec->len   = len;
+  rec->pref  = pref;
+  rec->type  = (uint8_t) type;
+  ::memset( rec->pad, 0, sizeof( rec->pad ) );
+  if ( len > 0 )
+    ::memcpy( rec->value, value, len );
+  /* record is complete before it is included in the log */
+  __atomic_store_n( &this->hdr->end_off, off + sz, __ATOMIC_RELEASE );
+  return true;
+}
+/* switch appends to a new file, old log is kept until end_compact() */
+bool
+AeronSnapshot::begin_compact( size_t map_size ) noexcept
+{
+  AeronSnapHdr * h = map_file( this->tmp_path, map_size, true );
+  if ( h == NULL )
+    return false;
+  this->old_hdr = this->hdr;
+  this->hdr     = h;
+  return true;
+}
+
+/* the new log is on disk before it replaces the old one */
+void
+AeronSnapshot::end_compact( void ) noexcept
+{
+  this->sync_off = 0;
+  this->sync();
+  if ( ::rename( this->tmp_path, this->path ) != 0 )
+    perror( this->path );
+  unmap_file( this->old_hdr );
+  this->old_hdr = NULL;
+}
+
+void
+AeronSnapshot::abort_compact( void ) noexcept
+{
+  unmap_file( this->hdr );
+  ::unlink( this->tmp_path );
+  this->hdr     = this->old_hdr;
+  this->old_hdr = NULL;
+}
+
+/* records are synced before end_off, so a crash between the two leaves
+   the log at the previous end, open() truncates a partial record */
+void
+AeronSnapshot::sync( void ) noexcept
+{
+  uint64_t end = this->hdr->end_off;
+  if ( end == this->sync_off )
+    return;
+  uint64_t pgsz = (uint64_t) ::sysconf( _SC_PAGESIZE ),
+           off  = this->sync_off & ~( pgsz - 1 );
+  char   * base = (char *) (void *) this->hdr;
+  if ( ::msync( &base[ off ], end - off, MS_SYNC ) != 0 ||
+       ( off != 0 && ::msync( base, pgsz, MS_SYNC ) != 0 ) )
+    perror( "msync snapshot" );
+  this->sync_off = end;
+}
+
+void
+AeronSnapshot::close( void ) noexcept
+{
+  if ( this->old_hdr != NULL )
+    this->abort_compact();
+  if ( this->hdr != NULL )
+    this->sync();
+  unmap_file( this->hdr );
+  this->hdr = NULL;
+  if ( this->path != NULL )
+    ::free( this->path );
+  this->path = this->tmp_path = NULL;
+}
+/* find or create a session from a snapshot record */
+AeronSession *
+MyPeers::restore_session( uint64_t stamp,  uint64_t seqno ) noexcept
+{
+  AeronSession * s = this->find_session( stamp );
+  if ( s == NULL ) {
+    s = this->update_session( stamp, seqno );
+    if ( s == NULL )
+      return NULL;
+  }
+  s->last_seqno = seqno;
+  s->clear( SESSION_DATALOSS );
+  /* still NEW, my subs are published when it pings me, its routes are
+     confirmed by the replay of its subs */
+  this->set_restored( *s );
+  return s;
+}
+/* load the snapshot, replay it into the route tables and rewrite it */
+bool
+EvAeron::open_snapshot( const char *path ) noexcept
+{
+  void * m = ::malloc( sizeof( AeronSnapshot ) );
+  if ( m == NULL ) {
+    perror( "alloc snapshot" );
+    return false;
+  }
+  this->snap = new ( m ) AeronSnapshot();
+  if ( ! this->snap->open( path, AERON_SNAP_SIZE ) ) {
+    this->close_snapshot();
+    return false;
+  }
+  this->cur_mono_ns = kv_current_monotonic_coarse_ns();
+  this->snap->loading = true;
+  for ( AeronSnapRec *rec = this->snap->first(); rec != NULL;
+        rec = this->snap->next( rec ) )
+    this->snap_replay( *rec );
+  this->snap->loading = false;
+  printf( "snapshot %s: %lu bytes, restored %u sessions, %lu subs, "
+          "%lu psubs\n", path, this->snap->used(),
+          this->my_peers.session_tab.count, this->sub_tab.sub_count(),
+          this->pat_sub_tab.sub_count() );
+  /* drop the history, only the current state is needed */
+  this->compact_snapshot();
+  return this->snap != NULL;
+}
+
+void
+EvAeron::close_snapshot( void ) noexcept
+{
+  if ( this->snap != NULL ) {
+    this->snap->close();
+    ::free( this->snap );
+    this->snap = NULL;
+  }
+}
+/* append a route change to the log, compact if full */
+void
+EvAeron::snap_log( AeronSnapType type,  AeronSession *session,  uint32_t h,
+                   const void *value,  uint32_t len,  uint16_t pref ) noexcept
+{
+  if ( this->snap == NULL || this->snap->loading )
+    return;
+  uint64_t stamp = 0, seqno = 0;
+  if ( session != NULL ) {
+    stamp = session->stamp;
+    seqno = session->last_seqno;
+  }
+  if ( this->snap->append( type, stamp, seqno, h, value, len, pref ) )
+    return;
+  /* the current state is written by compact, which includes this change */
+  this->compact_snapshot();
+}
+/* apply a record loaded from the log */
+void
+EvAeron::snap_replay( AeronSnapRec &rec ) noexcept
+{
+  AeronSession * session = NULL;
+  KvSubMsg     & msg     = *(KvSubMsg *) (void *) rec.value;
+
+  switch ( rec.type ) {
+    case AERON_SNAP_SUB:
+    case AERON_SNAP_UNSUB:
+    case AERON_SNAP_PSUB:
+    case AERON_SNAP_PUNSUB:
+      session = this->my_peers.restore_session( rec.stamp, rec.seqno );
+      if ( session == NULL )
+        return;
+      session->last_active = this->cur_mono_ns;
+      break;
+    case AERON_SNAP_MY_SUB:
+    case AERON_SNAP_MY_UNSUB:
+    case AERON_SNAP_MY_PUNSUB:
+      if ( ! msg.is_valid( rec.len ) )
+        return;
+      break;
+    default:
+      break;
+  }
+  switch ( rec.type ) {
+    case AERON_SNAP_SUB:
+      this->add_sub( *session, rec.hash, rec.value, rec.len, NULL, 0 );
+      break;
+    case AERON_SNAP_UNSUB:
+      this->rem_sub( *session, rec.hash, rec.value, rec.len, true );
+      break;
+    case AERON_SNAP_PSUB:
+      this->add_psub( *session, rec.hash, rec.value, rec.len, rec.pref );
+      break;
+    case AERON_SNAP_PUNSUB:
+      this->rem_psub( *session, rec.hash, rec.value, rec.pref );
+      break;
+    case AERON_SNAP_DROP:
+      if ( (session = this->my_peers.find_session( rec.stamp )) != NULL ) {
+        this->clear_session( *session );
+        this->my_peers.release_session( *session );
+      }
+      break;
+    case AERON_SNAP_MY_SUB:
+      this->my_subs.upsert( msg );
+      break;
+    case AERON_SNAP_MY_UNSUB:
+      this->my_subs.remove( msg );
+      break;
+    case AERON_SNAP_MY_PUNSUB:
+      this->my_subs.remove_pattern( msg );
+      break;
+    default:
+      break;
+  }
+}
+/* write the current state of the route tables to the log */
+bool
+EvAeron::snap_state( void ) noexcept
+{
+  AeronSubRoutePos        pos;
+  AeronPatternSubRoutePos ppos;
+  uint32_t              * routes, rcnt, i;
+  AeronSession          * s;
+
+  if ( this->sub_tab.first( pos ) ) {
+    do {
+      CodeRef * p = NULL;
+      rcnt = this->sub_tab.zip.decompress_routes( pos.rt->sub, routes, p );
+      for ( i = 0; i < rcnt; i++ ) {
+        if ( (s = this->my_peers.get_session( routes[ i ] )) == NULL )
+          continue;
+        if ( ! this->snap->append( AERON_SNAP_SUB, s->stamp, s->last_seqno,
+                                   pos.rt->hash, pos.rt->value, pos.rt->len,
+                                   0 ) )
+          return false;
+      }
+    } while ( this->sub_tab.next( pos ) );
+  }
+  if ( this->pat_sub_tab.first( ppos ) ) {
+    do {
+      CodeRef * p = NULL;
+      rcnt = this->pat_sub_tab.zip.decompress_routes( ppos.rt->sub, routes, p );
+      for ( i = 0; i < rcnt; i++ ) {
+        if ( (s = this->my_peers.get_session( routes[ i ] )) == NULL )
+          continue;
+        if ( ! this->snap->append( AERON_SNAP_PSUB, s->stamp, s->last_seqno,
+                                   ppos.rt->hash, ppos.rt->value, ppos.rt->len,
+                                   ppos.rt->pref ) )
+          return false;
+      }
+    } while ( this->pat_sub_tab.next( ppos ) );
+  }
+  i = 0;
+  while ( i < this->my_subs.subs_off ) {
+    KvSubMsg &scan = *(KvSubMsg *) (void *) &this->my_subs.subs[ i + 1 ];
+    if ( scan.sublen != 0 ) {
+      if ( ! this->snap->append( AERON_SNAP_MY_SUB, 0, 0, scan.hash, &scan,
+                                 scan.size, 0 ) )
+        return false;
+    }
+    i += MySubs::subs_align( scan.size ) / sizeof( uint32_t ) + 1;
+  }
+  return true;
+}
+/* rewrite the log with the current state, grow it if more than half full */
+void
+EvAeron::compact_snapshot( void ) noexcept
+{
+  size_t sz = this->snap->map_size();
+  for (;;) {
+    if ( ! this->snap->begin_compact( sz ) ) {
+      fprintf( stderr, "snapshot disabled\n" );
+      this->close_snapshot();
+      return;
+    }
+    if ( this->snap_state() && this->snap->used() <= sz / 2 ) {
+      this->snap->end_compact();
+      return;
+    }
+    this->snap->abort_compact();
+    sz *= 2;
+  }
+}
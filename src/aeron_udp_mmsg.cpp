@@ -0,0 +1,355 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <aekv/aeron_udp.h>
+extern "C" {
+#ifdef __GNUC__
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+#endif
+#include <aeronmd.h>
+#include "media/aeron_udp_channel_transport.h"
+#include "media/aeron_udp_transport_poller.h"
+#include "media/aeron_udp_channel_transport_bindings.h"
+#ifdef __GNUC__
+#pragma GCC diagnostic pop
+#endif
+}
+
+/* older libc headers */
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+
+/* datagrams per recvmmsg(), a gro buffer holds up to 64k of segments */
+static const size_t MMSG_RECV_BATCH = 32,
+                    MMSG_BUF_SIZE   = 64 * 1024,
+/* the kernel limits a gso send to 64 segments and a 64k payload */
+                    MMSG_GSO_SEGS   = 64,
+                    MMSG_GSO_MAX    = 65507;
+
+namespace {
+/* per transport state, in transport->bindings_clientd */
+struct MmsgState {
+  bool     gro,          /* recv cmsg has the gro segment size */
+           gso;          /* send coalesces equal datagrams */
+  uint64_t recv_calls,   /* recvmmsg() syscalls */
+           recv_msgs,    /* datagrams delivered to the driver */
+           send_calls,   /* sendmsg() and sendmmsg() syscalls */
+           send_msgs;    /* datagrams sent */
+};
+/* recv buffers are per thread, the receiver and the conductor each recv */
+struct MmsgRecvBuf {
+  struct mmsghdr          vec[ MMSG_RECV_BATCH ];
+  struct iovec            iov[ MMSG_RECV_BATCH ];
+  struct sockaddr_storage addr[ MMSG_RECV_BATCH ];
+  union {
+    char           buf[ CMSG_SPACE( sizeof( int ) ) ];
+    size_t         align;
+  } ctl[ MMSG_RECV_BATCH ];
+  uint8_t * data;
+};
+}
+
+static __thread MmsgRecvBuf * mmsg_recv_buf;
+
+static MmsgRecvBuf *
+get_recv_buf( void )
+{
+  MmsgRecvBuf * b = mmsg_recv_buf;
+  if ( b != NULL )
+    return b;
+  b = (MmsgRecvBuf *) ::malloc( sizeof( MmsgRecvBuf ) );
+  if ( b == NULL )
+    return NULL;
+  /* frames are parsed in place, aligned like the driver recv buffers */
+  b->data = (uint8_t *) ::aligned_alloc( 64, MMSG_RECV_BATCH * MMSG_BUF_SIZE );
+  if ( b->data == NULL ) {
+    ::free( b );
+    return NULL;
+  }
+  mmsg_recv_buf = b;
+  return b;
+}
+
+static int
+mmsg_init( aeron_udp_channel_transport_t          * transport,
+           struct sockaddr_storage                * bind_addr,
+           struct sockaddr_storage                * multicast_if_addr,
+           unsigned int                             multicast_if_index,
+           uint8_t                                  ttl,
+           size_t                                   socket_rcvbuf,
+           size_t                                   socket_sndbuf,
+           aeron_driver_context_t                 * context,
+           aeron_udp_channel_transport_affinity_t   affinity )
+{
+  int status = aeron_udp_channel_transport_init( transport, bind_addr,
+                 multicast_if_addr, multicast_if_index, ttl, socket_rcvbuf,
+                 socket_sndbuf, context, affinity );
+  if ( status < 0 )
+    return status;
+  MmsgState * st = (MmsgState *) ::calloc( 1, sizeof( MmsgState ) );
+  if ( st == NULL ) {
+    aeron_udp_channel_transport_close( transport );
+    return -1;
+  }
+  int       on = 1, seg = 0;
+  socklen_t len = sizeof( seg );
+  /* both fail with ENOPROTOOPT when the kernel does not have them */
+  if ( ::setsockopt( transport->fd, SOL_UDP, UDP_GRO, &on, sizeof( on ) ) == 0 )
+    st->gro = true;
+  if ( ::getsockopt( transport->fd, SOL_UDP, UDP_SEGMENT, &seg, &len ) == 0 )
+    st->gso = true;
+  transport->bindings_clientd = st;
+  return status;
+}
+
+static int
+mmsg_close( aeron_udp_channel_transport_t * transport )
+{
+  MmsgState * st = (MmsgState *) transport->bindings_clientd;
+  if ( st != NULL ) {
+    if ( ::getenv( "AEKV_UDP_STATS" ) != NULL )
+      fprintf( stderr, "udp fd %d gro %d gso %d recv %lu/%lu send %lu/%lu "
+               "(msgs/calls)\n", transport->fd, st->gro, st->gso,
+               (unsigned long) st->recv_msgs, (unsigned long) st->recv_calls,
+               (unsigned long) st->send_msgs, (unsigned long) st->send_calls );
+    ::free( st );
+    transport->bindings_clientd = NULL;
+  }
+  return aeron_udp_channel_transport_close( transport );
+}
+
+/* the msgvec passed is the driver's, which is a few buffers, this batches
+ * into a larger set and splits gro datagrams into the segments sent */
+static int
+mmsg_recvmmsg( aeron_udp_channel_transport_t   * transport,
+               struct mmsghdr                  * msgvec,
+               size_t                            vlen,
+               int64_t                         * bytes_rcved,
+               aeron_udp_transport_recv_func_t   recv_func,
+               void                            * clientd )
+{
+  MmsgState   * st = (MmsgState *) transport->bindings_clientd;
+  MmsgRecvBuf * b  = get_recv_buf();
+  size_t        i;
+  int           n, work_count = 0;
+
+  if ( st == NULL || b == NULL )
+    return aeron_udp_channel_transport_recvmmsg( transport, msgvec, vlen,
+                                                 bytes_rcved, recv_func,
+                                                 clientd );
+  for ( i = 0; i < MMSG_RECV_BATCH; i++ ) {
+    struct msghdr &h = b->vec[ i ].msg_hdr;
+    b->iov[ i ].iov_base = &b->data[ i * MMSG_BUF_SIZE ];
+    b->iov[ i ].iov_len  = MMSG_BUF_SIZE;
+    h.msg_name       = &b->addr[ i ];
+    h.msg_namelen    = sizeof( b->addr[ i ] );
+    h.msg_iov        = &b->iov[ i ];
+    h.msg_iovlen     = 1;
+    h.msg_control    = st->gro ? b->ctl[ i ].buf : NULL;
+    h.msg_controllen = st->gro ? sizeof( b->ctl[ i ].buf ) : 0;
+    h.msg_flags      = 0;
+    b->vec[ i ].msg_len = 0;
+  }
+  n = ::recvmmsg( transport->fd, b->vec, MMSG_RECV_BATCH, 0, NULL );
+  if ( n < 0 ) {
+    if ( errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR )
+      return 0;
+    /* the default sets the aeron error */
+    return aeron_udp_channel_transport_recvmmsg( transport, msgvec, vlen,
+                                                 bytes_rcved, recv_func,
+                                                 clientd );
+  }
+  st->recv_calls++;
+  for ( i = 0; i < (size_t) n; i++ ) {
+    struct msghdr & h   = b->vec[ i ].msg_hdr;
+    uint8_t       * buf = (uint8_t *) b->iov[ i ].iov_base;
+    size_t          len = b->vec[ i ].msg_len,
+                    seg = len, off;
+    if ( st->gro ) {
+      for ( struct cmsghdr *c = CMSG_FIRSTHDR( &h ); c != NULL;
+            c = CMSG_NXTHDR( &h, c ) ) {
+        if ( c->cmsg_level == SOL_UDP && c->cmsg_type == UDP_GRO ) {
+          int gso_size;
+          ::memcpy( &gso_size, CMSG_DATA( c ), sizeof( gso_size ) );
+          if ( gso_size > 0 )
+            seg = (size_t) gso_size;
+          break;
+        }
+      }
+    }
+    /* each segment is a datagram of the sender, the last may be short */
+    for ( off = 0; off < len; off += seg ) {
+      size_t sz = ( len - off < seg ? len - off : seg );
+      recv_func( transport->data_paths, transport, clientd,
+                 transport->dispatch_clientd, transport->destination_clientd,
+                 &buf[ off ], sz, (struct sockaddr_storage *) h.msg_name );
+      work_count++;
+    }
+    *bytes_rcved += len;
+  }
+  st->recv_msgs += work_count;
+  return work_count;
+}
+
+/* count of msgvec[ i .. ] which can be one gso send: same destination, the
+ * same size, except the last which may be shorter */
+static size_t
+gso_run( struct mmsghdr *msgvec,  size_t i,  size_t vlen )
+{
+  const struct msghdr & h = msgvec[ i ].msg_hdr;
+  size_t seg = 0, total, j, k;
+  for ( k = 0; k < h.msg_iovlen; k++ )
+    seg += h.msg_iov[ k ].iov_len;
+  total = seg;
+  for ( j = i + 1; j < vlen && j - i < MMSG_GSO_SEGS; j++ ) {
+    const struct msghdr & g = msgvec[ j ].msg_hdr;
+    size_t sz = 0;
+    for ( k = 0; k < g.msg_iovlen; k++ )
+      sz += g.msg_iov[ k ].iov_len;
+    if ( sz > seg || total + sz > MMSG_GSO_MAX ||
+         g.msg_namelen != h.msg_namelen ||
+         ::memcmp( g.msg_name, h.msg_name, h.msg_namelen ) != 0 )
+      break;
+    total += sz;
+    if ( sz < seg ) {
+      j++;
+      break;
+    }
+  }
+  return j - i;
+}
+
+/* send msgvec[ i .. i + n ] as one datagram segmented by the kernel */
+static ssize_t
+gso_send( int fd,  struct mmsghdr *msgvec,  size_t i,  size_t n )
+{
+  struct iovec iov[ MMSG_GSO_SEGS * 2 ];
+  union {
+    char           buf[ CMSG_SPACE( sizeof( uint16_t ) ) ];
+    size_t         align;
+  } ctl;
+  struct msghdr h;
+  size_t        cnt = 0, seg = 0, j, k;
+
+  for ( j = i; j < i + n; j++ ) {
+    const struct msghdr & g = msgvec[ j ].msg_hdr;
+    for ( k = 0; k < g.msg_iovlen; k++ ) {
+      if ( cnt == sizeof( iov ) / sizeof( iov[ 0 ] ) ) {
+        errno = EMSGSIZE;
+        return -1;
+      }
+      iov[ cnt++ ] = g.msg_iov[ k ];
+      if ( j == i )
+        seg += g.msg_iov[ k ].iov_len;
+    }
+  }
+  ::memset( &h, 0, sizeof( h ) );
+  ::memset( &ctl, 0, sizeof( ctl ) );
+  h.msg_name       = msgvec[ i ].msg_hdr.msg_name;
+  h.msg_namelen    = msgvec[ i ].msg_hdr.msg_namelen;
+  h.msg_iov        = iov;
+  h.msg_iovlen     = cnt;
+  h.msg_control    = ctl.buf;
+  h.msg_controllen = sizeof( ctl.buf );
+
+  struct cmsghdr * c = CMSG_FIRSTHDR( &h );
+  uint16_t gso_size = (uint16_t) seg;
+  c->cmsg_level = SOL_UDP;
+  c->cmsg_type  = UDP_SEGMENT;
+  c->cmsg_len   = CMSG_LEN( sizeof( gso_size ) );
+  ::memcpy( CMSG_DATA( c ), &gso_size, sizeof( gso_size ) );
+  return ::sendmsg( fd, &h, 0 );
+}
+
+/* runs of datagrams to the same destination are sent with one gso sendmsg,
+ * the rest with sendmmsg(), the batch is set by the sender, raise it with
+ * AERON_NETWORK_PUBLICATION_MAX_MESSAGES_PER_SEND */
+static int
+mmsg_sendmmsg( aeron_udp_channel_transport_t * transport,
+               struct mmsghdr                * msgvec,
+               size_t                          vlen )
+{
+  MmsgState * st = (MmsgState *) transport->bindings_clientd;
+  size_t      i = 0, n, k;
+  int         r;
+
+  if ( st == NULL )
+    return aeron_udp_channel_transport_sendmmsg( transport, msgvec, vlen );
+  while ( i < vlen ) {
+    n = ( st->gso ? gso_run( msgvec, i, vlen ) : 1 );
+    if ( n > 1 ) {
+      st->send_calls++;
+      if ( gso_send( transport->fd, msgvec, i, n ) >= 0 ) {
+        for ( k = i; k < i + n; k++ ) {
+          const struct msghdr & g = msgvec[ k ].msg_hdr;
+          msgvec[ k ].msg_len = 0;
+          for ( size_t m = 0; m < g.msg_iovlen; m++ )
+            msgvec[ k ].msg_len += (unsigned int) g.msg_iov[ m ].iov_len;
+        }
+        st->send_msgs += n;
+        i += n;
+        continue;
+      }
+      if ( errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS )
+        break;
+      /* EIO when the device can't checksum, EINVAL if not supported */
+      st->gso = false;
+    }
+    /* datagrams up to the next gso run */
+    for ( k = i + 1; k < vlen; k++ )
+      if ( st->gso && gso_run( msgvec, k, vlen ) > 1 )
+        break;
+    n = k - i;
+    st->send_calls++;
+    r = aeron_udp_channel_transport_sendmmsg( transport, &msgvec[ i ], n );
+    if ( r < 0 )
+      return i > 0 ? (int) i : r;
+    st->send_msgs += r;
+    i += r;
+    if ( (size_t) r < n )
+      break;
+  }
+  return (int) i;
+}
+
+static int
+mmsg_sendmsg( aeron_udp_channel_transport_t * transport,
+              struct msghdr                 * message )
+{
+  MmsgState * st = (MmsgState *) transport->bindings_clientd;
+  if ( st != NULL ) {
+    st->send_calls++;
+    st->send_msgs++;
+  }
+  return aeron_udp_channel_transport_sendmsg( transport, message );
+}
+
+/* the transport poller is the default, it calls the recvmmsg of bindings */
+aeron_udp_channel_transport_bindings_t aekv_udp_mmsg =
+{ mmsg_init,
+  mmsg_close,
+  mmsg_recvmmsg,
+  mmsg_sendmmsg,
+  mmsg_sendmsg,
+  aeron_udp_channel_transport_get_so_rcvbuf,
+  aeron_udp_channel_transport_bind_addr_and_port,
+  aeron_udp_transport_poller_init,
+  aeron_udp_transport_poller_close,
+  aeron_udp_transport_poller_add,
+  aeron_udp_transport_poller_remove,
+  aeron_udp_transport_poller_poll,
+  { "aekv_udp_mmsg", "media", NULL, NULL }
+};
@@ -0,0 +1,647 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <linux/io_uring.h>
+#include <aekv/aeron_udp.h>
+extern "C" {
+#ifdef __GNUC__
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+#endif
+#include <aeronmd.h>
+#include "media/aeron_udp_channel_transport.h"
+#include "media/aeron_udp_transport_poller.h"
+#include "media/aeron_udp_channel_transport_bindings.h"
+#ifdef __GNUC__
+#pragma GCC diagnostic pop
+#endif
+}
+
+/* multishot recvmsg and provided buffer rings are linux >= 6.0, with older
+ * headers the bindings are the default transport */
+#ifdef IORING_RECV_MULTISHOT
+
+/* sq entries, the cq is twice that, recv buffers must be a power of 2 */
+static const uint32_t URING_ENTRIES     = 256,
+                      URING_BUF_COUNT   = 256,
+                      URING_BUF_GROUP   = 1,
+                      URING_MAX_POLLERS = 64;
+/* a recv buffer holds a jumbo frame or the mtu of the context if larger,
+   the recvmsg_out header and the source address are before the payload */
+static const size_t   URING_BUF_MIN     = 9216,
+                      URING_BUF_HDR     = sizeof( struct io_uring_recvmsg_out ) +
+                                          sizeof( struct sockaddr_storage );
+
+namespace {
+/* sq and cq mapped from the kernel, without liburing */
+struct UringRing {
+  int                   fd;
+  uint32_t              sq_entries,
+                        sq_mask,
+                        cq_mask,
+                        to_submit;
+  uint32_t            * sq_head,
+                      * sq_tail,
+                      * sq_array,
+                      * cq_head,
+                      * cq_tail;
+  struct io_uring_sqe * sqes;
+  struct io_uring_cqe * cqes;
+  void                * ring_ptr,
+                      * sqe_ptr;
+  size_t                ring_len,
+                        sqe_len;
+
+  bool open( uint32_t entries ) noexcept;
+  void close( void ) noexcept;
+  struct io_uring_sqe *get_sqe( void ) noexcept;
+  /* submit to_submit and wait for wait_nr completions */
+  int enter( uint32_t wait_nr ) noexcept;
+};
+/* a transport with a multishot recvmsg, the sqe user_data */
+struct UringSock {
+  UringSock                     * next;
+  aeron_udp_channel_transport_t * transport;
+  struct msghdr                   tmpl;  /* name size, no control */
+  bool                            armed, /* recvmsg is active */
+                                  dead,  /* removed, cancel in progress */
+                                  cancelled; /* cancel sqe submitted */
+};
+/* ring of a poller, the transports of the poller recv into buffers taken
+ * from the provided buffer ring and recycled after the driver recv func */
+struct UringPoller {
+  aeron_udp_transport_poller_t * poller;
+  UringRing                      ring;
+  struct io_uring_buf_ring     * br;
+  uint8_t                      * bufs;
+  size_t                         buf_size,
+                                 br_len;
+  uint16_t                       br_tail;
+  UringSock                    * socks;
+  uint32_t                       need_arm,
+                                 need_cancel; /* dead without a cancel sqe */
+  uint64_t                       recv_msgs,   /* datagrams to the driver */
+                                 trunc_msgs,  /* larger than buf_size */
+                                 enobufs,     /* recv stopped, no buffers */
+                                 enters;      /* io_uring_enter() calls */
+
+  bool init( size_t mtu ) noexcept;
+  void release( void ) noexcept;
+  /* not br->bufs[], the empty struct of the flex array has size 1 in c++,
+     which moves bufs[] to offset 8, the tail overlays bufs[ 0 ].resv */
+  void recycle( uint16_t bid ) noexcept {
+    struct io_uring_buf * ring = (struct io_uring_buf *) (void *) this->br;
+    struct io_uring_buf & b = ring[ this->br_tail & ( URING_BUF_COUNT - 1 ) ];
+    b.addr = (uint64_t) (uintptr_t) &this->bufs[ (size_t) bid * this->buf_size ];
+    b.len  = (uint32_t) this->buf_size;
+    b.bid  = bid;
+    this->br_tail++;
+  }
+  void publish_bufs( void ) noexcept {
+    __atomic_store_n( &this->br->tail, this->br_tail, __ATOMIC_RELEASE );
+  }
+  bool arm( UringSock &s ) noexcept;
+  bool cancel( UringSock &s ) noexcept;
+  void add( aeron_udp_channel_transport_t *transport ) noexcept;
+  void remove( aeron_udp_channel_transport_t *transport ) noexcept;
+  int  poll( int64_t *bytes_rcved,  aeron_udp_transport_recv_func_t recv_func,
+             void *clientd ) noexcept;
+};
+}
+
+bool
+UringRing::open( uint32_t entries ) noexcept
+{
+  struct io_uring_params p;
+  ::memset( &p, 0, sizeof( p ) );
+  ::memset( (void *) this, 0, sizeof( *this ) );
+  this->fd = (int) ::syscall( __NR_io_uring_setup, entries, &p );
+  if ( this->fd < 0 )
+    return false;
+  if ( ( p.features & IORING_FEAT_SINGLE_MMAP ) == 0 ) {
+    ::close( this->fd );
+    errno = ENOSYS;
+    return false;
+  }
+  size_t sq_len = p.sq_off.array + p.sq_entries * sizeof( uint32_t ),
+         cq_len = p.cq_off.cqes + p.cq_entries * sizeof( struct io_uring_cqe );
+  this->ring_len = ( sq_len > cq_len ? sq_len : cq_len );
+  this->sqe_len  = p.sq_entries * sizeof( struct io_uring_sqe );
+  this->ring_ptr = ::mmap( NULL, this->ring_len, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, this->fd,
+                           IORING_OFF_SQ_RING );
+  this->sqe_ptr  = ::mmap( NULL, this->sqe_len, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, this->fd,
+                           IORING_OFF_SQES );
+  if ( this->ring_ptr == MAP_FAILED || this->sqe_ptr == MAP_FAILED ) {
+    this->close();
+    return false;
+  }
+  uint8_t * r = (uint8_t *) this->ring_ptr;
+  this->sq_entries = p.sq_entries;
+  this->sq_head    = (uint32_t *) (void *) &r[ p.sq_off.head ];
+  this->sq_tail    = (uint32_t *) (void *) &r[ p.sq_off.tail ];
+  this->sq_array   = (uint32_t *) (void *) &r[ p.sq_off.array ];
+  this->sq_mask    = *(uint32_t *) (void *) &r[ p.sq_off.ring_mask ];
+  this->cq_head    = (uint32_t *) (void *) &r[ p.cq_off.head ];
+  this->cq_tail    = (uint32_t *) (void *) &r[ p.cq_off.tail ];
+  this->cq_mask    = *(uint32_t *) (void *) &r[ p.cq_off.ring_mask ];
+  this->cqes       = (struct io_uring_cqe *) (void *) &r[ p.cq_off.cqes ];
+  this->sqes       = (struct io_uring_sqe *) this->sqe_ptr;
+  return true;
+}
+
+void
+UringRing::close( void ) noexcept
+{
+  if ( this->ring_ptr != NULL && this->ring_ptr != MAP_FAILED )
+    ::munmap( this->ring_ptr, this->ring_len );
+  if ( this->sqe_ptr != NULL && this->sqe_ptr != MAP_FAILED )
+    ::munmap( this->sqe_ptr, this->sqe_len );
+  if ( this->fd >= 0 )
+    ::close( this->fd );
+  this->ring_ptr = NULL;
+  this->sqe_ptr  = NULL;
+  this->fd       = -1;
+}
+
+struct io_uring_sqe *
+UringRing::get_sqe( void ) noexcept
+{
+  uint32_t tail = *this->sq_tail;
+  if ( tail - __atomic_load_n( this->sq_head, __ATOMIC_ACQUIRE ) >=
+       this->sq_entries ) {
+    if ( this->enter( 0 ) < 0 ||
+         tail - __atomic_load_n( this->sq_head, __ATOMIC_ACQUIRE ) >=
+         this->sq_entries )
+      return NULL;
+  }
+  uint32_t i = tail & this->sq_mask;
+  struct io_uring_sqe * sqe = &this->sqes[ i ];
+  ::memset( (void *) sqe, 0, sizeof( *sqe ) );
+  this->sq_array[ i ] = i;
+  __atomic_store_n( this->sq_tail, tail + 1, __ATOMIC_RELEASE );
+  this->to_submit++;
+  return sqe;
+}
+
+int
+UringRing::enter( uint32_t wait_nr ) noexcept
+{
+  int n;
+  for (;;) {
+    n = (int) ::syscall( __NR_io_uring_enter, this->fd, this->to_submit,
+                         wait_nr, wait_nr != 0 ? IORING_ENTER_GETEVENTS : 0,
+                         NULL, 0 );
+    if ( n >= 0 || errno != EINTR )
+      break;
+  }
+  if ( n > 0 )
+    this->to_submit -= ( (uint32_t) n < this->to_submit ? (uint32_t) n :
+                         this->to_submit );
+  return n;
+}
+
+bool
+UringPoller::init( size_t mtu ) noexcept
+{
+  struct io_uring_buf_reg reg;
+  size_t sz = ( mtu > URING_BUF_MIN ? mtu : URING_BUF_MIN ) + URING_BUF_HDR;
+
+  this->buf_size = ( sz + 63 ) & ~(size_t) 63;
+  if ( ! this->ring.open( URING_ENTRIES ) )
+    return false;
+  this->br_len = URING_BUF_COUNT * sizeof( struct io_uring_buf );
+  this->br = (struct io_uring_buf_ring *)
+    ::mmap( NULL, this->br_len, PROT_READ | PROT_WRITE,
+            MAP_ANONYMOUS | MAP_PRIVATE, -1, 0 );
+  this->bufs = (uint8_t *)
+    ::aligned_alloc( 64, this->buf_size * URING_BUF_COUNT );
+  if ( this->br == MAP_FAILED || this->bufs == NULL ) {
+    if ( this->br == MAP_FAILED )
+      this->br = NULL;
+    return false;
+  }
+  ::memset( &reg, 0, sizeof( reg ) );
+  reg.ring_addr    = (uint64_t) (uintptr_t) this->br;
+  reg.ring_entries = URING_BUF_COUNT;
+  reg.bgid         = URING_BUF_GROUP;
+  if ( ::syscall( __NR_io_uring_register, this->ring.fd,
+                  IORING_REGISTER_PBUF_RING, &reg, 1 ) < 0 )
+    return false;
+  this->br_tail = 0;
+  for ( uint32_t i = 0; i < URING_BUF_COUNT; i++ )
+    this->recycle( (uint16_t) i );
+  this->publish_bufs();
+  return true;
+}
+
+/* closing the ring cancels the recvs and drops the buffer ring */
+void
+UringPoller::release( void ) noexcept
+{
+  this->ring.close();
+  if ( this->br != NULL )
+    ::munmap( this->br, this->br_len );
+  if ( this->bufs != NULL )
+    ::free( this->bufs );
+  while ( this->socks != NULL ) {
+    UringSock * s = this->socks;
+    this->socks = s->next;
+    ::free( s );
+  }
+  this->br   = NULL;
+  this->bufs = NULL;
+}
+
+bool
+UringPoller::arm( UringSock &s ) noexcept
+{
+  struct io_uring_sqe * sqe = this->ring.get_sqe();
+  if ( sqe == NULL )
+    return false;
+  sqe->opcode    = IORING_OP_RECVMSG;
+  sqe->fd        = s.transport->fd;
+  sqe->addr      = (uint64_t) (uintptr_t) &s.tmpl;
+  sqe->len       = 1;
+  sqe->ioprio    = IORING_RECV_MULTISHOT;
+  sqe->flags     = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = URING_BUF_GROUP;
+  sqe->user_data = (uint64_t) (uintptr_t) &s;
+  s.armed = true;
+  return true;
+}
+
+/* the recv ends with a cqe without IORING_CQE_F_MORE, the cancel cqe has
+ * no sock */
+bool
+UringPoller::cancel( UringSock &s ) noexcept
+{
+  struct io_uring_sqe * sqe = this->ring.get_sqe();
+  if ( sqe == NULL )
+    return false;
+  sqe->opcode    = IORING_OP_ASYNC_CANCEL;
+  sqe->addr      = (uint64_t) (uintptr_t) &s;
+  sqe->user_data = 0;
+  s.cancelled = true;
+  return true;
+}
+
+/* armed by the next poll, which is on the thread of the agent */
+void
+UringPoller::add( aeron_udp_channel_transport_t *transport ) noexcept
+{
+  UringSock * s = (UringSock *) ::calloc( 1, sizeof( UringSock ) );
+  if ( s == NULL )
+    return;
+  s->transport        = transport;
+  s->tmpl.msg_namelen = sizeof( struct sockaddr_storage );
+  s->next             = this->socks;
+  this->socks         = s;
+  this->need_arm++;
+}
+
+void
+UringPoller::remove( aeron_udp_channel_transport_t *transport ) noexcept
+{
+  UringSock ** p = &this->socks, * s;
+  for ( ; (s = *p) != NULL; p = &s->next ) {
+    if ( s->transport != transport || s->dead )
+      continue;
+    if ( ! s->armed ) {
+      if ( this->need_arm > 0 )
+        this->need_arm--;
+      *p = s->next;
+      ::free( s );
+      return;
+    }
+    /* freed when the last cqe of the recv arrives, when the sq is full the
+       cancel is retried by poll() */
+    s->dead = true;
+    if ( this->cancel( *s ) ) {
+      this->ring.enter( 0 );
+      this->enters++;
+    }
+    else {
+      this->need_cancel++;
+    }
+    return;
+  }
+}
+
+/* reaps the cq without a syscall, io_uring_enter() is only used to arm */
+int
+UringPoller::poll( int64_t *bytes_rcved,
+                   aeron_udp_transport_recv_func_t recv_func,
+                   void *clientd ) noexcept
+{
+  int work_count = 0;
+  if ( this->need_arm > 0 ) {
+    for ( UringSock *s = this->socks; s != NULL; s = s->next ) {
+      if ( ! s->armed && ! s->dead && this->arm( *s ) )
+        this->need_arm--;
+    }
+  }
+  if ( this->need_cancel > 0 ) {
+    for ( UringSock *s = this->socks; s != NULL; s = s->next ) {
+      if ( s->dead && s->armed && ! s->cancelled && this->cancel( *s ) )
+        this->need_cancel--;
+    }
+  }
+  if ( this->ring.to_submit > 0 ) {
+    this->ring.enter( 0 );
+    this->enters++;
+  }
+  uint32_t head = *this->ring.cq_head,
+           tail = __atomic_load_n( this->ring.cq_tail, __ATOMIC_ACQUIRE ),
+           bufs = 0;
+  for ( ; head != tail; head++ ) {
+    struct io_uring_cqe * cqe = &this->ring.cqes[ head & this->ring.cq_mask ];
+    UringSock * s = (UringSock *) (uintptr_t) cqe->user_data;
+    if ( s == NULL ) /* cancel */
+      continue;
+    if ( ( cqe->flags & IORING_CQE_F_BUFFER ) != 0 ) {
+      uint16_t  bid = (uint16_t) ( cqe->flags >> IORING_CQE_BUFFER_SHIFT );
+      uint8_t * b   = &this->bufs[ (size_t) bid * this->buf_size ];
+      struct io_uring_recvmsg_out * o = (struct io_uring_recvmsg_out *) b;
+      if ( cqe->res > 0 && ! s->dead ) {
+        if ( ( o->flags & MSG_TRUNC ) != 0 )
+          this->trunc_msgs++;
+        else {
+          aeron_udp_channel_transport_t * t = s->transport;
+          recv_func( t->data_paths, t, clientd, t->dispatch_clientd,
+                     t->destination_clientd,
+                     &b[ sizeof( *o ) + s->tmpl.msg_namelen ], o->payloadlen,
+                     (struct sockaddr_storage *) (void *) &b[ sizeof( *o ) ] );
+          *bytes_rcved += o->payloadlen;
+          work_count++;
+        }
+      }
+      this->recycle( bid );
+      bufs++;
+    }
+    if ( ( cqe->flags & IORING_CQE_F_MORE ) == 0 ) {
+      /* ended by cancel, by ENOBUFS when the driver is behind, or an error */
+      s->armed = false;
+      if ( cqe->res == -ENOBUFS )
+        this->enobufs++;
+      if ( s->dead ) {
+        if ( ! s->cancelled && this->need_cancel > 0 ) /* ended before */
+          this->need_cancel--;
+        UringSock ** p = &this->socks;
+        while ( *p != s )
+          p = &(*p)->next;
+        *p = s->next;
+        ::free( s );
+      }
+      else {
+        this->need_arm++;
+      }
+    }
+  }
+  __atomic_store_n( this->ring.cq_head, head, __ATOMIC_RELEASE );
+  if ( bufs > 0 )
+    this->publish_bufs();
+  this->recv_msgs += work_count;
+  return work_count;
+}
+
+/* the bindings have no poller closure, pollers are found by address */
+static UringPoller * uring_tab[ URING_MAX_POLLERS ];
+
+static UringPoller *
+find_poller( aeron_udp_transport_poller_t *poller )
+{
+  for ( uint32_t i = 0; i < URING_MAX_POLLERS; i++ ) {
+    UringPoller * u = __atomic_load_n( &uring_tab[ i ], __ATOMIC_ACQUIRE );
+    if ( u != NULL && u->poller == poller )
+      return u;
+  }
+  return NULL;
+}
+
+static int
+uring_poller_init( aeron_udp_transport_poller_t          * poller,
+                   aeron_driver_context_t                * context,
+                   aeron_udp_channel_transport_affinity_t  affinity )
+{
+  int status = aeron_udp_transport_poller_init( poller, context, affinity );
+  if ( status < 0 )
+    return status;
+  UringPoller * u = (UringPoller *) ::calloc( 1, sizeof( UringPoller ) );
+  if ( u == NULL )
+    return status;
+  u->poller = poller;
+  if ( ! u->init( context != NULL ?
+                  aeron_driver_context_get_mtu_length( context ) : 0 ) ) {
+    /* io_uring disabled or kernel < 6.0, the default poller is used */
+    perror( "aekv_udp_uring" );
+    u->release();
+    ::free( u );
+    return status;
+  }
+  for ( uint32_t i = 0; i < URING_MAX_POLLERS; i++ ) {
+    UringPoller * null_u = NULL;
+    if ( __atomic_compare_exchange_n( &uring_tab[ i ], &null_u, u, false,
+                                      __ATOMIC_RELEASE, __ATOMIC_RELAXED ) )
+      return status;
+  }
+  u->release();
+  ::free( u );
+  return status;
+}
+
+int
+aekv_udp_uring_poller_fd( aeron_udp_transport_poller_t *poller )
+{
+  UringPoller * u = find_poller( poller );
+  return u != NULL ? u->ring.fd : -1;
+}
+
+static int
+uring_poller_close( aeron_udp_transport_poller_t * poller )
+{
+  UringPoller * u = find_poller( poller );
+  if ( u != NULL ) {
+    for ( uint32_t i = 0; i < URING_MAX_POLLERS; i++ )
+      if ( uring_tab[ i ] == u )
+        __atomic_store_n( &uring_tab[ i ], (UringPoller *) NULL,
+                          __ATOMIC_RELEASE );
+    if ( ::getenv( "AEKV_UDP_STATS" ) != NULL )
+      fprintf( stderr, "uring poller recv %lu trunc %lu enobufs %lu "
+               "enter %lu\n", (unsigned long) u->recv_msgs,
+               (unsigned long) u->trunc_msgs, (unsigned long) u->enobufs,
+               (unsigned long) u->enters );
+    u->release();
+    ::free( u );
+  }
+  return aeron_udp_transport_poller_close( poller );
+}
+
+static int
+uring_poller_add( aeron_udp_transport_poller_t  * poller,
+                  aeron_udp_channel_transport_t * transport )
+{
+  int status = aeron_udp_transport_poller_add( poller, transport );
+  UringPoller * u;
+  if ( status == 0 && (u = find_poller( poller )) != NULL )
+    u->add( transport );
+  return status;
+}
+
+static int
+uring_poller_remove( aeron_udp_transport_poller_t  * poller,
+                     aeron_udp_channel_transport_t * transport )
+{
+  int status = aeron_udp_transport_poller_remove( poller, transport );
+  UringPoller * u;
+  if ( status == 0 && (u = find_poller( poller )) != NULL )
+    u->remove( transport );
+  return status;
+}
+
+static int
+uring_poller_poll( aeron_udp_transport_poller_t              * poller,
+                   struct mmsghdr                            * msgvec,
+                   size_t                                      vlen,
+                   int64_t                                   * bytes_rcved,
+                   aeron_udp_transport_recv_func_t             recv_func,
+                   aeron_udp_channel_transport_recvmmsg_func_t recvmmsg_func,
+                   void                                      * clientd )
+{
+  UringPoller * u = find_poller( poller );
+  if ( u == NULL )
+    return aeron_udp_transport_poller_poll( poller, msgvec, vlen, bytes_rcved,
+                                            recv_func, recvmmsg_func, clientd );
+  return u->poll( bytes_rcved, recv_func, clientd );
+}
+
+/* sends use a ring per thread, the sender and the conductor each send */
+static __thread UringRing * uring_send;
+static __thread bool        uring_send_failed;
+
+static UringRing *
+get_send_ring( void )
+{
+  if ( uring_send != NULL || uring_send_failed )
+    return uring_send;
+  UringRing * r = (UringRing *) ::malloc( sizeof( UringRing ) );
+  if ( r != NULL && r->open( URING_ENTRIES ) )
+    return uring_send = r;
+  ::free( r );
+  uring_send_failed = true;
+  return NULL;
+}
+
+/* the msgs are linked sqes submitted with one io_uring_enter() which waits
+ * for them, a failure cancels the rest, so the count sent is a prefix, the
+ * payload is in the term buffer and is not used after the call returns */
+static int
+uring_sendmmsg( aeron_udp_channel_transport_t * transport,
+                struct mmsghdr                * msgvec,
+                size_t                          vlen )
+{
+  UringRing * r = ( vlen > 1 ? get_send_ring() : NULL );
+  int         res[ URING_ENTRIES ];
+  size_t      i, n;
+
+  if ( r == NULL )
+    return aeron_udp_channel_transport_sendmmsg( transport, msgvec, vlen );
+  if ( vlen > URING_ENTRIES )
+    vlen = URING_ENTRIES;
+  for ( i = 0; i < vlen; i++ ) {
+    struct io_uring_sqe * sqe = r->get_sqe();
+    if ( sqe == NULL )
+      break;
+    sqe->opcode    = IORING_OP_SENDMSG;
+    sqe->fd        = transport->fd;
+    sqe->addr      = (uint64_t) (uintptr_t) &msgvec[ i ].msg_hdr;
+    sqe->len       = 1;
+    sqe->msg_flags = MSG_DONTWAIT; /* EAGAIN instead of a poll retry */
+    sqe->flags     = ( i + 1 < vlen ? IOSQE_IO_LINK : 0 );
+    sqe->user_data = i;
+    res[ i ]       = -ECANCELED;
+  }
+  if ( i == 0 )
+    return aeron_udp_channel_transport_sendmmsg( transport, msgvec, vlen );
+  if ( i < vlen ) { /* end the link chain */
+    r->sqes[ ( *r->sq_tail - 1 ) & r->sq_mask ].flags = 0;
+    vlen = i;
+  }
+  int e = r->enter( (uint32_t) vlen );
+  if ( r->to_submit > 0 ) {
+    /* not submitted, the sqes are reused by the next call */
+    __atomic_store_n( r->sq_tail, *r->sq_tail - r->to_submit,
+                      __ATOMIC_RELEASE );
+    r->to_submit = 0;
+    /* the kernel does not wait after a short submit */
+    if ( e > 0 )
+      r->enter( (uint32_t) e );
+  }
+  if ( e <= 0 )
+    return aeron_udp_channel_transport_sendmmsg( transport, msgvec, vlen );
+  uint32_t head = *r->cq_head,
+           tail = __atomic_load_n( r->cq_tail, __ATOMIC_ACQUIRE );
+  for ( ; head != tail; head++ ) {
+    struct io_uring_cqe * cqe = &r->cqes[ head & r->cq_mask ];
+    if ( cqe->user_data < vlen )
+      res[ cqe->user_data ] = cqe->res;
+  }
+  __atomic_store_n( r->cq_head, head, __ATOMIC_RELEASE );
+  for ( n = 0; n < vlen && res[ n ] >= 0; n++ )
+    msgvec[ n ].msg_len = (unsigned int) res[ n ];
+  if ( n == 0 && res[ 0 ] != -EAGAIN && res[ 0 ] != -EWOULDBLOCK &&
+       res[ 0 ] != -ENOBUFS )
+    /* the default sets the aeron error */
+    return aeron_udp_channel_transport_sendmmsg( transport, msgvec, vlen );
+  return (int) n;
+}
+
+aeron_udp_channel_transport_bindings_t aekv_udp_uring =
+{ aeron_udp_channel_transport_init,
+  aeron_udp_channel_transport_close,
+  aeron_udp_channel_transport_recvmmsg,
+  uring_sendmmsg,
+  aeron_udp_channel_transport_sendmsg,
+  aeron_udp_channel_transport_get_so_rcvbuf,
+  aeron_udp_channel_transport_bind_addr_and_port,
+  uring_poller_init,
+  uring_poller_close,
+  uring_poller_add,
+  uring_poller_remove,
+  uring_poller_poll,
+  { "aekv_udp_uring", "media", NULL, NULL }
+};
+
+#else
+
+int
+aekv_udp_uring_poller_fd( aeron_udp_transport_poller_t * )
+{
+  return -1;
+}
+
+aeron_udp_channel_transport_bindings_t aekv_udp_uring =
+{ aeron_udp_channel_transport_init,
+  aeron_udp_channel_transport_close,
+  aeron_udp_channel_transport_recvmmsg,
+  aeron_udp_channel_transport_sendmmsg,
+  aeron_udp_channel_transport_sendmsg,
+  aeron_udp_channel_transport_get_so_rcvbuf,
+  aeron_udp_channel_transport_bind_addr_and_port,
+  aeron_udp_transport_poller_init,
+  aeron_udp_transport_poller_close,
+  aeron_udp_transport_poller_add,
+  aeron_udp_transport_poller_remove,
+  aeron_udp_transport_poller_poll,
+  { "aekv_udp_uring", "media", NULL, NULL }
+};
+
+#endif
@@ -7,22 +7,177 @@
 #include <stddef.h>
 #include <string.h>
 #include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
 #include <aekv/coroutine.h>
 
+/* switch saves callee saved registers on the stack and swaps the stack
+ * pointer, swapcontext() also saves the signal mask with a syscall */
+#if ( defined( __x86_64__ ) || defined( __aarch64__ ) ) && \
+    ! defined( AEKV_CORO_UCONTEXT )
+#define CORO_ASM_SWITCH
+#else
 #if __APPLE__ && __MACH__
 #include <sys/ucontext.h>
 #else 
 #include <ucontext.h>
 #endif 
+#endif
 
+/* default stack sizes when coroutine_open() is passed zero, these are
+ * reservations, pages are committed as the stack grows into them */
 static const size_t STACK_SIZE = (10*1024*1024);
+/* size of a stack in COROUTINE_SEPARATE_STACK mode, excluding guard page */
+static const size_t CORO_STACK_SIZE = (256*1024);
+/* passes an idle pool worker yields before it parks until a push */
+static const uint32_t CORO_IDLE_SPINS = 64;
+
+/* why a suspended coroutine is parked, cleared when woken */
+enum { WAIT_NONE = 0, WAIT_TIMER = 1, WAIT_FD = 2, WAIT_COND = 3 };
+
+#ifdef CORO_ASM_SWITCH
+extern "C" {
+/* save registers on the current stack, store sp to *save_sp, load new_sp and
+ * pop the registers saved there */
+void aekv_coro_switch( void **save_sp,  void *new_sp );
+/* first return of a new coroutine lands here, calls func( arg ) */
+void aekv_coro_entry( void );
+}
+#if defined( __x86_64__ )
+/* frame: mxcsr + x87 cw, r15, r14, r13, r12, rbx, rbp, return address,
+ * r12 is the arg and r13 is the func of a new coroutine */
+__asm__ (
+  ".text\n"
+  ".p2align 4\n"
+  ".globl aekv_coro_switch\n"
+  ".type aekv_coro_switch,@function\n"
+"aekv_coro_switch:\n"
+  "pushq %rbp\n"
+  "pushq %rbx\n"
+  "pushq %r12\n"
+  "pushq %r13\n"
+  "pushq %r14\n"
+  "pushq %r15\n"
+  "subq $8, %rsp\n"
+  "stmxcsr (%rsp)\n"
+  "fnstcw 4(%rsp)\n"
+  "movq %rsp, (%rdi)\n"
+  "movq %rsi, %rsp\n"
+  "ldmxcsr (%rsp)\n"
+  "fldcw 4(%rsp)\n"
+  "addq $8, %rsp\n"
+  "popq %r15\n"
+  "popq %r14\n"
+  "popq %r13\n"
+  "popq %r12\n"
+  "popq %rbx\n"
+  "popq %rbp\n"
+  "ret\n"
+  ".size aekv_coro_switch,.-aekv_coro_switch\n"
+  ".p2align 4\n"
+  ".globl aekv_coro_entry\n"
+  ".type aekv_coro_entry,@function\n"
+"aekv_coro_entry:\n"
+  "movq %r12, %rdi\n"
+  "callq *%r13\n"
+  "ud2\n"
+  ".size aekv_coro_entry,.-aekv_coro_entry\n"
+);
+enum { CORO_FRAME_WORDS = 10, CORO_ARG_WORD = 4, CORO_FUNC_WORD = 3,
+       CORO_RET_WORD = 7 };
+#else
+/* frame: x19 -> x30 pairs, d8 -> d15 pairs, 176 bytes keeps sp aligned,
+ * x19 is the arg and x20 is the func of a new coroutine */
+__asm__ (
+  ".text\n"
+  ".p2align 4\n"
+  ".globl aekv_coro_switch\n"
+  ".type aekv_coro_switch,%function\n"
+"aekv_coro_switch:\n"
+  "sub sp, sp, #176\n"
+  "stp x19, x20, [sp, #0]\n"
+  "stp x21, x22, [sp, #16]\n"
+  "stp x23, x24, [sp, #32]\n"
+  "stp x25, x26, [sp, #48]\n"
+  "stp x27, x28, [sp, #64]\n"
+  "stp x29, x30, [sp, #80]\n"
+  "stp d8, d9, [sp, #96]\n"
+  "stp d10, d11, [sp, #112]\n"
+  "stp d12, d13, [sp, #128]\n"
+  "stp d14, d15, [sp, #144]\n"
+  "mov x2, sp\n"
+  "str x2, [x0]\n"
+  "mov sp, x1\n"
+  "ldp x19, x20, [sp, #0]\n"
+  "ldp x21, x22, [sp, #16]\n"
+  "ldp x23, x24, [sp, #32]\n"
+  "ldp x25, x26, [sp, #48]\n"
+  "ldp x27, x28, [sp, #64]\n"
+  "ldp x29, x30, [sp, #80]\n"
+  "ldp d8, d9, [sp, #96]\n"
+  "ldp d10, d11, [sp, #112]\n"
+  "ldp d12, d13, [sp, #128]\n"
+  "ldp d14, d15, [sp, #144]\n"
+  "add sp, sp, #176\n"
+  "ret\n"
+  ".size aekv_coro_switch,.-aekv_coro_switch\n"
+  ".p2align 4\n"
+  ".globl aekv_coro_entry\n"
+  ".type aekv_coro_entry,%function\n"
+"aekv_coro_entry:\n"
+  "mov x0, x19\n"
+  "blr x20\n"
+  "brk #0\n"
+  ".size aekv_coro_entry,.-aekv_coro_entry\n"
+);
+enum { CORO_FRAME_WORDS = 22, CORO_ARG_WORD = 0, CORO_FUNC_WORD = 1,
+       CORO_RET_WORD = 11 };
+#endif
+/* build the frame popped by the first switch to a new coroutine, top is the
+ * end of the stack, the frame is placed below it */
+static void *
+coro_init_frame( char *top,  void (*func)( void * ),  void *arg )
+{
+  uintptr_t * sp = (uintptr_t *)
+    ( ( (uintptr_t) top & ~(uintptr_t) 15 ) - 16 - CORO_FRAME_WORDS * 8 );
+  ::memset( sp, 0, CORO_FRAME_WORDS * 8 );
+#if defined( __x86_64__ )
+  /* default mxcsr and x87 control word, after ret pops the entry, sp is
+   * 16 byte aligned for the call to func */
+  sp[ 0 ] = 0x1f80 | ( (uintptr_t) 0x037f << 32 );
+#endif
+  sp[ CORO_ARG_WORD ]  = (uintptr_t) arg;
+  sp[ CORO_FUNC_WORD ] = (uintptr_t) func;
+  sp[ CORO_RET_WORD ]  = (uintptr_t) aekv_coro_entry;
+  return sp;
+}
+#endif
 
 extern "C" {
 typedef struct coroutine_s {
   coroutine_func_t func;
   void           * ud;
+#ifdef CORO_ASM_SWITCH
+  void           * sp;     /* saved stack pointer, registers are below it */
+#else
   ucontext_t       ctx;
+#endif
   schedule_t     * sch;
+  coroutine_t    * next,   /* link in free list or ready queue */
+                 * back;
+  int              queued, /* if in ready queue, pool states are at
+                              Schedule::push_ready() */
+                   wait,   /* WAIT_TIMER, WAIT_FD, WAIT_COND when parked */
+                   wait_fd,/* fd added to epoll by wait_fd */
+                   revents,/* epoll events which woke wait_fd */
+                   pin;    /* pool worker it must run on, -1 stealable */
+  uint64_t         wait_ns;/* deadline of sleep_ns, matched to heap entry */
+  int           ( *cond )( void * );
+  void           * cond_arg;
   size_t           cap,
                    size;
   char           * stack;
@@ -31,12 +186,38 @@ typedef struct coroutine_s {
   int              status;
 } coroutine_t;
 
+struct coro_timer_s {
+  uint64_t      ns;
+  coroutine_t * co;
+};
+
 typedef struct schedule_s {
-  char           stack[ STACK_SIZE ] __attribute__((__aligned__( 128 )));
+  char         * stack;       /* shared stack, above guard page of stack_map */
+  void         * stack_map;   /* reservation of shared stack + guard */
+  size_t         stack_size;  /* size of shared or of each separate stack */
+#ifdef CORO_ASM_SWITCH
+  void         * main_sp;
+#else
   ucontext_t     main;
+#endif
   size_t         nco,
                  cap,
-                 used;
+                 used,
+                 page_size,   /* guard size below a separate stack */
+                 pool_count;  /* count of stacks in pool */
+  int            mode;        /* COROUTINE_SHARED_STACK or SEPARATE_STACK */
+  void         * pool;        /* free separate stacks, linked by first word */
+  coroutine_t  * free_list,   /* dead coroutines, slots for reuse */
+               * ready_hd,    /* coroutines runnable, fifo */
+               * ready_tl;
+  size_t         ready_count;
+  coroutine_t  * cond_hd;     /* coroutines parked in wait_cond */
+  struct coro_timer_s * heap; /* min heap of sleep_ns deadlines */
+  size_t         heap_count,
+                 heap_cap,
+                 fd_count;    /* coroutines parked in wait_fd */
+  int            epfd;        /* epoll for wait_fd, created when first used */
+  void         * worker;      /* pool worker which owns this, runs ready */
   coroutine_t  * running;
   coroutine_t ** co;
 } schedule_t;
@@ -50,6 +231,16 @@ static inline void *aligned_malloc( size_t sz ) {
 #endif
 }
 
+static inline uint64_t coro_now_ns( void ) {
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void worker_push( void *w,  coroutine_t *c );
+struct CoroWorker;
+static __thread CoroWorker * cur_worker;
+
 struct Coroutine : public coroutine_s {
   void * operator new( size_t, void *ptr ) { return ptr; }
   void operator delete( void *ptr ) { free( ptr ); }
@@ -58,6 +249,16 @@ struct Coroutine : public coroutine_s {
     this->func   = f;
     this->ud     = user_data;
     this->sch    = s;
+    this->next   = NULL;
+    this->back   = NULL;
+    this->queued = 0;
+    this->wait   = WAIT_NONE;
+    this->wait_fd = -1;
+    this->revents = 0;
+    this->pin     = -1;
+    this->wait_ns = 0;
+    this->cond   = NULL;
+    this->cond_arg = NULL;
     this->cap    = stk_cap;
     this->size   = 0;
     this->stack  = stk;
@@ -73,44 +274,300 @@ struct Coroutine : public coroutine_s {
 struct Schedule : public schedule_s {
   void * operator new( size_t, void *ptr ) { return ptr; }
   void operator delete( void *ptr ) { free( ptr ); }
-  Schedule() {
-    this->nco     = 0;
-    this->cap     = 0;
-    this->used    = 0;
-    this->running = NULL;
-    this->co      = NULL;
+  Schedule( size_t sz,  int m ) {
+    this->page_size  = (size_t) sysconf( _SC_PAGESIZE );
+    this->stack      = NULL;
+    this->stack_map  = NULL;
+    this->stack_size = ( sz + this->page_size - 1 ) & ~( this->page_size - 1 );
+    if ( this->stack_size == 0 )
+      this->stack_size = ( m == COROUTINE_SEPARATE_STACK ? CORO_STACK_SIZE :
+                           STACK_SIZE );
+    this->nco        = 0;
+    this->cap        = 0;
+    this->used       = 0;
+    this->pool_count = 0;
+    this->mode       = m;
+    this->pool       = NULL;
+    this->free_list  = NULL;
+    this->ready_hd   = NULL;
+    this->ready_tl   = NULL;
+    this->ready_count = 0;
+    this->cond_hd    = NULL;
+    this->heap       = NULL;
+    this->heap_count = 0;
+    this->heap_cap   = 0;
+    this->fd_count   = 0;
+    this->epfd       = -1;
+    this->worker     = NULL;
+    this->running    = NULL;
+    this->co         = NULL;
   }
   ~Schedule() {
     for ( size_t i = 0; i < this->cap; i++ ) {
-      if ( this->co[ i ] != NULL )
-        delete (Coroutine *) this->co[ i ];
+      Coroutine * c = (Coroutine *) this->co[ i ];
+      if ( c != NULL ) {
+        if ( this->mode == COROUTINE_SEPARATE_STACK && c->stack != NULL ) {
+          munmap( c->stack, this->map_size() );
+          c->stack = NULL;
+        }
+        delete c;
+      }
     }
+    while ( this->pool != NULL ) {
+      void * next = *(void **) this->stack_base( this->pool );
+      munmap( this->pool, this->map_size() );
+      this->pool = next;
+    }
+    if ( this->stack_map != NULL )
+      munmap( this->stack_map, this->map_size() );
+    if ( this->epfd >= 0 )
+      ::close( this->epfd );
+    free( this->heap );
     free( this->co );
   }
+  /* a stack is a mapping with a guard page at the low end, an overflow
+   * faults instead of writing over the next stack or the heap */
+  size_t map_size( void ) const { return this->stack_size + this->page_size; }
+  char * stack_base( void *map ) const { return (char *) map + this->page_size; }
+  char * stack_top( void *map ) const { return (char *) map + this->map_size(); }
+  char * map_stack( void ) {
+    void * m = mmap( NULL, this->map_size(), PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0 );
+    if ( m == MAP_FAILED )
+      return NULL;
+    mprotect( m, this->page_size, PROT_NONE );
+    return (char *) m;
+  }
+  /* the shared stack is mapped once, when first used */
+  char * shared_stack( void ) {
+    if ( this->stack == NULL ) {
+      if ( (this->stack_map = this->map_stack()) == NULL ) {
+        perror( "mmap coroutine stack" );
+        abort();
+      }
+      this->stack = this->stack_base( this->stack_map );
+    }
+    return this->stack;
+  }
+  char * alloc_stack( void ) {
+    void * m = this->pool;
+    if ( m != NULL ) {
+      this->pool = *(void **) this->stack_base( m );
+      this->pool_count--;
+      return (char *) m;
+    }
+    if ( (m = this->map_stack()) == NULL ) {
+      perror( "mmap coroutine stack" );
+      abort();
+    }
+    return (char *) m;
+  }
+  void free_stack( char *m ) {
+    *(void **) this->stack_base( m ) = this->pool;
+    this->pool = m;
+    this->pool_count++;
+  }
+  /* slots are reused from the free list, else a new slot is added */
   Coroutine *new_coroutine( coroutine_func_t func, void *user_data,
                             const char *name ) {
-    if ( this->used == this->cap )
-      this->resize_coro( this->cap + 16 );
-
-    size_t j = this->nco;
-    Coroutine * c = NULL;
-    for ( size_t i = 0; i < this->cap; i++ ) {
-      if ( j >= this->cap )
-        j = 0;
-      c = (Coroutine *) this->co[ j ];
-      if ( c == NULL || c->status == COROUTINE_DEAD )
-        break;
+    Coroutine * c = (Coroutine *) this->free_list;
+    if ( c != NULL ) {
+      this->free_list = c->next;
+      c = new ( c ) Coroutine( this, func, user_data, c->id, name,
+                               c->stack, c->cap );
     }
-    this->nco = j + 1;
-    this->used++;
-    if ( c == NULL ) {
+    else {
+      if ( this->nco == this->cap )
+        this->resize_coro( this->cap + 16 );
       void *p = malloc( sizeof( *c ) );
-      c = new ( p ) Coroutine( this, func, user_data, j, name );
-      this->co[ j ] = c;
-      return c;
+      c = new ( p ) Coroutine( this, func, user_data, this->nco, name );
+      this->co[ this->nco++ ] = c;
+    }
+    this->used++;
+    this->push_ready( c );
+    return c;
+  }
+  void push_ready( coroutine_t *c ) {
+    /* a pool worker queue can be stolen from, a coroutine is pushed by the
+     * worker after it has switched off its stack, a wake from another
+     * thread while it runs or switches only marks it, queued is:
+     *   0 parked, 1 in a worker queue or taken by a worker, 5 running,
+     *   4 running and woken, 3 switching out, 2 owed a push after switch */
+    if ( this->worker != NULL ) {
+      for (;;) {
+        int q = c->queued;
+        if ( q == 0 ) {
+          if ( __sync_bool_compare_and_swap( &c->queued, 0, 1 ) ) {
+            worker_push( this->worker, c );
+            return;
+          }
+        }
+        else if ( q == 5 ) {
+          if ( __sync_bool_compare_and_swap( &c->queued, 5, 4 ) )
+            return;
+        }
+        else if ( q == 3 ) {
+          if ( __sync_bool_compare_and_swap( &c->queued, 3, 2 ) )
+            return;
+        }
+        else {
+          return;
+        }
+      }
     }
-    return new ( c ) Coroutine( this, func, user_data, j, name,
-                                c->stack, c->cap );
+    if ( c->queued )
+      return;
+    c->queued = 1;
+    c->next   = NULL;
+    c->back   = this->ready_tl;
+    if ( this->ready_tl == NULL )
+      this->ready_hd = c;
+    else
+      this->ready_tl->next = c;
+    this->ready_tl = c;
+    this->ready_count++;
+  }
+  void pop_ready( coroutine_t *c ) {
+    if ( c->wait != WAIT_NONE ) /* resumed directly while parked */
+      this->unpark( c );
+    if ( ! c->queued || this->worker != NULL ) /* pool, see begin_run() */
+      return;
+    if ( c->back == NULL )
+      this->ready_hd = c->next;
+    else
+      c->back->next = c->next;
+    if ( c->next == NULL )
+      this->ready_tl = c->back;
+    else
+      c->next->back = c->back;
+    c->next = c->back = NULL;
+    c->queued = 0;
+    this->ready_count--;
+  }
+  /* a pool coroutine is switching out, cleared by the worker after the
+   * switch, or it was woken while it ran and is owed a push */
+  void begin_switch_out( coroutine_t *c ) {
+    if ( this->worker != NULL &&
+         ! __sync_bool_compare_and_swap( &c->queued, 5, 3 ) )
+      __sync_bool_compare_and_swap( &c->queued, 4, 2 );
+  }
+  /* a pool coroutine stays queued after the worker takes it until it is
+   * running, so a wake from another worker does not push it twice */
+  void begin_run( coroutine_t *c ) {
+    if ( this->worker != NULL )
+      __sync_bool_compare_and_swap( &c->queued, 1, 5 );
+  }
+  /* take a parked coroutine out of its wait and make it ready */
+  void unpark( coroutine_t *c ) {
+    switch ( c->wait ) {
+      case WAIT_FD:
+        epoll_ctl( this->epfd, EPOLL_CTL_DEL, c->wait_fd, NULL );
+        c->wait_fd = -1;
+        this->fd_count--;
+        break;
+      case WAIT_COND:
+        if ( c->back == NULL )
+          this->cond_hd = c->next;
+        else
+          c->back->next = c->next;
+        if ( c->next != NULL )
+          c->next->back = c->back;
+        c->next = c->back = NULL;
+        break;
+      default: /* a timer entry is left in the heap, wait_ns won't match */
+        break;
+    }
+    c->wait = WAIT_NONE;
+    this->push_ready( c );
+  }
+  void push_timer( uint64_t ns,  coroutine_t *c ) {
+    if ( this->heap_count == this->heap_cap ) {
+      this->heap_cap = ( this->heap_cap == 0 ? 16 : this->heap_cap * 2 );
+      this->heap = (coro_timer_s *)
+        realloc( this->heap, this->heap_cap * sizeof( this->heap[ 0 ] ) );
+    }
+    size_t i = this->heap_count++;
+    while ( i > 0 ) {
+      size_t j = ( i - 1 ) / 2;
+      if ( this->heap[ j ].ns <= ns )
+        break;
+      this->heap[ i ] = this->heap[ j ];
+      i = j;
+    }
+    this->heap[ i ].ns = ns;
+    this->heap[ i ].co = c;
+  }
+  void pop_timer( void ) {
+    coro_timer_s & last = this->heap[ --this->heap_count ];
+    size_t i = 0, n = this->heap_count;
+    for (;;) {
+      size_t j = i * 2 + 1;
+      if ( j >= n )
+        break;
+      if ( j + 1 < n && this->heap[ j + 1 ].ns < this->heap[ j ].ns )
+        j++;
+      if ( last.ns <= this->heap[ j ].ns )
+        break;
+      this->heap[ i ] = this->heap[ j ];
+      i = j;
+    }
+    this->heap[ i ] = last;
+  }
+  /* wake expired timers, true conditions and ready fds, block in epoll up to
+   * timeout_ms when nothing is ready, returns count woken */
+  int poll( int timeout_ms ) {
+    int n = 0;
+    if ( this->heap_count > 0 ) {
+      uint64_t now = coro_now_ns();
+      while ( this->heap_count > 0 && this->heap[ 0 ].ns <= now ) {
+        coroutine_t * c = this->heap[ 0 ].co;
+        if ( c->wait == WAIT_TIMER && c->wait_ns == this->heap[ 0 ].ns ) {
+          this->unpark( c );
+          n++;
+        }
+        this->pop_timer();
+      }
+      if ( n == 0 && timeout_ms != 0 && this->heap_count > 0 ) {
+        uint64_t ms = ( this->heap[ 0 ].ns - now + 999999 ) / 1000000;
+        if ( timeout_ms < 0 || ms < (uint64_t) timeout_ms )
+          timeout_ms = (int) ms;
+      }
+    }
+    for ( coroutine_t *c = this->cond_hd; c != NULL; ) {
+      coroutine_t * next = c->next;
+      if ( c->cond( c->cond_arg ) ) {
+        this->unpark( c );
+        n++;
+      }
+      c = next;
+    }
+    if ( n > 0 || this->ready_count > 0 || this->cond_hd != NULL )
+      timeout_ms = 0;
+    if ( this->fd_count > 0 ) {
+      struct epoll_event ev[ 16 ];
+      int m = epoll_wait( this->epfd, ev, 16, timeout_ms );
+      for ( int i = 0; i < m; i++ ) {
+        coroutine_t * c = (coroutine_t *) ev[ i ].data.ptr;
+        if ( c->wait == WAIT_FD ) {
+          this->unpark( c );
+          c->revents = (int) ev[ i ].events;
+          n++;
+        }
+      }
+    }
+    else if ( timeout_ms != 0 && this->heap_count > 0 ) {
+      struct timespec ts;
+      ts.tv_sec  = timeout_ms / 1000;
+      ts.tv_nsec = (long) ( timeout_ms % 1000 ) * 1000000;
+      nanosleep( &ts, NULL );
+      n += this->poll( 0 );
+    }
+    return n;
+  }
+  /* after switch back to main, a dead coroutine slot is free */
+  void release_dead( coroutine_t *c ) {
+    c->next = this->free_list;
+    this->free_list = c;
   }
   void resize_coro( size_t n ) {
     size_t cur = this->cap * sizeof( this->co[ 0 ] ),
@@ -121,12 +578,258 @@ struct Schedule : public schedule_s {
   }
 };
 
+/* fifo linked through coroutine next/back, same as Schedule ready queue */
+struct CoroList {
+  coroutine_t * hd, * tl;
+  void push_tl( coroutine_t *c ) {
+    c->next = NULL;
+    c->back = this->tl;
+    if ( this->tl == NULL )
+      this->hd = c;
+    else
+      this->tl->next = c;
+    this->tl = c;
+  }
+  coroutine_t *pop_hd( void ) {
+    coroutine_t * c = this->hd;
+    if ( c != NULL ) {
+      if ( (this->hd = c->next) == NULL )
+        this->tl = NULL;
+      else
+        this->hd->back = NULL;
+      c->next = NULL;
+    }
+    return c;
+  }
+  coroutine_t *pop_tl( void ) {
+    coroutine_t * c = this->tl;
+    if ( c != NULL ) {
+      if ( (this->tl = c->back) == NULL )
+        this->hd = NULL;
+      else
+        this->tl->next = NULL;
+      c->back = NULL;
+    }
+    return c;
+  }
+};
+
+struct CoroPool;
+/* a thread with its own schedule, pinned coroutines only run here, others
+ * are taken from the tail of stealable by idle workers */
+struct CoroWorker {
+  pthread_spinlock_t lock;
+  CoroList           pinned,
+                     stealable;
+  uint32_t           turn,     /* alternates pinned and stealable */
+                     seed;     /* victim selection */
+  int                idx;
+  volatile int       parked;    /* waiting on park_cond for a push */
+  pthread_mutex_t    park_lock;
+  pthread_cond_t     park_cond;
+  Schedule         * sched;
+  CoroPool         * pool;
+  pthread_t          thr;
+
+  void push( coroutine_t *c ) {
+    bool backlog;
+    pthread_spin_lock( &this->lock );
+    c->queued = 1;
+    backlog = ( this->stealable.hd != NULL );
+    if ( c->pin >= 0 ) {
+      this->pinned.push_tl( c );
+      backlog = false;
+    }
+    else {
+      this->stealable.push_tl( c );
+    }
+    pthread_spin_unlock( &this->lock );
+    this->notify( backlog );
+  }
+  coroutine_t *pop( void ) {
+    coroutine_t * c;
+    pthread_spin_lock( &this->lock );
+    if ( ( this->turn++ & 1 ) == 0 ) {
+      if ( (c = this->pinned.pop_hd()) == NULL )
+        c = this->stealable.pop_hd();
+    }
+    else {
+      if ( (c = this->stealable.pop_hd()) == NULL )
+        c = this->pinned.pop_hd();
+    }
+    pthread_spin_unlock( &this->lock );
+    return c;
+  }
+  coroutine_t *steal_from( CoroWorker &w ) {
+    coroutine_t * c;
+    if ( w.stealable.tl == NULL ) /* racy peek, recheck under lock */
+      return NULL;
+    pthread_spin_lock( &w.lock );
+    c = w.stealable.pop_tl();
+    pthread_spin_unlock( &w.lock );
+    if ( c != NULL )
+      c->sch = this->sched;
+    return c;
+  }
+  coroutine_t *steal( void );
+  bool has_work( void ) const;
+  void notify( bool backlog );
+  void park( void );
+  void wake( void );
+  void run( void );
+};
+
+struct CoroPool {
+  CoroWorker * w;
+  int          nworkers;
+  uint32_t     next_idx;  /* round robin placement of unpinned */
+  volatile size_t live;   /* coroutines not dead */
+  volatile int idle;      /* workers parked */
+};
+
+static void
+worker_push( void *w,  coroutine_t *c )
+{
+  ((CoroWorker *) w)->push( c );
+}
+
+coroutine_t *
+CoroWorker::steal( void )
+{
+  int n = this->pool->nworkers;
+  this->seed = this->seed * 1103515245 + 12345;
+  for ( int i = 0, j = (int) ( ( this->seed >> 16 ) % n ); i < n; i++ ) {
+    if ( j != this->idx ) {
+      coroutine_t * c = this->steal_from( this->pool->w[ j ] );
+      if ( c != NULL )
+        return c;
+    }
+    if ( ++j == n )
+      j = 0;
+  }
+  return NULL;
+}
+
+/* a coroutine is queued that this worker may take, or the pool is done */
+bool
+CoroWorker::has_work( void ) const
+{
+  if ( this->pinned.hd != NULL || this->stealable.hd != NULL )
+    return true;
+  for ( int i = 0; i < this->pool->nworkers; i++ )
+    if ( this->pool->w[ i ].stealable.tl != NULL )
+      return true;
+  return this->pool->live == 0;
+}
+
+/* after a push, wake the owner if parked, or a parked thief when the owner
+ * already has stealable coroutines queued */
+void
+CoroWorker::notify( bool backlog )
+{
+  CoroPool * p = this->pool;
+  __sync_synchronize(); /* the push is visible before idle is read */
+  if ( p->idle == 0 )
+    return;
+  if ( this->parked ) {
+    this->wake();
+    return;
+  }
+  if ( backlog ) {
+    for ( int i = 0; i < p->nworkers; i++ ) {
+      if ( p->w[ i ].parked && &p->w[ i ] != cur_worker ) {
+        p->w[ i ].wake();
+        return;
+      }
+    }
+  }
+}
+
+/* sleep until notify() or the last coroutine is dead, the queues are tested
+ * after idle is counted, so a push that missed the count is seen */
+void
+CoroWorker::park( void )
+{
+  pthread_mutex_lock( &this->park_lock );
+  this->parked = 1;
+  __sync_fetch_and_add( &this->pool->idle, 1 );
+  if ( ! this->has_work() )
+    pthread_cond_wait( &this->park_cond, &this->park_lock );
+  __sync_fetch_and_sub( &this->pool->idle, 1 );
+  this->parked = 0;
+  pthread_mutex_unlock( &this->park_lock );
+}
+
+void
+CoroWorker::wake( void )
+{
+  pthread_mutex_lock( &this->park_lock );
+  if ( this->parked )
+    pthread_cond_signal( &this->park_cond );
+  pthread_mutex_unlock( &this->park_lock );
+}
+
+void
+CoroWorker::run( void )
+{
+  Schedule * s = this->sched;
+  uint32_t   spins = 0;
+  cur_worker = this;
+  while ( this->pool->live > 0 ) {
+    if ( s->heap_count + s->fd_count > 0 || s->cond_hd != NULL )
+      s->poll( 0 );
+    coroutine_t * c = this->pop();
+    if ( c == NULL && (c = this->steal()) == NULL ) {
+      /* block for parked timers and fds unless a cond must be tested,
+       * park when there is nothing to wait for, after a short spin */
+      if ( s->heap_count + s->fd_count > 0 && s->cond_hd == NULL )
+        s->poll( 1 );
+      else if ( s->cond_hd != NULL || ++spins < CORO_IDLE_SPINS )
+        sched_yield();
+      else {
+        this->park();
+        spins = 0;
+      }
+      continue;
+    }
+    spins = 0;
+    coroutine_resume( c );
+    if ( c->status == COROUTINE_DEAD ) {
+      /* the parked workers see live is zero and return */
+      if ( __sync_sub_and_fetch( &this->pool->live, 1 ) == 0 )
+        for ( int i = 0; i < this->pool->nworkers; i++ )
+          this->pool->w[ i ].wake();
+    }
+    /* parked unless yielded or woken while switching out */
+    else if ( ! __sync_bool_compare_and_swap( &c->queued, 3, 0 ) &&
+              c->queued == 2 ) {
+      c->queued = 0;
+      this->push( c );
+    }
+  }
+  cur_worker = NULL;
+}
+
+static void *
+worker_thread( void *w )
+{
+  ((CoroWorker *) w)->run();
+  return NULL;
+}
+
 extern "C" {
 
 schedule_t *
-coroutine_open( void )
+coroutine_open( size_t stack_size )
+{
+  return coroutine_open_mode( stack_size, COROUTINE_SHARED_STACK );
+}
+
+schedule_t *
+coroutine_open_mode( size_t stack_size,  int mode )
 {
-  return new ( aligned_malloc( sizeof( Schedule ) ) ) Schedule();
+  return new ( aligned_malloc( sizeof( Schedule ) ) ) Schedule( stack_size,
+                                                                mode );
 }
 
 void
@@ -142,6 +845,96 @@ coroutine_new( schedule_t *sched, coroutine_func_t func, void *user_data,
   return ((Schedule *) sched)->new_coroutine( func, user_data, name );
 }
 
+#ifdef CORO_ASM_SWITCH
+static void
+mainfunc( void *arg )
+{
+  Coroutine * c = (Coroutine *) arg;
+  c->func( c, c->ud );
+  Schedule  * s = (Schedule *) c->sch; /* may have been stolen */
+  c->status = COROUTINE_DEAD;
+  s->used--;
+  s->running = NULL;
+  aekv_coro_switch( &c->sp, s->main_sp ); /* does not return */
+}
+
+void
+coroutine_resume( coroutine_t *co )
+{
+  Coroutine * c = (Coroutine *) co;
+  Schedule  * s = (Schedule *) c->sch;
+  char      * top;
+
+  if ( s->mode == COROUTINE_SEPARATE_STACK ) {
+    switch ( c->status ) {
+      case COROUTINE_READY:
+        if ( c->stack == NULL )
+          c->stack = s->alloc_stack();
+        c->sp = coro_init_frame( s->stack_top( c->stack ), mainfunc, c );
+        break;
+      case COROUTINE_SUSPEND:
+        break;
+      default:
+        assert( 0 );
+        return;
+    }
+    s->pop_ready( c );
+    s->running = c;
+    c->status  = COROUTINE_RUNNING;
+    s->begin_run( c );
+    aekv_coro_switch( &s->main_sp, c->sp );
+    /* nothing to copy, stack goes back to the pool when done */
+    if ( c->status == COROUTINE_DEAD ) {
+      s->free_stack( c->stack );
+      c->stack = NULL;
+      s->release_dead( c );
+    }
+    return;
+  }
+  /* only a shared stack schedule maps the shared stack */
+  top = s->shared_stack() + s->stack_size;
+  switch ( c->status ) {
+    case COROUTINE_READY:
+      c->sp = coro_init_frame( top, mainfunc, c );
+      break;
+
+    case COROUTINE_SUSPEND:
+      memcpy( top - c->size, c->stack, c->size );
+      break;
+
+    default:
+      assert( 0 );
+      return;
+  }
+  s->pop_ready( c );
+  s->running = c;
+  c->status  = COROUTINE_RUNNING;
+  s->begin_run( c );
+  aekv_coro_switch( &s->main_sp, c->sp );
+  /* save the stack after the switch, c->sp is the exact bottom of it */
+  if ( c->status == COROUTINE_SUSPEND ) {
+    size_t sz = top - (char *) c->sp;
+    if ( c->cap < sz ) {
+      c->cap   = sz;
+      c->stack = (char *) realloc( c->stack, c->cap );
+    }
+    c->size = sz;
+    memcpy( c->stack, c->sp, sz );
+  }
+  else if ( c->status == COROUTINE_DEAD ) {
+    s->release_dead( c );
+  }
+}
+
+static void
+coro_switch_out( Coroutine *c,  Schedule *s )
+{
+  s->begin_switch_out( c );
+  c->status  = COROUTINE_SUSPEND;
+  s->running = NULL;
+  aekv_coro_switch( &c->sp, s->main_sp );
+}
+#else
 static uint32_t uint_upper( void *p ) { return ((uintptr_t) p ) >> 32; }
 static uint32_t uint_lower( void *p ) { return ((uintptr_t) p ); }
 static void * uint_toptr( uintptr_t i,  uintptr_t j ) {
@@ -152,11 +945,14 @@ static void
 mainfunc( uint32_t i,  uint32_t j )
 {
   Coroutine * c = (Coroutine *) uint_toptr( i, j );
-  Schedule  * s = (Schedule *) c->sch;
   c->func( c, c->ud );
+  Schedule  * s = (Schedule *) c->sch;
   c->status = COROUTINE_DEAD;
   s->used--;
   s->running = NULL;
+  /* uc_link is the main of the schedule it started on, it may have been
+   * stolen by another pool worker */
+  setcontext( &s->main );
 }
 
 void
@@ -167,27 +963,47 @@ coroutine_resume( coroutine_t *co )
 
   switch ( c->status ) {
     case COROUTINE_READY:
+      s->pop_ready( c );
       getcontext( &c->ctx );
-      c->ctx.uc_stack.ss_sp   = s->stack;
-      c->ctx.uc_stack.ss_size = STACK_SIZE;
+      if ( s->mode == COROUTINE_SEPARATE_STACK ) {
+        if ( c->stack == NULL )
+          c->stack = s->alloc_stack();
+        c->ctx.uc_stack.ss_sp   = s->stack_base( c->stack );
+        c->ctx.uc_stack.ss_size = s->stack_size;
+      }
+      else {
+        c->ctx.uc_stack.ss_sp   = s->shared_stack();
+        c->ctx.uc_stack.ss_size = s->stack_size;
+      }
       c->ctx.uc_link          = &s->main;
       c->sch->running         = c;
       c->status               = COROUTINE_RUNNING;
+      s->begin_run( c );
       makecontext( &c->ctx, (void ( * )( void )) mainfunc, 2,
                    uint_upper( c ), uint_lower( c ) );
       swapcontext( &s->main, &c->ctx );
       break;
 
     case COROUTINE_SUSPEND:
-      memcpy( s->stack + STACK_SIZE - c->size, c->stack, c->size );
+      s->pop_ready( c );
+      if ( s->mode != COROUTINE_SEPARATE_STACK )
+        memcpy( s->stack + s->stack_size - c->size, c->stack, c->size );
       s->running = c;
       c->status  = COROUTINE_RUNNING;
+      s->begin_run( c );
       swapcontext( &s->main, &c->ctx );
       break;
 
     default:
       assert( 0 );
   }
+  if ( c->status == COROUTINE_DEAD ) {
+    if ( s->mode == COROUTINE_SEPARATE_STACK ) {
+      s->free_stack( c->stack );
+      c->stack = NULL;
+    }
+    s->release_dead( c );
+  }
 }
 
 static void
@@ -202,16 +1018,127 @@ _save_stack( Coroutine *c, char *top )
   memcpy( c->stack, &dummy, c->size );
 }
 
+static void
+coro_switch_out( Coroutine *c,  Schedule *s )
+{
+  if ( s->mode != COROUTINE_SEPARATE_STACK )
+    _save_stack( c, s->stack + s->stack_size );
+  s->begin_switch_out( c );
+  c->status  = COROUTINE_SUSPEND;
+  s->running = NULL;
+  swapcontext( &c->ctx, &s->main );
+}
+#endif
+
+/* yield and stay runnable, coroutine_run() resumes it next pass */
 void
 coroutine_yield( coroutine_t *co )
 {
   Coroutine * c = (Coroutine *) co;
   Schedule  * s = (Schedule *) c->sch;
+  s->push_ready( c );
+  coro_switch_out( c, s );
+}
 
-  _save_stack( c, s->stack + STACK_SIZE );
-  c->status  = COROUTINE_SUSPEND;
-  s->running = NULL;
-  swapcontext( &c->ctx, &s->main );
+/* yield without being runnable, until coroutine_wake() */
+void
+coroutine_suspend( coroutine_t *co )
+{
+  Coroutine * c = (Coroutine *) co;
+  Schedule  * s = (Schedule *) c->sch;
+  /* woken by another worker after it tested its condition, test again */
+  if ( s->worker != NULL && __sync_bool_compare_and_swap( &c->queued, 4, 5 ) )
+    return;
+  coro_switch_out( c, s );
+}
+
+void
+coroutine_wake( coroutine_t *co )
+{
+  Schedule * s  = (Schedule *) co->sch;
+  int        st = *(volatile int *) &co->status;
+  if ( st == COROUTINE_SUSPEND || st == COROUTINE_READY )
+    s->unpark( co );
+  /* a pool coroutine running on another worker is between the test of its
+   * condition and coroutine_suspend(), the wake is left pending */
+  else if ( st == COROUTINE_RUNNING && s->worker != NULL )
+    s->push_ready( co );
+}
+
+void
+coroutine_sleep_ns( coroutine_t *co,  uint64_t ns )
+{
+  Coroutine * c = (Coroutine *) co;
+  Schedule  * s = (Schedule *) c->sch;
+  c->wait    = WAIT_TIMER;
+  c->wait_ns = coro_now_ns() + ns;
+  s->push_timer( c->wait_ns, c );
+  coro_switch_out( c, s );
+}
+
+/* fd is registered while waiting, it must not be in another wait */
+int
+coroutine_wait_fd( coroutine_t *co,  int fd,  int events )
+{
+  Coroutine * c = (Coroutine *) co;
+  Schedule  * s = (Schedule *) c->sch;
+  struct epoll_event ev;
+
+  if ( s->epfd < 0 && ( s->epfd = epoll_create1( EPOLL_CLOEXEC ) ) < 0 )
+    return -1;
+  ev.events   = (uint32_t) events;
+  ev.data.ptr = c;
+  if ( epoll_ctl( s->epfd, EPOLL_CTL_ADD, fd, &ev ) < 0 )
+    return -1;
+  s->fd_count++;
+  c->wait    = WAIT_FD;
+  c->wait_fd = fd;
+  c->revents = 0;
+  coro_switch_out( c, s );
+  return c->revents;
+}
+
+/* cond is tested by the scheduler each pass, the scheduler can't block while
+ * coroutines are waiting for a cond */
+void
+coroutine_wait_cond( coroutine_t *co,  int ( *cond )( void * ),  void *arg )
+{
+  Coroutine * c = (Coroutine *) co;
+  Schedule  * s = (Schedule *) c->sch;
+  if ( cond( arg ) )
+    return;
+  c->cond     = cond;
+  c->cond_arg = arg;
+  c->wait     = WAIT_COND;
+  c->back     = NULL;
+  c->next     = s->cond_hd;
+  if ( s->cond_hd != NULL )
+    s->cond_hd->back = c;
+  s->cond_hd  = c;
+  coro_switch_out( c, s );
+}
+
+int
+coroutine_poll( schedule_t *sched,  int timeout_ms )
+{
+  return ((Schedule *) sched)->poll( timeout_ms );
+}
+
+/* resume the coroutines that are ready now, those that yield during the pass
+ * run in the next pass */
+int
+coroutine_run( schedule_t *sched )
+{
+  Schedule * s = (Schedule *) sched;
+  size_t     n, i = 0;
+  if ( s->heap_count + s->fd_count > 0 || s->cond_hd != NULL )
+    s->poll( 0 );
+  n = s->ready_count;
+  while ( i < n && s->ready_hd != NULL ) {
+    coroutine_resume( s->ready_hd );
+    i++;
+  }
+  return (int) i;
 }
 
 int
@@ -231,4 +1158,100 @@ coroutine_name( coroutine_t *co )
 {
   return co->name;
 }
+
+coroutine_pool_t *
+coroutine_pool_open( int nworkers,  size_t stack_size )
+{
+  if ( nworkers <= 0 )
+    nworkers = (int) sysconf( _SC_NPROCESSORS_ONLN );
+  CoroPool * p = (CoroPool *) malloc( sizeof( CoroPool ) );
+  p->w        = (CoroWorker *) calloc( nworkers, sizeof( CoroWorker ) );
+  p->nworkers = nworkers;
+  p->next_idx = 0;
+  p->live     = 0;
+  p->idle     = 0;
+  for ( int i = 0; i < nworkers; i++ ) {
+    CoroWorker & w = p->w[ i ];
+    pthread_spin_init( &w.lock, PTHREAD_PROCESS_PRIVATE );
+    pthread_mutex_init( &w.park_lock, NULL );
+    pthread_cond_init( &w.park_cond, NULL );
+    w.seed  = (uint32_t) i + 1;
+    w.idx   = i;
+    w.pool  = p;
+    w.sched = (Schedule *) coroutine_open_mode( stack_size,
+                                                COROUTINE_SEPARATE_STACK );
+    w.sched->worker = &w;
+  }
+  return (coroutine_pool_t *) p;
+}
+
+/* before coroutine_pool_run() or from a pool coroutine, unpinned are placed
+ * round robin before the run and on the calling worker during it */
+coroutine_t *
+coroutine_pool_new( coroutine_pool_t *pool,  coroutine_func_t func,
+                    void *user_data,  const char *name,  int worker )
+{
+  CoroPool   * p = (CoroPool *) pool;
+  CoroWorker * w;
+  Coroutine  * c;
+
+  if ( worker >= p->nworkers )
+    worker %= p->nworkers;
+  if ( worker >= 0 )
+    w = &p->w[ worker ];
+  else if ( cur_worker != NULL && cur_worker->pool == p )
+    w = cur_worker;
+  else
+    w = &p->w[ p->next_idx++ % p->nworkers ];
+  __sync_fetch_and_add( &p->live, 1 );
+  /* allocated from the schedule of the calling thread, then queued on w */
+  Schedule * s  = ( cur_worker != NULL && cur_worker->pool == p ) ?
+                  cur_worker->sched : w->sched;
+  void     * sw = s->worker;
+  s->worker = NULL;
+  c = s->new_coroutine( func, user_data, name );
+  s->pop_ready( c );
+  s->worker = sw;
+  c->sch = w->sched;
+  c->pin = worker;
+  w->push( c );
+  return c;
+}
+
+int
+coroutine_pool_run( coroutine_pool_t *pool )
+{
+  CoroPool * p = (CoroPool *) pool;
+  int        i, n = 1;
+  for ( i = 1; i < p->nworkers; i++ ) {
+    if ( pthread_create( &p->w[ i ].thr, NULL, worker_thread,
+                         &p->w[ i ] ) != 0 )
+      break;
+    n++;
+  }
+  p->w[ 0 ].run();
+  for ( i = 1; i < n; i++ )
+    pthread_join( p->w[ i ].thr, NULL );
+  return n == p->nworkers ? 0 : -1;
+}
+
+void
+coroutine_pool_close( coroutine_pool_t *pool )
+{
+  CoroPool * p = (CoroPool *) pool;
+  for ( int i = 0; i < p->nworkers; i++ ) {
+    coroutine_close( p->w[ i ].sched );
+    pthread_spin_destroy( &p->w[ i ].lock );
+    pthread_mutex_destroy( &p->w[ i ].park_lock );
+    pthread_cond_destroy( &p->w[ i ].park_cond );
+  }
+  free( p->w );
+  free( p );
+}
+
+int
+coroutine_pool_worker( void )
+{
+  return cur_worker != NULL ? cur_worker->idx : -1;
+}
 }
@@ -2,30 +2,60 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <time.h>
 #include <sys/time.h>
 #include <errno.h>
+#include <math.h>
+#include <sys/mman.h>
 #include <netinet/in.h>
 #include <aekv/ev_aeron.h>
 #include <raikv/ev_publish.h>
 #include <raikv/delta_coder.h>
+#include <raikv/key_hash.h>
 extern "C" {
 #include <aeronc.h>
 #include <aeron_client.h>
+#include <hdr_histogram.h>
 }
 
 using namespace rai;
 using namespace aekv;
 using namespace kv;
 
-/* poll interval: 100us, hb ival: 200ms, timeout ival: 5s */
+/* poll interval: 100us, hb ival: 200ms, timeout ival: 5s, the timeout is a
+   ceiling, the phi detector usually expires a lost session sooner */
 static const uint64_t AERON_POLL_US      = 100,
                       AERON_HEARTBEAT_US = 200 * 1000,
                       AERON_TIMEOUT_NS   = AERON_HEARTBEAT_US * 1000 * 25;
-static const uint32_t POLL_EVENT_ID = 0,
-                      HB_EVENT_ID   = 1;
+static const uint32_t POLL_EVENT_ID     = 0,
+                      HB_EVENT_ID       = 1,
+                      SHUTDOWN_EVENT_ID = 2;
+/* close of the sub and pub is checked each poll interval, after a second the
+   streams are abandoned and freed by aeron_close() */
+static const uint32_t AERON_SHUTDOWN_TICKS = 1000000 / AERON_POLL_US;
+/* subs replayed to new peers per poll, while not back pressured */
+static const uint32_t AERON_REPLAY_BUDGET = 64;
+/* session stats are written to stats_path at this interval */
+static const uint64_t AERON_STATS_NS = 10 * (uint64_t) 1000000000;
+/* snapshot records appended are synced to disk at this interval */
+static const uint64_t AERON_SNAP_SYNC_NS = 1000000000;
+/* hellos are suppressed while data is sent, but one is sent at least this
+   often, it refreshes the bloom and samples the clock offset of a peer */
+static const uint64_t AERON_HB_MAX_NS = AERON_HEARTBEAT_US * 1000 * 5;
+/* phi accrual detector: default suspicion threshold, samples needed before
+   it is used, and the floor of the deviation, so a steady LAN does not expire
+   a peer on the first late hello */
+static const double   AERON_PHI_THRESHOLD   = 8.0;
+static const uint32_t AERON_PHI_MIN_SAMPLES = 8;
+static const double   AERON_PHI_MIN_STD_NS  = AERON_HEARTBEAT_US * 1000 / 4;
+/* restored routes of a session not confirmed when no replay end or confirm
+   is recvd within this time, for peers which do not send the replay end */
+static const uint64_t AERON_RESYNC_NS = 10 * (uint64_t) 1000000000;
+/* subject ids are reset when more than this are defined */
+static const uint32_t AERON_SUBJ_ID_MAX = 64 * 1024;
 #define CONDUCTOR
 /*static char aeron_dbg_path[ 40 ];*/
 
@@ -33,7 +63,13 @@ EvAeron::EvAeron( EvPoll &p ) noexcept
     : EvSocket( p, p.register_type( "aeron" ) ),
       KvSendQueue( p.create_ns(), p.ctx_id ),
       context( 0 ), aeron( 0 ), conductor( 0 ), pub( 0 ), sub( 0 ),
-      fragment_asm( 0 ), async_pub( 0 ), async_sub( 0 ), timer_id( 0 ),
+      fragment_asm( 0 ), async_pub( 0 ), async_sub( 0 ), images( 0 ),
+      image_count( 0 ), image_size( 0 ), pub_session_id( 0 ), snap( 0 ),
+      replay_off( 0 ), replay_left( 0 ), replay_gc( 0 ),
+      replay_budget( AERON_REPLAY_BUDGET ), replay_start( 0 ), stats_path( 0 ),
+      send_wait( 0 ), msg_wait( 0 ),
+      next_subj_id( 0 ), subj_epoch( 0 ), timer_id( 0 ),
+      send_ns( 0 ), last_send_ns( 0 ), last_hb_ns( 0 ), stats_ns( 0 ),
       max_payload_len( MAX_KV_MSG_SIZE ), timer_count( 0 ),
       shutdown_count( 0 ), aeron_flags( 0 )
 {
@@ -45,46 +81,81 @@ EvAeron::EvAeron( EvPoll &p ) noexcept
   printf( "debug: %s\n", aeron_dbg_path );*/
 }
 
-void
-print_avail_img( void *, aeron_subscription_t *subscription,
-                 aeron_image_t *image )
+/* track images, so that my publication is not polled, images may be
+   available before finish_init() sets sub, so the subscription is kept */
+static void
+avail_img( void *clientd,  aeron_subscription_t *subscription,
+           aeron_image_t *image )
 {
-  aeron_subscription_constants_t subscription_constants;
-  aeron_image_constants_t        image_constants;
+  aeron_image_constants_t image_constants;
 
-  if ( aeron_subscription_constants( subscription, &subscription_constants ) <
-         0 ||
-       aeron_image_constants( image, &image_constants ) < 0 ) {
-    fprintf( stderr, "could not get subscription/image constants: %s\n",
-             aeron_errmsg() );
+  if ( aeron_image_constants( image, &image_constants ) < 0 ) {
+    fprintf( stderr, "could not get image constants: %s\n", aeron_errmsg() );
+    return;
   }
-  /*
-  else {
-    printf( "Available image on %s streamId=%d sessionId=%d from %s\n",
-            subscription_constants.channel, subscription_constants.stream_id,
-            image_constants.session_id, image_constants.source_identity );
-  } */
+  /*printf( "Available image sessionId=%d from %s\n",
+          image_constants.session_id, image_constants.source_identity );*/
+  if ( aeron_subscription_image_retain( subscription, image ) < 0 ) {
+    fprintf( stderr, "could not retain image: %s\n", aeron_errmsg() );
+    return;
+  }
+  if ( ! ((EvAeron *) clientd)->add_image( subscription, image,
+                                           image_constants.session_id ) )
+    aeron_subscription_image_release( subscription, image );
 }
 
-void
-print_unavail_img( void *, aeron_subscription_t *subscription,
-                   aeron_image_t *image )
+static void
+unavail_img( void *clientd,  aeron_subscription_t *,  aeron_image_t *image )
 {
-  aeron_subscription_constants_t subscription_constants;
-  aeron_image_constants_t        image_constants;
+  /*printf( "Unavailable image\n" );*/
+  ((EvAeron *) clientd)->remove_image( image );
+}
+
+bool
+EvAeron::add_image( aeron_subscription_t *subscription,  aeron_image_t *image,
+                    int32_t session_id ) noexcept
+{
+  if ( this->image_count == this->image_size ) {
+    uint32_t sz = this->image_size + 16;
+    void   * p  = ::realloc( this->images, sz * sizeof( this->images[ 0 ] ) );
+    if ( p == NULL ) {
+      perror( "realloc images" );
+      return false;
+    }
+    this->images     = (AeronImage *) p;
+    this->image_size = sz;
+  }
+  this->images[ this->image_count ].subscription = subscription;
+  this->images[ this->image_count ].image        = image;
+  this->images[ this->image_count ].session_id   = session_id;
+  this->image_count++;
+  return true;
+}
 
-  if ( aeron_subscription_constants( subscription, &subscription_constants ) <
-         0 ||
-       aeron_image_constants( image, &image_constants ) < 0 ) {
-    fprintf( stderr, "could not get subscription/image constants: %s\n",
-             aeron_errmsg() );
+void
+EvAeron::remove_image( aeron_image_t *image ) noexcept
+{
+  for ( uint32_t i = 0; i < this->image_count; i++ ) {
+    if ( this->images[ i ].image == image ) {
+      aeron_subscription_image_release( this->images[ i ].subscription,
+                                        image );
+      this->images[ i ] = this->images[ --this->image_count ];
+      return;
+    }
   }
-  /*
-  else {
-    printf( "Unavailable image on %s streamId=%d sessionId=%d\n",
-            subscription_constants.channel, subscription_constants.stream_id,
-            image_constants.session_id );
-  }*/
+}
+
+void
+EvAeron::release_images( void ) noexcept
+{
+  for ( uint32_t i = 0; i < this->image_count; i++ )
+    aeron_subscription_image_release( this->images[ i ].subscription,
+                                      this->images[ i ].image );
+  if ( this->images != NULL )
+    ::free( this->images );
+  this->images      = NULL;
+  this->image_count = 0;
+  this->image_size  = 0;
 }
 /* allocate aeron client */
 EvAeron *
@@ -164,13 +235,15 @@ EvAeron::init_pubsub( const char *pub_channel,  int pub_stream_id,
   if ( status == 0 )
     status = aeron_start( this->aeron );
 #endif
+  /* exclusive, so that the session id of my image is not shared with the
+     other publishers on the channel and stream using the same driver */
   if ( status == 0 )
-    status = aeron_async_add_publication( &async_pub, this->aeron, pub_channel,
-                                          pub_stream_id );
+    status = aeron_async_add_exclusive_publication( &async_pub, this->aeron,
+                                                    pub_channel, pub_stream_id );
   if ( status == 0 )
     status = aeron_async_add_subscription( &async_sub, this->aeron, sub_channel,
-                                           sub_stream_id, print_avail_img,
-                                           NULL, print_unavail_img, NULL );
+                                           sub_stream_id, avail_img,
+                                           this, unavail_img, this );
   if ( status == 0 ) {
     this->set_ae( AE_FLAG_INIT );
     return true;
@@ -199,22 +272,26 @@ EvAeron::finish_init( void ) noexcept
 {
   int status;
   if ( this->pub == NULL ) {
-    status = aeron_async_add_publication_poll( &this->pub, this->async_pub );
+    status = aeron_async_add_exclusive_publication_poll( &this->pub,
+                                                         this->async_pub );
 #ifdef CONDUCTOR
     if ( status == 0 ) {
       aeron_client_conductor_do_work( this->conductor );
-      status = aeron_async_add_publication_poll( &this->pub, this->async_pub );
+      status = aeron_async_add_exclusive_publication_poll( &this->pub,
+                                                           this->async_pub );
     }
 #endif
     if ( status != 0 ) {
       if ( status > 0 ) {
         aeron_publication_constants_t c;
-        status = aeron_publication_constants( this->pub, &c );
-        if ( status == 0 )
+        status = aeron_exclusive_publication_constants( this->pub, &c );
+        if ( status == 0 ) {
           this->max_payload_len = c.max_payload_length;
+          this->pub_session_id  = c.session_id;
+        }
       }
       if ( status != 0 ) {
-        fprintf( stderr, "aeron_async_add_publication_poll: %d, %s\n",
+        fprintf( stderr, "aeron_async_add_exclusive_publication_poll: %d, %s\n",
                  status, aeron_errmsg() );
         this->push( EV_CLOSE );
         return false;
@@ -255,12 +332,15 @@ EvAeron::finish_init( void ) noexcept
 void
 EvAeron::release_aeron( void ) noexcept
 {
+  this->cancel_all_waits();
+  this->frame_pool.release();
+  this->release_images();
   if ( this->sub != NULL ) {
     aeron_subscription_close( this->sub, NULL, NULL );
     this->sub = NULL;
   }
   if ( this->pub != NULL ) {
-    aeron_publication_close( this->pub, NULL, NULL );
+    aeron_exclusive_publication_close( this->pub, NULL, NULL );
     this->pub = NULL;
   }
   if ( this->aeron != NULL ) {
@@ -284,6 +364,12 @@ EvAeron::release_aeron( void ) noexcept
   this->set_ae( AE_FLAG_SHUTDOWN );
 }
 
+/* the frame reserved value carries the send time, for latency at recv */
+static int64_t
+send_stamp( void *clientd,  uint8_t *,  size_t )
+{
+  return (int64_t) ((EvAeron *) clientd)->send_ns;
+}
 /* send the messages queued */
 void
 EvAeron::write( void ) noexcept
@@ -296,17 +382,21 @@ EvAeron::write( void ) noexcept
   if ( ! this->test_ae( AE_FLAG_SHUTDOWN | AE_FLAG_INIT ) ) {
     int64_t status;
     int retry_count = 0;
+    this->send_ns = kv_current_realtime_ns();
     while ( ! this->sendq.is_empty() ) {
       KvMsgList * l = this->sendq.hd;
     retry:;
-      if ( (status = aeron_publication_offer( this->pub,
+      if ( (status = aeron_exclusive_publication_offer( this->pub,
                                             (const uint8_t *) (void *) &l->msg,
-                                            l->msg.size, NULL, NULL )) < 0 ) {
+                                            l->msg.size, send_stamp,
+                                            this )) < 0 ) {
         /* toss messages, not connected */
         if ( status == AERON_PUBLICATION_NOT_CONNECTED ) {
           this->sendq.init();
           this->snd_wrk.reset();
           this->clear_ae( AE_FLAG_BACKPRESSURE );
+          if ( this->send_wait != NULL )
+            this->notify_send();
           return;
         }
         /* try again later */
@@ -320,9 +410,9 @@ EvAeron::write( void ) noexcept
           return;
         }
         if ( status == AERON_PUBLICATION_ADMIN_ACTION ) {
-          status = aeron_publication_offer( this->pub,
+          status = aeron_exclusive_publication_offer( this->pub,
                                             (const uint8_t *) (void *) &l->msg,
-                                            l->msg.size, NULL, NULL );
+                                            l->msg.size, send_stamp, this );
           if ( status < 0 ) {
             if ( ++retry_count < 3 ) /* retry once */
               goto retry;
@@ -333,12 +423,16 @@ EvAeron::write( void ) noexcept
           }
         }
         /* AERON_PUBLICATION_CLOSED, AERON_PUBLICATION_ERROR */
-        fprintf( stderr, "aeron_publication_offer: %ld, %s\n",
+        fprintf( stderr, "aeron_exclusive_publication_offer: %ld, %s\n",
                  status, aeron_errmsg() );
         this->push( EV_CLOSE );
         break;
       }
     success:;
+      /* the hello is not data, the timer tests the data sent since the
+         last tick, a hello would suppress the next one */
+      if ( l->msg.msg_type != KV_MSG_HELLO )
+        this->last_send_ns = this->cur_mono_ns;
       this->sendq.pop_hd();
     }
   }
@@ -347,6 +441,8 @@ EvAeron::write( void ) noexcept
 #endif
   this->clear_ae( AE_FLAG_BACKPRESSURE );
   this->snd_wrk.reset();
+  if ( this->send_wait != NULL )
+    this->notify_send();
 }
 /* read is handled by poll(), which is a timer based event */
 void
@@ -358,26 +454,25 @@ EvAeron::read( void ) noexcept
   if ( this->test_ae( AE_FLAG_SHUTDOWN | AE_FLAG_INIT ) == AE_FLAG_INIT )
     this->finish_init();
   if ( ! this->test_ae( AE_FLAG_SHUTDOWN | AE_FLAG_INIT ) ) {
-    for (;;) {
-      fragments_read = aeron_subscription_poll( this->sub,
-                                             aeron_fragment_assembler_handler,
-                                                this->fragment_asm,
-                                                fragment_count_limit );
-      /*if ( fragments_read == 0 &&
-           aeron_client_conductor_do_work( this->conductor ) > 0 ) {
-        fragments_read = aeron_subscription_poll( this->sub,
-                                               aeron_fragment_assembler_handler,
-                                                  this->fragment_asm,
-                                                  fragment_count_limit );
-      }*/
-      if ( fragments_read <= 0 ) {
-        if ( fragments_read == 0 )
+    /* poll each image, except the one of my publication, until empty */
+    do {
+      fragments_read = 0;
+      for ( uint32_t i = 0; i < this->image_count; i++ ) {
+        if ( this->images[ i ].session_id == this->pub_session_id &&
+             this->pub != NULL )
+          continue;
+        int n = aeron_image_poll( this->images[ i ].image,
+                                  aeron_fragment_assembler_handler,
+                                  this->fragment_asm, fragment_count_limit );
+        if ( n < 0 ) {
+          fprintf( stderr, "aeron_image_poll: %s\n", aeron_errmsg() );
+          this->push( EV_CLOSE );
+          fragments_read = 0;
           break;
-        fprintf( stderr, "aeron_subscription_poll: %s\n", aeron_errmsg() );
-        this->push( EV_CLOSE );
-        break;
+        }
+        fragments_read += n;
       }
-    }
+    } while ( fragments_read > 0 );
   }
   this->pop3( EV_READ, EV_READ_HI, EV_READ_LO );
 }
@@ -411,13 +506,15 @@ EvAeron::do_shutdown( void ) noexcept
   this->push( EV_SHUTDOWN );
 }
 
-/* shutdown aeron client */
+/* shutdown aeron client, the shutdown timer closes when sub and pub are
+   closed, the poll thread is not blocked waiting for the driver */
 void
 EvAeron::process_shutdown( void ) noexcept
 {
   this->start_shutdown();
-  /* stop notification of route +/- */
   if ( this->check_shutdown() )
+    this->pop( EV_SHUTDOWN );
+  else
     this->pushpop( EV_CLOSE, EV_SHUTDOWN );
 }
 
@@ -426,13 +523,17 @@ EvAeron::start_shutdown( void ) noexcept
 {
   if ( ! this->test_ae( AE_FLAG_SHUTDOWN ) ) {
     this->set_ae( AE_FLAG_SHUTDOWN );
-    this->timer_id = 0;
+    /* poll and hb timers stop with the old id */
+    this->timer_id = ++this->next_timer_id;
+    this->poll.add_timer_micros( this->fd, AERON_POLL_US, this->timer_id,
+                                 SHUTDOWN_EVENT_ID );
     this->shutdown_count = 1;
     this->poll.remove_route_notify( *this );
+    this->release_images();
     if ( this->sub != NULL )
       aeron_subscription_close( this->sub, sub_close_cb, this );
     if ( this->pub != NULL )
-      aeron_publication_close( this->pub, pub_close_cb, this );
+      aeron_exclusive_publication_close( this->pub, pub_close_cb, this );
   }
 }
 
@@ -441,17 +542,16 @@ EvAeron::check_shutdown( void ) noexcept
 {
   if ( this->shutdown_count != 0 &&
        ( this->sub != NULL || this->pub != NULL ) ) {
-    if ( ++this->shutdown_count == 1000 ) {
+#ifdef CONDUCTOR
+    /* runs sub_close_cb(), pub_close_cb() when the driver is done */
+    aeron_client_conductor_do_work( this->conductor );
+#endif
+    if ( ( this->sub != NULL || this->pub != NULL ) &&
+         ++this->shutdown_count >= AERON_SHUTDOWN_TICKS ) {
       fprintf( stderr, "failed to shutdown aeron\n" );
       this->sub = NULL;
       this->pub = NULL;
-      return false;
     }
-#ifdef CONDUCTOR
-    aeron_client_conductor_do_work( this->conductor );
-#else
-    usleep( 1 );
-#endif
   }
   return this->sub != NULL || this->pub != NULL;
 }
@@ -464,10 +564,17 @@ EvAeron::process_close( void ) noexcept
   this->clear_all_subs();
   this->sub_tab.release();
   this->pat_sub_tab.release();
+  this->resync_tab.release();
+  this->resync_pat_tab.release();
   this->my_peers.release();
   this->my_subs.release();
-  while ( this->check_shutdown() )
-    ;
+  this->subj_tab.release();
+  this->close_snapshot();
+  /* closed before the shutdown timer finished, aeron_close() frees them */
+  if ( this->check_shutdown() ) {
+    this->sub = NULL;
+    this->pub = NULL;
+  }
   this->release_aeron();
 }
 
@@ -489,25 +596,43 @@ EvAeron::timer_expire( uint64_t tid,  uint64_t event_id ) noexcept
       aeron_client_conductor_do_work( this->conductor );
 #endif
       this->read();
+      if ( this->replay_left != 0 || this->replay_start != 0 )
+        this->replay_my_subs();
       break;
     }
     case HB_EVENT_ID: {
       /*if ( ::unlink( aeron_dbg_path ) == 0 )
         this->print_stats();*/
       AeronSession *session =
-        this->my_peers.check_timeout( this->cur_mono_ns - AERON_TIMEOUT_NS );
+        this->my_peers.check_timeout( this->cur_mono_ns, AERON_TIMEOUT_NS );
       if ( session != NULL ) {
         this->send_dataloss( *session );
         this->my_peers.release_session( *session );
       }
-      KvMsg *m = this->create_kvmsg( KV_MSG_HELLO,
-                                     sizeof( KvMsg ) + sizeof( uint64_t ) );
-      uint64_t peer = this->my_peers.next_ping();
-      ::memcpy( &m[ 1 ], &peer, sizeof( uint64_t ) );
-      this->idle_push( EV_WRITE );
+      if ( this->my_peers.restored_count != 0 )
+        this->check_resync();
+      /* data sent within the interval is liveness, a hello is not needed
+         unless a new peer needs a ping or the hello is stale */
+      AeronSession * np = this->my_peers.unpinged();
+      if ( np != NULL ||
+           this->cur_mono_ns - this->last_send_ns >=
+             (uint64_t) AERON_HEARTBEAT_US * 1000 ||
+           this->cur_mono_ns - this->last_hb_ns >= AERON_HB_MAX_NS ) {
+        this->send_hello( np != NULL ? np->stamp : this->my_peers.next_ping() );
+      }
+      if ( this->stats_path != NULL &&
+           this->cur_mono_ns - this->stats_ns >= AERON_STATS_NS ) {
+        this->stats_ns = this->cur_mono_ns;
+        this->write_stats();
+      }
+      if ( this->snap != NULL &&
+           this->cur_mono_ns - this->snap->sync_ns >= AERON_SNAP_SYNC_NS ) {
+        this->snap->sync_ns = this->cur_mono_ns;
+        this->snap->sync();
+      }
 
       if ( this->timer_count > 0 ) {
-        if ( this->timer_count > this->my_peers.session_idx->elem_count + 3 ) {
+        if ( this->timer_count > this->my_peers.session_tab.count + 3 ) {
           this->on_connect();
           this->timer_count = 0;
         }
@@ -517,6 +642,13 @@ EvAeron::timer_expire( uint64_t tid,  uint64_t event_id ) noexcept
       }
       break;
     }
+    case SHUTDOWN_EVENT_ID: {
+      if ( this->check_shutdown() )
+        return true; /* check again next interval */
+      this->timer_id = 0;
+      this->push( EV_CLOSE );
+      return false;
+    }
   }
   return true;
 }
@@ -532,6 +664,8 @@ EvAeron::on_sub( uint32_t h,  const char *sub,  size_t sublen,
     this->create_kvsubmsg( h, sub, sublen, src_type, KV_MSG_SUB, 'L', rep,
                            rlen );
   this->my_subs.upsert( *submsg );
+  if ( this->snap != NULL )
+    this->snap_log( AERON_SNAP_MY_SUB, NULL, h, submsg, submsg->size, 0 );
 }
 /* when an unsubscribe occurs by an in process bridge */
 void
@@ -550,8 +684,11 @@ EvAeron::on_unsub( uint32_t h,  const char *sub,  size_t sublen,
   KvSubMsg *submsg =
     this->create_kvsubmsg( h, sub, sublen, src_type, KV_MSG_UNSUB,
                            do_unsubscribe ? 'D' : 'C', NULL, 0 );
-  if ( do_unsubscribe )
+  if ( do_unsubscribe ) {
     this->my_subs.remove( *submsg );
+    if ( this->snap != NULL )
+      this->snap_log( AERON_SNAP_MY_UNSUB, NULL, h, submsg, submsg->size, 0 );
+  }
 }
 /* a new pattern subscription by an in process bridge */
 void
@@ -565,6 +702,8 @@ EvAeron::on_psub( uint32_t h,  const char *pattern,  size_t patlen,
     this->create_kvpsubmsg( h, pattern, patlen, prefix, prefix_len, src_type,
                             KV_MSG_PSUB, 'L' );
   this->my_subs.upsert( *submsg );
+  if ( this->snap != NULL )
+    this->snap_log( AERON_SNAP_MY_SUB, NULL, h, submsg, submsg->size, 0 );
 }
 /* a new pattern unsubscribe by an in process bridge */
 void
@@ -584,34 +723,111 @@ EvAeron::on_punsub( uint32_t h,  const char *pattern,  size_t patlen,
   KvSubMsg *submsg =
     this->create_kvpsubmsg( h, pattern, patlen, prefix, prefix_len, src_type,
                             KV_MSG_PUNSUB, do_unsubscribe ? 'D' : 'C' );
-  if ( do_unsubscribe )
+  if ( do_unsubscribe ) {
     this->my_subs.remove_pattern( *submsg );
+    if ( this->snap != NULL )
+      this->snap_log( AERON_SNAP_MY_PUNSUB, NULL, h, submsg, submsg->size, 0 );
+  }
 }
-/* when new client appers on the network, publish my subscriptions */
+/* heartbeat with the peer pinged and the bloom of my subs */
+void
+EvAeron::send_hello( uint64_t peer ) noexcept
+{
+  KvMsg * m = this->create_kvmsg( KV_MSG_HELLO,
+                                  sizeof( KvMsg ) + sizeof( AeronHello ) );
+  uint8_t * p = (uint8_t *) (void *) &m[ 1 ];
+  uint64_t  t[ 3 ] = { kv_current_realtime_ns(), 0, 0 };
+  ::memcpy( &p[ offsetof( AeronHello, ping ) ], &peer, sizeof( uint64_t ) );
+  ::memcpy( &p[ offsetof( AeronHello, bloom ) ], &this->my_subs.get_bloom(),
+            sizeof( AeronBloom ) );
+  this->last_hb_ns = this->cur_mono_ns;
+  /* echo the ping peer's last hello, it computes offset and rtt */
+  if ( peer != 0 ) {
+    AeronSession * s = this->my_peers.find_session( peer );
+    if ( s != NULL ) {
+      this->my_peers.set_pinged( *s, this->cur_mono_ns );
+      t[ 1 ] = s->hello_ns;
+      t[ 2 ] = s->hello_recv;
+    }
+  }
+  ::memcpy( &p[ offsetof( AeronHello, send_ns ) ], t, sizeof( t ) );
+  this->idle_push( EV_WRITE );
+}
+/* when new client appers on the network, publish my subscriptions, the
+   publication is shared, so peers that join while a replay is running extend
+   it by a full cycle from the current position instead of starting another,
+   the cycle ends with AERON_MSG_REPLAY_END */
 void
 EvAeron::publish_my_subs( void ) noexcept
 {
-  uint32_t i = 0, j = 0;
-  while ( i < this->my_subs.subs_off ) {
+  if ( this->replay_left == 0 || this->replay_gc != this->my_subs.gc_count ) {
+    this->replay_gc = this->my_subs.gc_count;
+    if ( this->replay_left == 0 || this->replay_off > this->my_subs.subs_off )
+      this->replay_off = 0;
+  }
+  this->replay_left  = this->my_subs.subs_off;
+  this->replay_start = this->KvSendQueue::next_seqno + 1;
+  this->replay_my_subs();
+}
+/* paced by the timer, stops when back pressured */
+void
+EvAeron::replay_my_subs( void ) noexcept
+{
+  uint32_t n = 0;
+  if ( this->test_ae( AE_FLAG_BACKPRESSURE ) )
+    return;
+  /* subs[] was compacted, offsets changed, send the whole set again */
+  if ( this->replay_gc != this->my_subs.gc_count ) {
+    this->replay_gc    = this->my_subs.gc_count;
+    this->replay_off   = 0;
+    this->replay_left  = this->my_subs.subs_off;
+    this->replay_start = this->KvSendQueue::next_seqno + 1;
+  }
+  while ( this->replay_left != 0 && n < this->replay_budget ) {
+    if ( this->replay_off >= this->my_subs.subs_off ) {
+      this->replay_off = 0;
+      if ( this->my_subs.subs_off == 0 ) {
+        this->replay_left = 0;
+        break;
+      }
+    }
+    uint32_t i = this->replay_off;
     KvSubMsg &scan = *(KvSubMsg *) (void *) &this->my_subs.subs[ i + 1 ];
+    uint32_t k = MySubs::subs_align( scan.size ) / sizeof( uint32_t ) + 1;
     if ( scan.sublen != 0 ) {
       KvSubMsg & msg = *this->KvSendQueue::copy_kvsubmsg( scan );
       msg.set_seqno( ++this->KvSendQueue::next_seqno );
-      /*printf( "publish_sub: %.*s\n", msg.sublen, msg.subject() );*/
+      n++;
     }
-    i += MySubs::subs_align( scan.size ) / sizeof( uint32_t ) + 1;
-    j++;
+    this->replay_off += k;
+    this->replay_left = ( k < this->replay_left ? this->replay_left - k : 0 );
   }
-  this->idle_push( EV_WRITE );
+  /* every sub is sent or was sent since the start, a peer confirming its
+     restored routes removes the ones not in the cycle */
+  if ( this->replay_left == 0 && this->replay_start != 0 ) {
+    AeronReplayEndMsg end;
+    KvMsg * m = this->create_kvmsg( AERON_MSG_REPLAY_END,
+                                    sizeof( KvMsg ) + sizeof( end ) );
+    end.start_seqno = this->replay_start;
+    ::memcpy( &m[ 1 ], &end, sizeof( end ) );
+    this->replay_start = 0;
+    n++;
+  }
+  if ( n != 0 )
+    this->idle_push( EV_WRITE );
 }
 /* a cache for subscritions */
 MySubs::MySubs() noexcept
 {
+  this->subs_gen  = 0;
+  this->bloom_gen = 1;
+  this->gc_count  = 0;
   this->subsc_idx = UIntHashTab::resize( NULL );
   this->subs      = NULL;
   this->subs_free = 0;
   this->subs_off  = 0;
   this->subs_size = 0;
+  this->subs_gen++;
 }
 
 void
@@ -625,6 +841,8 @@ MySubs::release( void ) noexcept
   this->subs_free = 0;
   this->subs_off  = 0;
   this->subs_size = 0;
+  this->subs_gen++;
+  this->gc_count++;
 }
 
 /* append submsg to cache */
@@ -655,6 +873,7 @@ MySubs::upsert( KvSubMsg &msg ) noexcept
   size_t   pos;
   uint32_t head, next, prev, i;
 
+  this->subs_gen++;
   if ( this->subs_free * 2 > this->subs_size && this->subs_free > 1024 )
     this->gc();
   if ( this->subsc_idx->find( msg.hash, pos, head ) ) {
@@ -702,6 +921,7 @@ MySubs::remove( KvSubMsg &msg ) noexcept
   size_t   pos;
   uint32_t head, prev, i;
 
+  this->subs_gen++;
   if ( this->subsc_idx->find( msg.hash, pos, head ) ) {
     prev = 0;
     for ( i = head; i != 0; i = this->subs[ i - 1 ] ) {
@@ -739,6 +959,7 @@ MySubs::remove_pattern( KvSubMsg &msg ) noexcept
   size_t   pos;
   uint32_t head, prev, i;
 
+  this->subs_gen++;
   if ( this->subsc_idx->find( msg.hash, pos, head ) ) {
     prev = 0;
     for ( i = head; i != 0; i = this->subs[ i - 1 ] ) {
@@ -772,12 +993,30 @@ MySubs::remove_pattern( KvSubMsg &msg ) noexcept
     }
   }
 }
+/* hashes of subjects and pattern prefixes, pattern hash is the prefix hash */
+const AeronBloom &
+MySubs::get_bloom( void ) noexcept
+{
+  if ( this->bloom_gen != this->subs_gen ) {
+    uint32_t i = 0;
+    this->bloom.zero();
+    while ( i < this->subs_off ) {
+      KvSubMsg &scan = *(KvSubMsg *) (void *) &this->subs[ i + 1 ];
+      if ( scan.sublen != 0 )
+        this->bloom.add( scan.hash );
+      i += subs_align( scan.size ) / sizeof( uint32_t ) + 1;
+    }
+    this->bloom_gen = this->subs_gen;
+  }
+  return this->bloom;
+}
 /* recover space by moving active elements to head of subs[] array */
 void
 MySubs::gc( void ) noexcept
 {
   uint32_t i = 0, j = 0;
 
+  this->gc_count++;
   this->subsc_idx->clear_all();
   while ( i < this->subs_off ) {
     KvSubMsg &scan = *(KvSubMsg *) (void *) &this->subs[ i + 1 ];
@@ -805,8 +1044,15 @@ MySubs::gc( void ) noexcept
 bool
 EvAeron::on_msg( EvPublish &pub ) noexcept
 {
-  /* no publish to self */
-  if ( (uint32_t) this->fd != pub.src_route ) {
+  /* no publish to self, or when no peer is subscribed */
+  if ( (uint32_t) this->fd != pub.src_route &&
+       this->my_peers.maybe_pub( pub.subj_hash, pub.prefix_cnt, pub.hash ) ) {
+    /* a new peer may not have seen the subject ids defined */
+    if ( this->test_ae( AE_FLAG_SUBJ_ID ) && this->my_peers.new_count == 0 &&
+         this->publish_subj_id( pub ) ) {
+      this->idle_push( EV_WRITE );
+      return true;
+    }
     this->create_kvpublish( pub.subj_hash, pub.subject, pub.subject_len,
                             pub.prefix, pub.hash, pub.prefix_cnt,
                             (const char *) pub.reply, pub.reply_len, pub.msg,
@@ -819,14 +1065,121 @@ EvAeron::on_msg( EvPublish &pub ) noexcept
   /* hash backperssure, could be more specific for the stream destination */
 /*  return false; */
 }
+/* publish with subject id if defined, otherwise define it and return false
+ * so that the subject is sent with the publish */
+bool
+EvAeron::publish_subj_id( EvPublish &pub ) noexcept
+{
+  RouteLoc         loc;
+  AeronSubjRoute * rt;
+  uint32_t         sig = AeronSubjRoute::make_sig( pub.prefix_cnt, pub.prefix );
+  size_t           sz  = sizeof( KvMsg ) + sizeof( AeronPubIdMsg ) +
+                         pub.reply_len + pub.msg_len;
+
+  /* too large for an id publish, the full publish does not need the id
+     defined, so an id in use is left as is */
+  if ( sz > this->max_payload_len )
+    return false;
+  if ( this->subj_tab.pop_count() >= AERON_SUBJ_ID_MAX )
+    this->reset_subj_ids();
+  rt = this->subj_tab.upsert( pub.subj_hash, pub.subject, pub.subject_len,
+                              loc );
+  if ( rt == NULL )
+    return false;
+  if ( loc.is_new )
+    rt->id = ++this->next_subj_id;
+  /* if prefixes routed have not changed, the id is sufficient */
+  else if ( rt->prefix_sig == sig ) {
+    AeronPubIdMsg hdr;
+    KvMsg   * m = this->create_kvmsg( AERON_MSG_PUB_ID, sz );
+    uint8_t * p = (uint8_t *) (void *) &m[ 1 ];
+    hdr.id       = rt->id;
+    hdr.msg_size = pub.msg_len;
+    hdr.epoch    = this->subj_epoch;
+    hdr.replylen = pub.reply_len;
+    hdr.msg_enc  = pub.msg_enc;
+    hdr.code     = pub.pub_type;
+    hdr.pad[ 0 ] = hdr.pad[ 1 ] = 0;
+    ::memcpy( p, &hdr, sizeof( hdr ) );
+    p = &p[ sizeof( hdr ) ];
+    ::memcpy( p, pub.reply, pub.reply_len );
+    ::memcpy( &p[ pub.reply_len ], pub.msg, pub.msg_len );
+    return true;
+  }
+  rt->prefix_sig = sig;
+  /* peers define id from the subject of the publish which follows */
+  AeronSubjIdMsg def;
+  KvMsg * m = this->create_kvmsg( AERON_MSG_SUBJ_ID,
+                                  sizeof( KvMsg ) + sizeof( AeronSubjIdMsg ) );
+  def.id    = rt->id;
+  def.epoch = this->subj_epoch;
+  def.pad   = 0;
+  ::memcpy( &m[ 1 ], &def, sizeof( def ) );
+  return false;
+}
+/* forget subject ids sent, peers redefine them with the next epoch */
+void
+EvAeron::reset_subj_ids( void ) noexcept
+{
+  this->subj_tab.release();
+  this->next_subj_id = 0;
+  this->subj_epoch++;
+}
+/* recv a publish by subject id, request a reset if the id is not known */
+void
+EvAeron::on_pub_id( AeronSession &session,  const uint8_t *buffer,
+                    size_t length ) noexcept
+{
+  AeronPubIdMsg    hdr;
+  AeronSubjEntry * ent;
+  size_t           off = sizeof( KvMsg ) + sizeof( AeronPubIdMsg );
+
+  if ( length < off )
+    return;
+  ::memcpy( &hdr, &buffer[ sizeof( KvMsg ) ], sizeof( hdr ) );
+  if ( off + hdr.replylen + hdr.msg_size > length )
+    return;
+  if ( (ent = session.get_subj( hdr.id, hdr.epoch )) == NULL ) {
+    /* the definition was lost, counted, then request once per epoch,
+       subj_reset is epoch + 1 */
+    session.stats.subj_drop++;
+    if ( session.subj_reset != (uint16_t) ( hdr.epoch + 1 ) ) {
+      session.subj_reset = hdr.epoch + 1;
+      fprintf( stderr, "session %u subject id %u epoch %u unknown, reset\n",
+               session.id, hdr.id, hdr.epoch );
+      KvMsg * m = this->create_kvmsg( AERON_MSG_SUBJ_RESET,
+                                      sizeof( KvMsg ) + sizeof( uint64_t ) );
+      ::memcpy( &m[ 1 ], &session.stamp, sizeof( uint64_t ) );
+      this->idle_push( EV_WRITE );
+    }
+    return;
+  }
+  session.pub_count++;
+  EvPublish pub( ent->value, ent->len,
+                 &buffer[ off ], hdr.replylen,
+                 &buffer[ off + hdr.replylen ], hdr.msg_size,
+                 this->fd, ent->hash, NULL, 0,
+                 hdr.msg_enc, hdr.code );
+  if ( this->msg_wait != NULL )
+    this->notify_msg( pub );
+  this->poll.forward_msg( pub, NULL, ent->prefix_cnt, ent->prefix_array() );
+}
+/* the aekv types are not known to KvMsg::is_valid() */
+static inline bool
+is_valid_msg( KvMsg &msg,  size_t length )
+{
+  if ( length >= sizeof( KvMsg ) && msg.msg_type >= AERON_MSG_SUBJ_ID )
+    return msg.size >= sizeof( KvMsg ) && msg.size <= length;
+  return msg.is_valid( length );
+}
 /* recv a message from aeron network and route to bridge protos */
 void
 EvAeron::on_poll_handler( const uint8_t *buffer,  size_t length,
-                          aeron_header_t * ) noexcept
+                          aeron_header_t *header ) noexcept
 {
   KvMsg  & msg = *(KvMsg *) (void *) buffer;
 
-  if ( ! msg.is_valid( length ) ) {
+  if ( ! is_valid_msg( msg, length ) ) {
     fprintf( stderr, "Invalid message, length %lu < %u\n", length, msg.size );
     KvHexDump::dump_hex( buffer, length < 256 ? length : 256 );
     return;
@@ -853,13 +1206,43 @@ EvAeron::on_poll_handler( const uint8_t *buffer,  size_t length,
     return;
   if ( session->test( SESSION_DATALOSS ) ) {
     session->clear( SESSION_DATALOSS );
+    session->stats.gap_count++;
+    if ( (int64_t) session->delta_seqno > 1 )
+      session->stats.gap_seqno += session->delta_seqno - 1;
     if ( msg.msg_type != KV_MSG_BYE )
       this->send_dataloss( *session );
   }
+  else if ( session->resync_seqno != 0 && session->resync_ns == 0 )
+    session->resync_ns = this->cur_mono_ns; /* first frame after restore */
+  if ( this->cur_mono_ns - session->last_live >=
+       (uint64_t) AERON_HEARTBEAT_US * 1000 / 2 )
+    session->live_arrival( this->cur_mono_ns );
   session->last_active = this->cur_mono_ns;
+  session->count_msg( msg.msg_type, msg.size );
 
+  if ( msg.msg_type == KV_MSG_PUBLISH || msg.msg_type == AERON_MSG_PUB_ID ) {
+    aeron_header_values_t hv;
+    /* zero when sender does not stamp frames */
+    if ( header != NULL && aeron_header_values( header, &hv ) == 0 &&
+         hv.frame.reserved_value > 0 ) {
+      /* stamp is peer clock, offset moves it to mine */
+      int64_t lat = (int64_t) kv_current_realtime_ns() -
+                    hv.frame.reserved_value + session->clock_offset;
+      if ( lat > 0 )
+        session->record_latency( (uint64_t) lat );
+    }
+  }
+
+  if ( msg.msg_type == AERON_MSG_PUB_ID ) {
+    this->on_pub_id( *session, buffer, msg.size );
+    return;
+  }
   if ( msg.msg_type == KV_MSG_PUBLISH ) {
     KvSubMsg & submsg = (KvSubMsg &) msg;
+    if ( session->subj_pending != 0 ) {
+      session->set_subj( session->subj_pending, submsg );
+      session->subj_pending = 0;
+    }
     if ( session->frag == NULL ) {
     do_dispatch:;
       /* forward message from publisher to shm */
@@ -869,6 +1252,8 @@ EvAeron::on_poll_handler( const uint8_t *buffer,  size_t length,
                      submsg.get_msg_data(), submsg.msg_size,
                      this->fd, submsg.hash, NULL, 0,
                      submsg.msg_enc, submsg.code );
+      if ( this->msg_wait != NULL )
+        this->notify_msg( pub );
       this->poll.forward_msg( pub, NULL, submsg.get_prefix_cnt(),
                               submsg.prefix_array() );
       return;
@@ -881,126 +1266,144 @@ EvAeron::on_poll_handler( const uint8_t *buffer,  size_t length,
                      frag->buf, frag->msg_size,
                      this->fd, submsg.hash, NULL, 0,
                      submsg.msg_enc, submsg.code );
+      if ( this->msg_wait != NULL )
+        this->notify_msg( pub );
       this->poll.forward_msg( pub, NULL, submsg.get_prefix_cnt(),
                               submsg.prefix_array() );
       KvFragAsm::release( session->frag );
       return;
     }
     fprintf( stderr, "kv fragment dropped\n" );
+    session->stats.frag_drop++;
     goto do_dispatch;
   }
 
-  AeronSubStatus stat;
-  int            rcnt;
   switch ( msg.msg_type ) {
     case KV_MSG_FRAGMENT:
       KvFragAsm::merge( session->frag, (KvSubMsg &) msg );
       break;
     case KV_MSG_SUB: { /* update my routing table when sub/unsub occurs */
       KvSubMsg &submsg = (KvSubMsg &) msg;
-      rcnt = 2; /* if alredy exists, there are at least 2 */
-      stat = this->sub_tab.put( submsg.hash, submsg.subject(),
-                                submsg.sublen, session->id );
-      if ( stat == AERON_SUB_NEW ) {
-        /*printf( "new_sub: %.*s\n", submsg.sublen, submsg.subject() );*/
-        rcnt = this->poll.sub_route.add_sub_route( submsg.hash, this->fd );
-        session->sub_count++; /* session was added */
-      }
-      /*if ( stat != AERON_SUB_EXISTS )*/
-      this->poll.notify_sub( submsg.hash, submsg.subject(), submsg.sublen,
-                             this->fd, rcnt, 'A',
-                             submsg.reply(), submsg.replylen );
+      this->add_sub( *session, submsg.hash, submsg.subject(), submsg.sublen,
+                     submsg.reply(), submsg.replylen );
+      if ( this->snap != NULL )
+        this->snap_log( AERON_SNAP_SUB, session, submsg.hash,
+                        submsg.subject(), submsg.sublen, 0 );
       break;
     }
     case KV_MSG_UNSUB: {
       KvSubMsg &submsg = (KvSubMsg &) msg;
-      rcnt = 2;
-      if ( submsg.code == 'D' ) { /* subscription is retired, remove route */
-        stat = this->sub_tab.rem( submsg.hash, submsg.subject(), submsg.sublen,
-                                  session->id );
-        if ( stat == AERON_SUB_REMOVED ) {
-          /*printf( "rem_sub: %.*s\n", submsg.sublen, submsg.subject() );*/
-          if ( this->sub_tab.tab.find_by_hash( submsg.hash ) == NULL )
-            rcnt = this->poll.sub_route.del_sub_route( submsg.hash, this->fd );
-          session->sub_count--;
-        }
-      }
-      /*if ( stat != AERON_SUB_NOT_FOUND )*/
-      this->poll.notify_unsub( submsg.hash, submsg.subject(), submsg.sublen,
-                               this->fd, rcnt, 'A' );
+      /* if code == 'D', subscription is retired, remove route */
+      this->rem_sub( *session, submsg.hash, submsg.subject(), submsg.sublen,
+                     submsg.code == 'D' );
+      if ( this->snap != NULL && submsg.code == 'D' )
+        this->snap_log( AERON_SNAP_UNSUB, session, submsg.hash,
+                        submsg.subject(), submsg.sublen, 0 );
       break;
     }
     case KV_MSG_PSUB: {
       KvSubMsg &submsg = (KvSubMsg &) msg;
-      rcnt = 2;
-      stat = this->pat_sub_tab.put( submsg.hash, submsg.subject(),
-                                    submsg.sublen + submsg.replylen + 2,
-                                    submsg.replylen, session->id );
-      if ( stat == AERON_SUB_NEW ) {
-        /*printf( "add_psub: %.*s\n", submsg.sublen, submsg.subject() );*/
-        rcnt = this->poll.sub_route.add_pattern_route( submsg.hash, this->fd,
-                                                       submsg.replylen );
-        session->psub_count++; /* session was added */
-      }
-      this->poll.notify_psub( submsg.hash, submsg.subject(), submsg.sublen,
-                              submsg.reply(), submsg.replylen,
-                              this->fd, rcnt, 'A' );
+      /* pattern and prefix are null terminated and contiguous */
+      this->add_psub( *session, submsg.hash, submsg.subject(),
+                      submsg.sublen + submsg.replylen + 2, submsg.replylen );
+      if ( this->snap != NULL )
+        this->snap_log( AERON_SNAP_PSUB, session, submsg.hash,
+                        submsg.subject(), submsg.sublen + submsg.replylen + 2,
+                        submsg.replylen );
       break;
     }
     case KV_MSG_PUNSUB: {
       KvSubMsg &submsg = (KvSubMsg &) msg;
-      AeronTmpList tmp;
-      rcnt = 2;
-      if ( submsg.code == 'D' ) { /* subscription is retired, remove route */
-        stat = this->pat_sub_tab.rem( submsg.hash, submsg.reply(),
-                                      submsg.replylen, session->id, tmp ); 
-        if ( stat == AERON_SUB_OK ) {
-          if ( tmp.list.hd != NULL ) {
-            /*for ( AeronTmpElem *el = tmp.list.hd; el != NULL; el = el->next )
-              printf( "rem_psub: %.*s\n", (int) el->x.pattern_len(),
-                                                el->x.pattern() );*/
-            rcnt =
-              this->poll.sub_route.del_pattern_route( submsg.hash, this->fd,
-                                                      submsg.replylen );
-          }
-          session->psub_count--;
-        }
-        else {
-          printf( "stat %d\n", stat );
-        }
-      }
-      else {
+      if ( submsg.code != 'D' ) {
         printf( "code %c\n", submsg.code );
+        break;
       }
-      for ( AeronTmpElem *el = tmp.list.hd; el != NULL; el = el->next ) {
-        this->poll.notify_punsub( submsg.hash, el->x.pattern(),
-                                  el->x.pattern_len(), el->x.prefix(),
-                                  el->x.prefix_len(), this->fd, rcnt, 'A' );
-      }
+      this->rem_psub( *session, submsg.hash, submsg.reply(), submsg.replylen );
+      if ( this->snap != NULL )
+        this->snap_log( AERON_SNAP_PUNSUB, session, submsg.hash,
+                        submsg.reply(), submsg.replylen, submsg.replylen );
       break;
     }
     case KV_MSG_HELLO: {
       uint64_t ping;
       if ( msg.size >= sizeof( KvMsg ) + sizeof( uint64_t ) ) {
         ::memcpy( &ping, &buffer[ sizeof( KvMsg ) ], sizeof( uint64_t ) );
+        /* the bloom of the sender's subs, absent from older peers */
+        if ( msg.size >= sizeof( KvMsg ) + offsetof( AeronHello, bloom ) +
+                         sizeof( AeronBloom ) ) {
+          const uint8_t * b = &buffer[ sizeof( KvMsg ) +
+                                       offsetof( AeronHello, bloom ) ];
+          if ( ! session->has_bloom ||
+               ::memcmp( &session->bloom, b, sizeof( AeronBloom ) ) != 0 ) {
+            ::memcpy( &session->bloom, b, sizeof( AeronBloom ) );
+            session->has_bloom = 1;
+            this->my_peers.bloom_dirty = true;
+          }
+        }
+        /* timestamps, absent from older peers */
+        if ( msg.size >= sizeof( KvMsg ) + sizeof( AeronHello ) ) {
+          uint64_t t[ 3 ], now = kv_current_realtime_ns();
+          ::memcpy( t, &buffer[ sizeof( KvMsg ) +
+                                offsetof( AeronHello, send_ns ) ], sizeof( t ) );
+          if ( ping == this->KvSendQueue::stamp && t[ 1 ] != 0 )
+            session->clock_sample( t[ 1 ], t[ 2 ], t[ 0 ], now );
+          session->hello_ns   = t[ 0 ];
+          session->hello_recv = now;
+        }
         if ( ping == this->KvSendQueue::stamp ) {
           if ( session->test( SESSION_NEW ) ) {
-            session->clear( SESSION_NEW );
+            this->my_peers.clear_new( *session );
             if ( msg.msg_type != KV_MSG_BYE )
               this->publish_my_subs();
+            /* all peers recv my publication, subject ids are defined again
+               so that the new peers see the definitions */
+            if ( this->my_peers.new_count == 0 &&
+                 this->test_ae( AE_FLAG_SUBJ_ID ) )
+              this->reset_subj_ids();
           }
         }
       }
       else {
-        KvMsg *m = this->create_kvmsg( KV_MSG_HELLO,
-                                       sizeof( KvMsg ) + sizeof( uint64_t ) );
-        uint64_t peer = 0;
-        ::memcpy( &m[ 1 ], &peer, sizeof( uint64_t ) );
-        this->idle_push( EV_WRITE );
+        this->send_hello( 0 );
+      }
+      break;
+    }
+    case AERON_MSG_SUBJ_ID: {
+      AeronSubjIdMsg def;
+      if ( msg.size >= sizeof( KvMsg ) + sizeof( AeronSubjIdMsg ) ) {
+        ::memcpy( &def, &buffer[ sizeof( KvMsg ) ], sizeof( def ) );
+        if ( def.epoch != session->subj_epoch ) {
+          session->release_subj();
+          session->subj_epoch = def.epoch;
+        }
+        session->subj_pending = def.id;
+      }
+      break;
+    }
+    case AERON_MSG_SUBJ_RESET: {
+      uint64_t stamp;
+      if ( msg.size >= sizeof( KvMsg ) + sizeof( uint64_t ) ) {
+        ::memcpy( &stamp, &buffer[ sizeof( KvMsg ) ], sizeof( uint64_t ) );
+        if ( stamp == this->KvSendQueue::stamp )
+          this->reset_subj_ids();
+      }
+      break;
+    }
+    case AERON_MSG_REPLAY_END: {
+      AeronReplayEndMsg end;
+      if ( session->resync_seqno != 0 &&
+           msg.size >= sizeof( KvMsg ) + sizeof( AeronReplayEndMsg ) ) {
+        ::memcpy( &end, &buffer[ sizeof( KvMsg ) ], sizeof( end ) );
+        /* the cycle started after my first frame, all of it was recvd */
+        if ( end.start_seqno >= session->resync_seqno )
+          this->end_resync( *session, true );
       }
       break;
     }
     case KV_MSG_BYE:
+      this->my_peers.clear_new( *session );
+      if ( session->test( SESSION_RESTORED ) )
+        this->end_resync( *session, false );
       session->clear();
       session->set( SESSION_BYE );
       this->clear_session( *session );
@@ -1017,6 +1420,99 @@ EvAeron::poll_handler( void *clientd, const uint8_t *buffer,
 {
   ((EvAeron *) clientd)->on_poll_handler( buffer, length, header );
 }
+/* add session to the subject route, notify bridges of the subscription */
+void
+EvAeron::add_sub( AeronSession &session,  uint32_t h,  const char *sub,
+                  uint16_t sublen,  const char *rep,  uint16_t replen ) noexcept
+{
+  uint32_t rcnt = 2; /* if alredy exists, there are at least 2 */
+  AeronSubStatus stat = this->sub_tab.put( h, sub, sublen, session.id );
+  /* a restored route confirmed by the replay, the bridges have it */
+  if ( session.resync_seqno != 0 ) {
+    this->resync_tab.put( h, sub, sublen, session.id );
+    session.resync_ns = this->cur_mono_ns;
+    if ( stat == AERON_SUB_EXISTS )
+      return;
+  }
+  if ( stat == AERON_SUB_NEW ) {
+    /*printf( "new_sub: %.*s\n", sublen, sub );*/
+    rcnt = this->poll.sub_route.add_sub_route( h, this->fd );
+    session.sub_count++; /* session was added */
+  }
+  this->my_peers.add_bloom( session, h );
+  /*if ( stat != AERON_SUB_EXISTS )*/
+  this->poll.notify_sub( h, sub, sublen, this->fd, rcnt, 'A', rep, replen );
+}
+/* remove session from the subject route, if retired */
+void
+EvAeron::rem_sub( AeronSession &session,  uint32_t h,  const char *sub,
+                  uint16_t sublen,  bool retired ) noexcept
+{
+  uint32_t rcnt = 2;
+  if ( retired ) {
+    AeronSubStatus stat = this->sub_tab.rem( h, sub, sublen, session.id );
+    if ( stat == AERON_SUB_REMOVED ) {
+      /*printf( "rem_sub: %.*s\n", sublen, sub );*/
+      if ( this->sub_tab.tab.find_by_hash( h ) == NULL )
+        rcnt = this->poll.sub_route.del_sub_route( h, this->fd );
+      session.sub_count--;
+    }
+  }
+  /*if ( stat != AERON_SUB_NOT_FOUND )*/
+  this->poll.notify_unsub( h, sub, sublen, this->fd, rcnt, 'A' );
+}
+/* add session to the pattern route, value is pattern + prefix */
+void
+EvAeron::add_psub( AeronSession &session,  uint32_t h,  const char *value,
+                   uint16_t len,  uint16_t pref ) noexcept
+{
+  uint32_t rcnt = 2;
+  size_t   patlen = len - ( pref + 2 );
+  AeronSubStatus stat = this->pat_sub_tab.put( h, value, len, pref,
+                                               session.id );
+  if ( session.resync_seqno != 0 ) {
+    this->resync_pat_tab.put( h, value, len, session.id );
+    session.resync_ns = this->cur_mono_ns;
+    if ( stat == AERON_SUB_EXISTS )
+      return;
+  }
+  if ( stat == AERON_SUB_NEW ) {
+    /*printf( "add_psub: %.*s\n", (int) patlen, value );*/
+    rcnt = this->poll.sub_route.add_pattern_route( h, this->fd, pref );
+    session.psub_count++; /* session was added */
+  }
+  this->my_peers.add_bloom( session, h );
+  this->poll.notify_psub( h, value, patlen, &value[ patlen + 1 ], pref,
+                          this->fd, rcnt, 'A' );
+}
+/* remove session from the patterns which match prefix */
+void
+EvAeron::rem_psub( AeronSession &session,  uint32_t h,  const char *prefix,
+                   uint16_t preflen ) noexcept
+{
+  AeronTmpList   tmp;
+  AeronSubStatus stat;
+  uint32_t       rcnt = 2;
+
+  stat = this->pat_sub_tab.rem( h, prefix, preflen, session.id, tmp );
+  if ( stat == AERON_SUB_OK ) {
+    if ( tmp.list.hd != NULL ) {
+      /*for ( AeronTmpElem *el = tmp.list.hd; el != NULL; el = el->next )
+        printf( "rem_psub: %.*s\n", (int) el->x.pattern_len(),
+                                          el->x.pattern() );*/
+      rcnt = this->poll.sub_route.del_pattern_route( h, this->fd, preflen );
+    }
+    session.psub_count--;
+  }
+  else {
+    printf( "stat %d\n", stat );
+  }
+  for ( AeronTmpElem *el = tmp.list.hd; el != NULL; el = el->next ) {
+    this->poll.notify_punsub( h, el->x.pattern(), el->x.pattern_len(),
+                              el->x.prefix(), el->x.prefix_len(), this->fd,
+                              rcnt, 'A' );
+  }
+}
 /* if a publisher from the aeron network loses sequences or times out */
 void
 EvAeron::send_dataloss( AeronSession &session ) noexcept
@@ -1026,17 +1522,141 @@ EvAeron::send_dataloss( AeronSession &session ) noexcept
             session.stamp, session.delta_seqno );
   if ( session.test( SESSION_TIMEOUT ) )
     printf( "session %u stamp %lu timeout\n", session.id, session.stamp );
+  if ( session.test( SESSION_RESTORED ) )
+    printf( "session %u stamp %lu restored routes dropped\n", session.id,
+            session.stamp );
   this->clear_session( session );
 }
+/* the routes of session are confirmed or it was lost */
+void
+EvAeron::end_resync( AeronSession &session,  bool prune ) noexcept
+{
+  if ( prune )
+    this->prune_restored( session );
+  this->my_peers.clear_restored( session );
+  session.resync_seqno = 0;
+  session.resync_ns    = 0;
+  if ( this->my_peers.restored_count == 0 ) {
+    this->resync_tab.release();
+    this->resync_pat_tab.release();
+  }
+  else {
+    this->purge_resync( this->resync_tab, session.id );
+    this->purge_resync( this->resync_pat_tab, session.id );
+  }
+}
+/* remove session from the restored routes that the replay did not confirm,
+   the confirmed routes are not touched, so the bridges do not see a flap */
+void
+EvAeron::prune_restored( AeronSession &session ) noexcept
+{
+  AeronTmpList tmp, ptmp;
+  AeronSubRoutePos pos;
+  AeronPatternSubRoutePos ppos;
+  AeronSubStatus stat;
+  uint32_t id = session.id, cnt = 0;
+
+  if ( this->sub_tab.first( pos ) ) {
+    do {
+      uint32_t rcnt = 2;
+      if ( this->resync_tab.rem( pos.rt->hash, pos.rt->value, pos.rt->len,
+                                 id ) != AERON_SUB_NOT_FOUND )
+        continue;
+      stat = AeronSubMap::remove_sub( this->sub_tab.zip, pos.rt->sub, id );
+      if ( stat == AERON_SUB_NOT_FOUND )
+        continue;
+      if ( stat == AERON_SUB_REMOVED ) {
+        rcnt = this->poll.sub_route.del_sub_route( pos.rt->hash, this->fd );
+        tmp.append( *pos.rt );
+        if ( session.sub_count != 0 )
+          session.sub_count--;
+      }
+      this->poll.notify_unsub( pos.rt->hash, pos.rt->value, pos.rt->len,
+                               this->fd, rcnt, 'A' );
+      cnt++;
+    } while ( this->sub_tab.next( pos ) );
+  }
+  for ( AeronTmpElem *el = tmp.list.hd; el != NULL; el = el->next )
+    this->sub_tab.tab.remove( el->x.hash, el->x.value, el->x.len );
+
+  if ( this->pat_sub_tab.first( ppos ) ) {
+    do {
+      uint32_t rcnt = 2;
+      if ( this->resync_pat_tab.rem( ppos.rt->hash, ppos.rt->value,
+                                     ppos.rt->len, id ) != AERON_SUB_NOT_FOUND )
+        continue;
+      stat = AeronSubMap::remove_sub( this->pat_sub_tab.zip, ppos.rt->sub, id );
+      if ( stat == AERON_SUB_NOT_FOUND )
+        continue;
+      if ( stat == AERON_SUB_REMOVED ) {
+        rcnt = this->poll.sub_route.del_pattern_route( ppos.rt->hash, this->fd,
+                                                       ppos.rt->prefix_len() );
+        ptmp.append( *ppos.rt );
+        if ( session.psub_count != 0 )
+          session.psub_count--;
+      }
+      this->poll.notify_punsub( ppos.rt->hash, ppos.rt->pattern(),
+                                ppos.rt->pattern_len(), ppos.rt->prefix(),
+                                ppos.rt->prefix_len(), this->fd, rcnt, 'A' );
+      cnt++;
+    } while ( this->pat_sub_tab.next( ppos ) );
+  }
+  for ( AeronTmpElem *el = ptmp.list.hd; el != NULL; el = el->next )
+    this->pat_sub_tab.tab.remove( el->x.hash, el->x.value, el->x.len );
+
+  printf( "session %u stamp %lu restored routes confirmed, %u pruned\n",
+          session.id, session.stamp, cnt );
+  /* the log has the pruned routes, rewrite it from the tables */
+  if ( cnt != 0 && this->snap != NULL )
+    this->compact_snapshot();
+}
+/* remove the confirms of session id, left by routes retired while resyncing */
+void
+EvAeron::purge_resync( AeronSubMap &tab,  uint32_t id ) noexcept
+{
+  AeronTmpList tmp;
+  AeronSubRoutePos pos;
+
+  if ( tab.first( pos ) ) {
+    do {
+      if ( AeronSubMap::remove_sub( tab.zip, pos.rt->sub, id ) ==
+           AERON_SUB_REMOVED )
+        tmp.append( *pos.rt );
+    } while ( tab.next( pos ) );
+  }
+  for ( AeronTmpElem *el = tmp.list.hd; el != NULL; el = el->next )
+    tab.tab.remove( el->x.hash, el->x.value, el->x.len );
+}
+/* a peer that does not send the replay end, or one whose replay stalled,
+   is pruned with the confirms recvd so far */
+void
+EvAeron::check_resync( void ) noexcept
+{
+  for ( AeronSession *s = this->my_peers.list.hd; s != NULL; s = s->next ) {
+    if ( s->resync_ns != 0 &&
+         this->cur_mono_ns - s->resync_ns >= AERON_RESYNC_NS ) {
+      printf( "session %u stamp %lu replay end not recvd\n", s->id,
+              s->stamp );
+      this->end_resync( *s, true );
+    }
+  }
+}
 /* clear session of subscriptions and patterns open */
 void
 EvAeron::clear_session( AeronSession &session ) noexcept
 {
+  if ( session.test( SESSION_RESTORED ) )
+    this->end_resync( session, false );
   if ( session.sub_count != 0 )
     this->clear_subs( session );
   if ( session.psub_count != 0 )
     this->clear_pattern_subs( session );
-  /* clear state bits and set to NEW */
+  /* the subject ids may be missing a definition */
+  session.release_subj();
+  if ( this->snap != NULL )
+    this->snap_log( AERON_SNAP_DROP, &session, 0, NULL, 0, 0 );
+  /* clear state bits and set to NEW, counted if it was not */
+  this->my_peers.set_new( session );
   session.clear();
   session.set( SESSION_NEW );
 }
@@ -1119,80 +1739,247 @@ EvAeron::clear_pattern_subs( AeronSession &session ) noexcept
     this->pat_sub_tab.tab.remove( el->x.hash, el->x.value, el->x.len );
   session.psub_count = 0;
 }
+/* index session, keep load at or below half of the slots */
+bool
+AeronSessionTab::insert( AeronSession *s ) noexcept
+{
+  uint32_t nb = this->mask + 1;
+  if ( this->buckets == NULL || ( this->count + 1 ) * 2 > nb * BUCKET_SLOTS ) {
+    if ( ! this->resize( this->buckets == NULL ? 16 : nb * 2 ) )
+      return false;
+  }
+  for ( uint32_t b = home( s->stamp, this->mask ); ; b = ( b + 1 ) & this->mask ) {
+    Bucket & bk = this->buckets[ b ];
+    uint32_t m = match( bk, 0 );
+    if ( m != 0 ) {
+      uint32_t i = __builtin_ctz( m );
+      bk.stamp[ i ]   = s->stamp;
+      bk.session[ i ] = s;
+      this->count++;
+      return true;
+    }
+  }
+}
+/* remove stamp, shift the following entries back to close the gap, so that
+   find() can stop at the first empty slot without tombstones */
+void
+AeronSessionTab::remove( uint64_t stamp ) noexcept
+{
+  if ( this->count == 0 || stamp == 0 )
+    return;
+  const uint32_t nslots = ( this->mask + 1 ) * BUCKET_SLOTS;
+  uint32_t b = home( stamp, this->mask ), i;
+  for (;;) {
+    uint32_t m = match( this->buckets[ b ], stamp );
+    if ( m != 0 ) {
+      i = b * BUCKET_SLOTS + __builtin_ctz( m );
+      break;
+    }
+    if ( match( this->buckets[ b ], 0 ) != 0 )
+      return;
+    b = ( b + 1 ) & this->mask;
+  }
+  for ( uint32_t j = i; ; ) {
+    this->slot_stamp( i ) = 0;
+    this->slot_session( i ) = NULL;
+    for (;;) {
+      j = ( j + 1 ) % nslots;
+      uint64_t x = this->slot_stamp( j );
+      if ( x == 0 ) {
+        this->count--;
+        return;
+      }
+      /* k is first slot of home bucket, entry stays if k in ( i, j ] */
+      uint32_t k = home( x, this->mask ) * BUCKET_SLOTS;
+      if ( i <= j ? ( i < k && k <= j ) : ( i < k || k <= j ) )
+        continue;
+      this->slot_stamp( i )   = x;
+      this->slot_session( i ) = this->slot_session( j );
+      i = j;
+      break;
+    }
+  }
+}
+/* rehash into nbuckets, a power of 2 */
+bool
+AeronSessionTab::resize( uint32_t nbuckets ) noexcept
+{
+  Bucket * old   = this->buckets;
+  uint32_t oldnb = ( old == NULL ? 0 : this->mask + 1 );
+  void   * p     = ::aligned_alloc( 64, sizeof( Bucket ) * nbuckets );
+  if ( p == NULL ) {
+    perror( "alloc session_tab" );
+    return false;
+  }
+  ::memset( p, 0, sizeof( Bucket ) * nbuckets );
+  this->buckets = (Bucket *) p;
+  this->mask    = nbuckets - 1;
+  this->count   = 0;
+  for ( uint32_t b = 0; b < oldnb; b++ )
+    for ( uint32_t i = 0; i < BUCKET_SLOTS; i++ )
+      if ( old[ b ].stamp[ i ] != 0 )
+        this->insert( old[ b ].session[ i ] );
+  if ( old != NULL )
+    ::free( old );
+  return true;
+}
+
+void
+AeronSessionTab::release( void ) noexcept
+{
+  if ( this->buckets != NULL )
+    ::free( this->buckets );
+  this->buckets = NULL;
+  this->mask    = 0;
+  this->count   = 0;
+}
 /* list of all sessions on aeron network */
 MyPeers::MyPeers() noexcept
        : dummy_session( 0 )
 {
-  this->session_idx   = UIntHashTab::resize( NULL );
   this->last_session  = &this->dummy_session;
   this->sessions      = NULL;
+  this->live_map      = NULL;
   this->session_size  = 0;
+  this->new_count     = 0;
+  this->restored_count = 0;
+  this->ping_needed   = 0;
   this->ping_idx      = 0;
+  this->free_word     = 0;
+  this->map_hi        = 0;
+  this->chunk_cnt     = 0;
+  this->chunks        = NULL;
+  this->huge_pages    = false;
+  this->phi_threshold = AERON_PHI_THRESHOLD;
   this->last_check_ns = 0;
+  this->bloom_dirty   = false;
+  this->bloom_all     = false;
+  this->peer_bloom.zero();
 }
 
 void
 MyPeers::release( void ) noexcept
 {
-  delete this->session_idx;
-  this->session_idx   = UIntHashTab::resize( NULL );
+  AeronSession * s;
+  while ( ! this->list.is_empty() ) {
+    s = this->list.pop_hd();
+    KvFragAsm::release( s->frag );
+    s->release_subj();
+    if ( s->lat_hist != NULL ) {
+      hdr_close( s->lat_hist );
+      s->lat_hist = NULL;
+    }
+  }
+  for ( uint32_t i = 0; i < this->chunk_cnt; i++ )
+    ::munmap( this->chunks[ i ].mem, this->chunks[ i ].size );
+  if ( this->chunks != NULL )
+    ::free( this->chunks );
+  this->chunks        = NULL;
+  this->chunk_cnt     = 0;
+  this->session_tab.release();
   this->last_session  = &this->dummy_session;
   if ( this->sessions != NULL )
     ::free( this->sessions );
+  if ( this->live_map != NULL )
+    ::free( this->live_map );
   this->sessions      = NULL;
+  this->live_map      = NULL;
   this->session_size  = 0;
+  this->new_count     = 0;
+  this->restored_count = 0;
+  this->ping_needed   = 0;
   this->ping_idx      = 0;
+  this->free_word     = 0;
+  this->map_hi        = 0;
   this->last_check_ns = 0;
-
-  AeronSession * s;
-  while ( ! this->list.is_empty() ) {
-    s = this->list.pop_hd();
-    if ( ( s->id % 64 ) == 0 )
-      this->free_list.push_hd( s );
+  this->bloom_dirty   = false;
+  this->bloom_all     = false;
+  this->peer_bloom.zero();
+}
+static const size_t AERON_HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+/* pre-size sessions[], so new peers do not allocate */
+bool
+MyPeers::reserve( uint32_t count,  bool huge ) noexcept
+{
+  this->huge_pages = huge;
+  if ( count <= this->session_size )
+    return true;
+  return this->grow_sessions( count - this->session_size );
+}
+/* map a slab for count more sessions and grow sessions[] and live_map[] */
+bool
+MyPeers::grow_sessions( uint32_t count ) noexcept
+{
+  size_t pgsz = ( this->huge_pages ? AERON_HUGE_PAGE_SIZE : 4096 ),
+         size = align<size_t>( sizeof( AeronSession ) *
+                               align<size_t>( count, 64 ), pgsz );
+  void * m    = MAP_FAILED;
+  /* whatever fits in the mapping, in words of live_map */
+  count = (uint32_t) ( size / sizeof( AeronSession ) ) & ~(uint32_t) 63;
+#ifdef MAP_HUGETLB
+  if ( this->huge_pages )
+    m = ::mmap( NULL, size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0 );
+#endif
+  if ( m == MAP_FAILED ) {
+    m = ::mmap( NULL, size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+    if ( m == MAP_FAILED ) {
+      perror( "mmap sessions" );
+      return false;
+    }
+#ifdef MADV_HUGEPAGE
+    /* no reserved hugepages, transparent hugepages may back it */
+    if ( this->huge_pages )
+      ::madvise( m, size, MADV_HUGEPAGE );
+#endif
   }
-  for ( s = this->free_list.hd; s != NULL; ) {
-    AeronSession *next = s->next;
-    if ( ( s->id % 64 ) != 0 )
-      this->free_list.pop( s );
-    s = next;
+  uint32_t nwords = this->session_size / 64;
+  void   * p = ::realloc( this->chunks,
+                     sizeof( this->chunks[ 0 ] ) * ( this->chunk_cnt + 1 ) );
+  if ( p != NULL ) {
+    this->chunks = (AeronSessionChunk *) p;
+    p = ::realloc( this->sessions,
+             sizeof( this->sessions[ 0 ] ) * ( this->session_size + count ) );
   }
-  while ( ! this->free_list.is_empty() ) {
-    s = this->free_list.pop_hd();
-    ::free( s );
+  if ( p != NULL ) {
+    this->sessions = (AeronSession **) p;
+    p = ::realloc( this->live_map,
+                   sizeof( this->live_map[ 0 ] ) * ( nwords + count / 64 ) );
   }
-}
+  if ( p == NULL ) {
+    perror( "realloc net_session" );
+    ::munmap( m, size );
+    return false;
+  }
+  this->live_map = (uint64_t *) p;
+  ::memset( &this->live_map[ nwords ], 0, sizeof( uint64_t ) * ( count / 64 ) );
+  this->chunks[ this->chunk_cnt ].mem  = m;
+  this->chunks[ this->chunk_cnt ].size = size;
+  this->chunk_cnt++;
 
-/* creae a new session and index by stamp */
+  AeronSession * x = (AeronSession *) m;
+  for ( uint32_t i = 0; i < count; i++ ) {
+    new ( &x[ i ] ) AeronSession( this->session_size );
+    this->sessions[ this->session_size++ ] = &x[ i ];
+  }
+  return true;
+}
+/* creae a new session and index by stamp, the lowest free id is used so
+   that live ids stay packed at the bottom of live_map */
 AeronSession *
-MyPeers::new_session( uint64_t stamp,  uint64_t seqno, uint32_t h,
-                      size_t pos,  AeronSession *next_id ) noexcept
+MyPeers::new_session( uint64_t stamp,  uint64_t seqno ) noexcept
 {
-  if ( this->free_list.is_empty() ) {
-    void *p = ::realloc( this->sessions,
-                  sizeof( this->sessions[ 0 ] ) * ( this->session_size + 64 ) );
-    if ( p == NULL ) {
-      perror( "realloc net_session" );
-      return NULL;
-    }
-    this->sessions = (AeronSession **) p;
-    p = ::malloc( sizeof( AeronSession ) * 64 );
-    if ( p == NULL ) {
-      perror( "alloc sessions" );
-      return NULL;
-    }
-    for ( int i = 0; i < 64; i++ ) {
-      this->sessions[ this->session_size ] = NULL;
-      AeronSession * x = new ( p ) AeronSession( this->session_size++ );
-      this->free_list.push_tl( x );
-      p = (void *) &x[ 1 ];
-    }
-  }
+  uint32_t nwords = this->session_size / 64,
+           w      = this->free_word;
+  while ( w < nwords && this->live_map[ w ] == ~(uint64_t) 0 )
+    w++;
+  this->free_word = w;
+  if ( w == nwords && ! this->grow_sessions( 64 ) )
+    return NULL;
 
-  this->last_session = this->free_list.pop_hd();
-  uint32_t id = this->last_session->id;
-  this->session_idx->set( h, pos, id );
-  if ( this->session_idx->need_resize() )
-    this->session_idx = UIntHashTab::resize( this->session_idx );
+  uint32_t id = w * 64 + __builtin_ctzl( ~this->live_map[ w ] );
+  this->last_session = this->sessions[ id ];
 
   uint8_t  * u8 = (uint8_t *) (void *) &stamp;
   uint16_t * u16 = (uint16_t *) (void *) &stamp;
@@ -1205,51 +1992,92 @@ MyPeers::new_session( uint64_t stamp,  uint64_t seqno, uint32_t h,
     printf( "new_session:          i=%u, seqno=%lu, stamp=%lu\n", id, seqno,
             stamp );
   }
-  this->sessions[ id ] = this->last_session;
-  new ( this->last_session ) AeronSession( id, stamp, seqno, next_id );
+  new ( this->last_session ) AeronSession( id, stamp, seqno );
+  if ( ! this->session_tab.insert( this->last_session ) ) {
+    this->last_session = &this->dummy_session;
+    return NULL;
+  }
+  this->live_map[ w ] |= (uint64_t) 1 << ( id % 64 );
+  if ( w >= this->map_hi )
+    this->map_hi = w + 1;
   this->list.push_hd( this->last_session );
+  this->new_count++;
+  this->ping_needed++;
+  this->bloom_dirty = true; /* no bloom until hello */
   return this->last_session;
 }
-/* release a session by removing from index, put to free list for reuse */
-void
-MyPeers::release_session( AeronSession &session ) noexcept
+AeronSession *
+MyPeers::check_timeout( uint64_t now_ns,  uint64_t max_ns ) noexcept
 {
-  size_t   pos;
-  uint32_t h = hash( session.stamp ), id;
-  if ( &session == this->last_session )
-    this->last_session = &this->dummy_session;
-  if ( this->session_idx->find( h, pos, id ) ) {
-    /* if head of chain */
-    if ( id == session.id ) {
-      /* if more sessions follow */
-      if ( session.next_id != NULL ) {
-        this->session_idx->set( h, pos, session.next_id->id );
-        session.next_id->last_id = NULL;
-        session.next_id = NULL;
+  if ( now_ns > this->last_check_ns ) {
+    this->last_check_ns = now_ns;
+    for ( AeronSession *s = this->list.hd; s != NULL; s = s->next ) {
+      bool suspect;
+      if ( now_ns - s->last_active > max_ns )
+        suspect = true;
+      else if ( s->hb_count < AERON_PHI_MIN_SAMPLES )
+        suspect = false;
+      else
+        suspect = s->phi( now_ns ) > this->phi_threshold;
+      if ( suspect ) {
+        if ( s->test( SESSION_TIMEOUT ) )
+          return s;
+        s->set( SESSION_TIMEOUT );
       }
-      /* is only link  in chain */
       else {
-        this->session_idx->remove( pos );
-        if ( this->session_idx->need_resize() )
-          this->session_idx = UIntHashTab::resize( this->session_idx );
+        s->clear( SESSION_TIMEOUT );
       }
     }
-    /* find link in chain */
-    else {
-      for ( AeronSession *p = this->sessions[ id ]->next_id; ; ) {
-        if ( p == &session ) {
-          p->last_id->next_id = p->next_id;
-          if ( p->next_id != NULL )
-            p->next_id->last_id = p->last_id;
-          p->next_id = p->last_id = NULL;
-          break;
-        }
-        p = p->next_id;
-      }
+  }
+  return NULL;
+}
+/* clear id from live_map, lower the free and high water words */
+void
+MyPeers::clear_live( uint32_t id ) noexcept
+{
+  uint32_t w = id / 64;
+  this->live_map[ w ] &= ~( (uint64_t) 1 << ( id % 64 ) );
+  if ( w < this->free_word )
+    this->free_word = w;
+  while ( this->map_hi > 0 && this->live_map[ this->map_hi - 1 ] == 0 )
+    this->map_hi--;
+}
+/* union of session blooms, if a session has no bloom, then match all */
+void
+MyPeers::merge_bloom( void ) noexcept
+{
+  this->peer_bloom.zero();
+  this->bloom_all = false;
+  for ( AeronSession *s = this->list.hd; s != NULL; s = s->next ) {
+    if ( ! s->has_bloom ) {
+      this->bloom_all = true;
+      break;
     }
+    this->peer_bloom.merge( s->bloom );
+  }
+  this->bloom_dirty = false;
+}
+/* release a session by removing from index, the id is free for reuse */
+void
+MyPeers::release_session( AeronSession &session ) noexcept
+{
+  if ( &session == this->last_session )
+    this->last_session = &this->dummy_session;
+  if ( this->session_tab.find( session.stamp ) == &session ) {
+    this->session_tab.remove( session.stamp );
     KvFragAsm::release( session.frag );
+    session.release_subj();
+    if ( session.lat_hist != NULL ) {
+      hdr_close( session.lat_hist );
+      session.lat_hist = NULL;
+    }
     this->list.pop( &session );
-    this->free_list.push_tl( &session );
+    this->clear_live( session.id );
+    this->clear_new( session );
+    this->clear_restored( session );
+    if ( session.ping_ns == 0 )
+      this->ping_needed--;
+    this->bloom_dirty = true;
 
     uint8_t  * u8 = (uint8_t *) (void *) &session.stamp;
     uint16_t * u16 = (uint16_t *) (void *) &session.stamp;
@@ -1269,6 +2097,54 @@ MyPeers::release_session( AeronSession &session ) noexcept
              session.id, session.stamp );
   }
 }
+/* copy subject and prefix hashes, publish by subject id uses them */
+void
+AeronSession::set_subj( uint32_t sid,  KvSubMsg &msg ) noexcept
+{
+  if ( sid > 2 * AERON_SUBJ_ID_MAX )
+    return;
+  if ( sid >= this->subj_size ) {
+    uint32_t sz = ( sid | 255 ) + 1;
+    void   * p  = ::realloc( this->subj_ids, sz * sizeof( this->subj_ids[ 0 ] ) );
+    if ( p == NULL ) {
+      perror( "realloc subj_ids" );
+      return;
+    }
+    this->subj_ids = (AeronSubjEntry **) p;
+    ::memset( &this->subj_ids[ this->subj_size ], 0,
+              ( sz - this->subj_size ) * sizeof( this->subj_ids[ 0 ] ) );
+    this->subj_size = sz;
+  }
+  uint8_t cnt = msg.get_prefix_cnt();
+  size_t  psz = cnt * sizeof( msg.prefix_array()[ 0 ] );
+  void  * p   = ::realloc( this->subj_ids[ sid ],
+                           sizeof( AeronSubjEntry ) + msg.sublen + psz );
+  if ( p == NULL ) {
+    perror( "realloc subj_id" );
+    return;
+  }
+  AeronSubjEntry * ent = (AeronSubjEntry *) p;
+  ent->hash       = msg.hash;
+  ent->len        = msg.sublen;
+  ent->prefix_cnt = cnt;
+  ::memcpy( ent->value, msg.subject(), msg.sublen );
+  ::memcpy( (void *) ent->prefix_array(), msg.prefix_array(), psz );
+  this->subj_ids[ sid ] = ent;
+}
+
+void
+AeronSession::release_subj( void ) noexcept
+{
+  if ( this->subj_ids != NULL ) {
+    for ( uint32_t i = 0; i < this->subj_size; i++ )
+      if ( this->subj_ids[ i ] != NULL )
+        ::free( this->subj_ids[ i ] );
+    ::free( this->subj_ids );
+  }
+  this->subj_ids     = NULL;
+  this->subj_size    = 0;
+  this->subj_pending = 0;
+}
 /* merge id into tab[ subj ] route */
 AeronSubStatus
 AeronSubMap::merge_sub( RouteZip &zip,  uint32_t &r,  uint32_t i ) noexcept
@@ -1348,13 +2224,161 @@ AeronPatternSubMap::print( void ) noexcept
   }
 }
 
+AeronStatType
+AeronSessionStats::type( uint8_t msg_type ) noexcept
+{
+  switch ( msg_type ) {
+    case KV_MSG_PUBLISH:
+    case AERON_MSG_PUB_ID: return AERON_STAT_PUB;
+    case KV_MSG_FRAGMENT:  return AERON_STAT_FRAG;
+    case KV_MSG_SUB:
+    case KV_MSG_UNSUB:
+    case KV_MSG_PSUB:
+    case KV_MSG_PUNSUB:    return AERON_STAT_SUB;
+    case KV_MSG_HELLO:     return AERON_STAT_HELLO;
+    default:               return AERON_STAT_OTHER;
+  }
+}
+/* ewma of inter-arrival mean and variance, alpha = 1/16 */
+void
+AeronSession::live_arrival( uint64_t now_ns ) noexcept
+{
+  if ( this->last_live != 0 && now_ns > this->last_live ) {
+    double x = (double) ( now_ns - this->last_live );
+    if ( this->hb_count++ == 0 ) {
+      this->hb_mean = x;
+      this->hb_var  = 0;
+    }
+    else {
+      double d = x - this->hb_mean;
+      this->hb_mean += d / 16.0;
+      this->hb_var  += ( d * ( x - this->hb_mean ) - this->hb_var ) / 16.0;
+    }
+  }
+  this->last_live = now_ns;
+}
+/* normal approximation of the inter-arrival distribution */
+double
+AeronSession::phi( uint64_t now_ns ) const noexcept
+{
+  double std = ::sqrt( this->hb_var );
+  if ( std < AERON_PHI_MIN_STD_NS )
+    std = AERON_PHI_MIN_STD_NS;
+  /* data samples pull the mean below the hello interval, when a busy peer
+     goes idle the gap is the interval, which is not a late arrival */
+  double mean = this->hb_mean;
+  if ( mean < (double) AERON_HEARTBEAT_US * 1000 )
+    mean = (double) AERON_HEARTBEAT_US * 1000;
+  /* last_active, any message is proof of life */
+  double t = (double) ( now_ns - this->last_active ),
+         p = 0.5 * ::erfc( ( t - mean ) / ( std * M_SQRT2 ) );
+  if ( p < 1e-300 )
+    return 300.0;
+  return -::log10( p );
+}
+/* offset from the lowest delay samples, queued samples are asymmetric */
+void
+AeronSession::clock_sample( uint64_t t1,  uint64_t t2,  uint64_t t3,
+                            uint64_t t4 ) noexcept
+{
+  int64_t rtt    = (int64_t) ( t4 - t1 ) - (int64_t) ( t3 - t2 ),
+          offset = ( (int64_t) ( t2 - t1 ) + (int64_t) ( t3 - t4 ) ) / 2;
+  if ( rtt < 0 )
+    return;
+  if ( this->clock_samples++ == 0 ) {
+    this->clock_offset = offset;
+    this->rtt_ns       = rtt;
+    this->rtt_min      = rtt;
+    return;
+  }
+  this->rtt_ns += ( rtt - this->rtt_ns ) / 8;
+  if ( rtt < this->rtt_min )
+    this->rtt_min = rtt;
+  else /* path may change, let the min rise */
+    this->rtt_min += ( rtt - this->rtt_min ) / 64;
+  if ( rtt <= 2 * this->rtt_min )
+    this->clock_offset += ( offset - this->clock_offset ) / 4;
+}
+/* histogram is allocated with the first sample, 1ns to 10s, 2 digits */
+void
+AeronSession::record_latency( uint64_t lat_ns ) noexcept
+{
+  if ( this->lat_hist == NULL ) {
+    if ( hdr_init( 1, 10 * (int64_t) 1000000000, 2, &this->lat_hist ) != 0 ) {
+      this->lat_hist = NULL;
+      return;
+    }
+  }
+  hdr_record_value( this->lat_hist, (int64_t) lat_ns );
+}
+
+static const char *stat_name[ AERON_STAT_TYPES ] = {
+  "pub", "frag", "sub", "hello", "other"
+};
+
 void
-MyPeers::print( void ) noexcept
+MyPeers::print( uint64_t now_ns ) noexcept
 {
   for ( AeronSession *s = this->list.hd; s != NULL; s = s->next ) {
-    printf( "session-id %u = %lu.%lu subs=%u psubs=%u pubs=%lu\n",
+    AeronSessionStats & st = s->stats;
+    printf( "session-id %u = %lu.%lu subs=%u psubs=%u pubs=%lu age=%lums\n",
             s->id, s->stamp, s->last_seqno, s->sub_count, s->psub_count,
-            s->pub_count );
+            s->pub_count, ( now_ns - s->last_active ) / 1000000 );
+    printf( "  " );
+    for ( int t = 0; t < AERON_STAT_TYPES; t++ )
+      printf( "%s=%lu/%lu ", stat_name[ t ], st.msg_count[ t ],
+              st.byte_count[ t ] );
+    printf( "gaps=%lu missing=%lu frag_drop=%lu subj_drop=%lu\n",
+            st.gap_count, st.gap_seqno, st.frag_drop, st.subj_drop );
+    if ( s->hb_count != 0 )
+      printf( "  hb_mean_ms=%.1f hb_std_ms=%.1f phi=%.2f\n",
+              s->hb_mean / 1e6, ::sqrt( s->hb_var ) / 1e6, s->phi( now_ns ) );
+    if ( s->clock_samples != 0 )
+      printf( "  offset_us=%.1f rtt_us=%.1f rtt_min_us=%.1f\n",
+              s->clock_offset / 1000.0, s->rtt_ns / 1000.0,
+              s->rtt_min / 1000.0 );
+    if ( s->lat_hist != NULL && s->lat_hist->total_count > 0 ) {
+      hdr_histogram * h = s->lat_hist;
+      printf( "  lat_us min=%.1f p50=%.1f p99=%.1f p99.9=%.1f max=%.1f "
+              "n=%ld\n",
+              hdr_min( h ) / 1000.0, hdr_value_at_percentile( h, 50.0 ) / 1000.0,
+              hdr_value_at_percentile( h, 99.0 ) / 1000.0,
+              hdr_value_at_percentile( h, 99.9 ) / 1000.0,
+              hdr_max( h ) / 1000.0, (long) h->total_count );
+    }
+  }
+}
+
+void
+MyPeers::print_json( FILE *fp,  uint64_t now_ns ) noexcept
+{
+  for ( AeronSession *s = this->list.hd; s != NULL; s = s->next ) {
+    AeronSessionStats & st = s->stats;
+    fprintf( fp, "{\"id\":%u,\"stamp\":%lu,\"seqno\":%lu,\"subs\":%u,"
+             "\"psubs\":%u,\"age_ns\":%lu", s->id, s->stamp, s->last_seqno,
+             s->sub_count, s->psub_count, now_ns - s->last_active );
+    for ( int t = 0; t < AERON_STAT_TYPES; t++ )
+      fprintf( fp, ",\"%s_msgs\":%lu,\"%s_bytes\":%lu", stat_name[ t ],
+               st.msg_count[ t ], stat_name[ t ], st.byte_count[ t ] );
+    fprintf( fp, ",\"gaps\":%lu,\"missing\":%lu,\"frag_drop\":%lu,"
+             "\"subj_drop\":%lu", st.gap_count, st.gap_seqno, st.frag_drop,
+             st.subj_drop );
+    if ( s->hb_count != 0 )
+      fprintf( fp, ",\"hb_mean_ns\":%.0f,\"hb_std_ns\":%.0f,\"phi\":%.2f",
+               s->hb_mean, ::sqrt( s->hb_var ), s->phi( now_ns ) );
+    if ( s->clock_samples != 0 )
+      fprintf( fp, ",\"offset_ns\":%ld,\"rtt_ns\":%ld,\"rtt_min_ns\":%ld",
+               (long) s->clock_offset, (long) s->rtt_ns, (long) s->rtt_min );
+    if ( s->lat_hist != NULL && s->lat_hist->total_count > 0 ) {
+      hdr_histogram * h = s->lat_hist;
+      fprintf( fp, ",\"lat_n\":%ld,\"lat_min_ns\":%ld,\"lat_p50_ns\":%ld,"
+               "\"lat_p99_ns\":%ld,\"lat_p999_ns\":%ld,\"lat_max_ns\":%ld",
+               (long) h->total_count, (long) hdr_min( h ),
+               (long) hdr_value_at_percentile( h, 50.0 ),
+               (long) hdr_value_at_percentile( h, 99.0 ),
+               (long) hdr_value_at_percentile( h, 99.9 ), (long) hdr_max( h ) );
+    }
+    fprintf( fp, "}\n" );
   }
 }
 
@@ -1392,7 +2416,202 @@ EvAeron::print_stats( void ) noexcept
   printf( "|- MySubs ----------|\n" );
   this->my_subs.print( this->poll );
   printf( "|- MyPeers ---------|\n" );
-  this->my_peers.print();
+  this->my_peers.print( this->cur_mono_ns );
   printf( "+-------------------+\n" );
   fflush( stdout );
 }
+
+void
+EvAeron::write_stats( void ) noexcept
+{
+  char tmp[ 1024 ];
+  ::snprintf( tmp, sizeof( tmp ), "%s.tmp", this->stats_path );
+  FILE * fp = ::fopen( tmp, "w" );
+  if ( fp == NULL ) {
+    perror( tmp );
+    return;
+  }
+  this->my_peers.print_json( fp, this->cur_mono_ns );
+  if ( ::fclose( fp ) != 0 || ::rename( tmp, this->stats_path ) != 0 )
+    perror( this->stats_path );
+}
+/* publish without a route, the receivers match it against their routes */
+bool
+EvAeron::publish( const char *sub,  uint16_t sublen,  const char *reply,
+                  uint16_t replylen,  const void *msg,  size_t msg_len,
+                  uint8_t msg_enc ) noexcept
+{
+  if ( this->test_ae( AE_FLAG_SHUTDOWN | AE_FLAG_INIT ) || this->pub == NULL )
+    return false;
+  /* write() would toss it, no subscriber image is connected */
+  if ( ! aeron_exclusive_publication_is_connected( this->pub ) )
+    return false;
+  this->create_kvpublish( kv_crc_c( sub, sublen, 0 ), sub, sublen, NULL, NULL,
+                          0, reply, replylen, msg, msg_len, 'p', msg_enc,
+                          this->max_payload_len );
+  this->idle_push( EV_WRITE );
+  return true;
+}
+/* a subject waited on by a coroutine, sent to peers as my sub, it should not
+ * be subscribed by a local route too, unsubscribe would remove it */
+void
+EvAeron::subscribe( const char *sub,  uint16_t sublen ) noexcept
+{
+  KvSubMsg *submsg =
+    this->create_kvsubmsg( kv_crc_c( sub, sublen, 0 ), sub, sublen, 'A',
+                           KV_MSG_SUB, 'L', NULL, 0 );
+  this->my_subs.upsert( *submsg );
+  this->idle_push( EV_WRITE );
+}
+
+void
+EvAeron::unsubscribe( const char *sub,  uint16_t sublen ) noexcept
+{
+  KvSubMsg *submsg =
+    this->create_kvsubmsg( kv_crc_c( sub, sublen, 0 ), sub, sublen, 'A',
+                           KV_MSG_UNSUB, 'D', NULL, 0 );
+  this->my_subs.remove( *submsg );
+  this->idle_push( EV_WRITE );
+}
+/* send waiters are woken in order after the sendq is written */
+void
+EvAeron::wait_send( AeronWaiter &w ) noexcept
+{
+  AeronWaiter ** tl = &this->send_wait;
+  while ( *tl != NULL )
+    tl = &(*tl)->next;
+  w.next   = NULL;
+  w.sub    = NULL;
+  w.pub    = NULL;
+  w.state  = AERON_WAIT_PENDING;
+  *tl = &w;
+}
+
+void
+EvAeron::wait_msg( AeronWaiter &w,  const char *sub,  uint16_t sublen ) noexcept
+{
+  w.sub    = sub;
+  w.sublen = sublen;
+  w.h      = kv_crc_c( sub, sublen, 0 );
+  w.pub    = NULL;
+  w.state  = AERON_WAIT_PENDING;
+  w.next   = this->msg_wait;
+  this->msg_wait = &w;
+}
+
+void
+EvAeron::cancel_wait( AeronWaiter &w ) noexcept
+{
+  AeronWaiter ** p = ( w.sub == NULL ? &this->send_wait : &this->msg_wait );
+  for ( ; *p != NULL; p = &(*p)->next ) {
+    if ( *p == &w ) {
+      *p = w.next;
+      break;
+    }
+  }
+  w.next  = NULL;
+  w.state = AERON_WAIT_IDLE;
+}
+/* the list is detached while waking, a waiter may wait again in on_wake() */
+void
+EvAeron::notify_send( void ) noexcept
+{
+  AeronWaiter * w = this->send_wait;
+  this->send_wait = NULL;
+  while ( w != NULL ) {
+    AeronWaiter * next = w->next;
+    w->next  = NULL;
+    w->state = AERON_WAIT_READY;
+    w->on_wake();
+    w = next;
+  }
+}
+
+void
+EvAeron::notify_msg( EvPublish &pub ) noexcept
+{
+  AeronWaiter * w = this->msg_wait,
+              * keep = NULL,
+             ** keep_tl = &keep;
+  this->msg_wait = NULL;
+  while ( w != NULL ) {
+    AeronWaiter * next = w->next;
+    w->next = NULL;
+    if ( w->h == pub.subj_hash && w->sublen == pub.subject_len &&
+         ::memcmp( w->sub, pub.subject, w->sublen ) == 0 ) {
+      w->state = AERON_WAIT_READY;
+      w->pub   = &pub;
+      w->on_wake();
+    }
+    else {
+      *keep_tl = w;
+      keep_tl  = &w->next;
+    }
+    w = next;
+  }
+  *keep_tl = this->msg_wait; /* waits added by on_wake() */
+  this->msg_wait = keep;
+}
+
+void
+EvAeron::cancel_all_waits( void ) noexcept
+{
+  for ( int i = 0; i < 2; i++ ) {
+    AeronWaiter * w = ( i == 0 ? this->send_wait : this->msg_wait );
+    if ( i == 0 )
+      this->send_wait = NULL;
+    else
+      this->msg_wait = NULL;
+    while ( w != NULL ) {
+      AeronWaiter * next = w->next;
+      w->next  = NULL;
+      w->pub   = NULL;
+      w->state = AERON_WAIT_CANCELLED;
+      w->on_wake();
+      w = next;
+    }
+  }
+}
+/* a block is prefixed by the pool which allocated it */
+static const size_t FRAME_HDR = 16;
+
+void *
+AeronFramePool::alloc( size_t sz ) noexcept
+{
+  size_t n = ( sz + FRAME_HDR + FRAME_ALIGN - 1 ) / FRAME_ALIGN;
+  char * b = NULL;
+  if ( n <= FRAME_CLASSES && (b = (char *) this->free_list[ n - 1 ]) != NULL )
+    this->free_list[ n - 1 ] = *(void **) (void *) b;
+  else if ( (b = (char *) ::aligned_alloc( FRAME_ALIGN,
+                                           n * FRAME_ALIGN )) == NULL )
+    return NULL;
+  *(AeronFramePool **) (void *) b = this;
+  return &b[ FRAME_HDR ];
+}
+
+void
+AeronFramePool::free( void *p,  size_t sz ) noexcept
+{
+  size_t n = ( sz + FRAME_HDR + FRAME_ALIGN - 1 ) / FRAME_ALIGN;
+  char * b = &((char *) p)[ -(ptrdiff_t) FRAME_HDR ];
+  if ( n <= FRAME_CLASSES ) {
+    AeronFramePool * pool = *(AeronFramePool **) (void *) b;
+    *(void **) (void *) b = pool->free_list[ n - 1 ];
+    pool->free_list[ n - 1 ] = b;
+  }
+  else {
+    ::free( b );
+  }
+}
+
+void
+AeronFramePool::release( void ) noexcept
+{
+  for ( size_t i = 0; i < FRAME_CLASSES; i++ ) {
+    while ( this->free_list[ i ] != NULL ) {
+      void * next = *(void **) this->free_list[ i ];
+      ::free( this->free_list[ i ] );
+      this->free_list[ i ] = next;
+    }
+  }
+}
@@ -0,0 +1,489 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sched.h>
+#include <pthread.h>
+#include <aekv/ev_aeron_driver.h>
+#include <aekv/ev_aeron.h>
+#include <aekv/aeron_udp.h>
+extern "C" {
+#ifdef __GNUC__
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+#endif
+#include <aeronmd.h>
+#include "media/aeron_udp_channel_transport.h"
+#include "media/aeron_udp_transport_poller.h"
+#include "media/aeron_udp_channel_transport_bindings.h"
+#ifdef __GNUC__
+#pragma GCC diagnostic pop
+#endif
+}
+
+using namespace rai;
+using namespace aekv;
+using namespace kv;
+
+/* duty cycle interval when run from the poll, a tick repeats the duty cycle
+   while it finds work, up to the limit, then yields to the other sockets,
+   the interval doubles while idle up to the conductor timer interval */
+static const uint64_t DRIVER_POLL_US     = 100;
+static const uint32_t DRIVER_WORK_LIMIT  = 16;
+static const uint32_t POLL_EVENT_ID      = 0,
+                      SHUTDOWN_EVENT_ID  = 1;
+/* the client has 1 sec to close its streams, the driver waits longer */
+static const uint32_t DRIVER_SHUTDOWN_TICKS = 2 * 1000000 / DRIVER_POLL_US;
+
+/* the bindings have no closure, one driver in poll mode uses them, they wrap
+   the media named by AERON_UDP_CHANNEL_TRANSPORT_BINDINGS_MEDIA */
+static EvAeronDriver                          * udp_driver;
+static aeron_udp_channel_transport_bindings_t * udp_media;
+
+/* the multishot recvs of a uring poller drain its transport fds, they don't
+   become readable, the ring fd is readable when the recvs complete */
+static int
+evpoll_fd( aeron_udp_transport_poller_t  * poller,
+           aeron_udp_channel_transport_t * transport )
+{
+  if ( udp_media == &aekv_udp_uring ) {
+    int fd = aekv_udp_uring_poller_fd( poller );
+    if ( fd >= 0 )
+      return fd;
+  }
+  return transport->fd;
+}
+
+static int
+evpoll_poller_add( aeron_udp_transport_poller_t  * poller,
+                   aeron_udp_channel_transport_t * transport )
+{
+  int status = udp_media->poller_add_func( poller, transport );
+  if ( status == 0 && udp_driver != NULL )
+    udp_driver->add_udp( evpoll_fd( poller, transport ) );
+  return status;
+}
+
+static int
+evpoll_poller_remove( aeron_udp_transport_poller_t  * poller,
+                      aeron_udp_channel_transport_t * transport )
+{
+  int fd     = evpoll_fd( poller, transport ),
+      status = udp_media->poller_remove_func( poller, transport );
+  if ( status == 0 && udp_driver != NULL )
+    udp_driver->remove_udp( fd );
+  return status;
+}
+
+static int
+evpoll_poller_init( aeron_udp_transport_poller_t          * poller,
+                    aeron_driver_context_t                * context,
+                    aeron_udp_channel_transport_affinity_t  affinity )
+{
+  return udp_media->poller_init_func( poller, context, affinity );
+}
+
+/* the ring fd is closed with the poller, even with transports still added */
+static int
+evpoll_poller_close( aeron_udp_transport_poller_t * poller )
+{
+  int fd = ( udp_media == &aekv_udp_uring ?
+             aekv_udp_uring_poller_fd( poller ) : -1 );
+  if ( fd >= 0 && udp_driver != NULL )
+    udp_driver->remove_udp( fd, true );
+  return udp_media->poller_close_func( poller );
+}
+
+static int
+evpoll_poller_poll( aeron_udp_transport_poller_t              * poller,
+                    struct mmsghdr                            * msgvec,
+                    size_t                                      vlen,
+                    int64_t                                   * bytes_rcved,
+                    aeron_udp_transport_recv_func_t             recv_func,
+                    aeron_udp_channel_transport_recvmmsg_func_t recvmmsg_func,
+                    void                                      * clientd )
+{
+  return udp_media->poller_poll_func( poller, msgvec, vlen, bytes_rcved,
+                                        recv_func, recvmmsg_func, clientd );
+}
+
+static aeron_udp_channel_transport_bindings_t evpoll_udp =
+{ aeron_udp_channel_transport_init,
+  aeron_udp_channel_transport_close,
+  aeron_udp_channel_transport_recvmmsg,
+  aeron_udp_channel_transport_sendmmsg,
+  aeron_udp_channel_transport_sendmsg,
+  aeron_udp_channel_transport_get_so_rcvbuf,
+  aeron_udp_channel_transport_bind_addr_and_port,
+  evpoll_poller_init,
+  evpoll_poller_close,
+  evpoll_poller_add,
+  evpoll_poller_remove,
+  evpoll_poller_poll,
+  { "evpoll", "media", NULL, NULL }
+};
+
+EvAeronDriver::EvAeronDriver( EvPoll &p ) noexcept
+    : EvSocket( p, p.register_type( "aeron_driver" ) ),
+      context( 0 ), driver( 0 ), client( 0 ), udp_tab( 0 ), udp_free( 0 ),
+      udp_size( 0 ), udp_count( 0 ), cpu( -1 ), timer_id( 0 ),
+      work_count( 0 ), idle_count( 0 ), poll_us( DRIVER_POLL_US ),
+      max_poll_us( DRIVER_POLL_US ), shutdown_count( 0 ), drv_flags( 0 )
+{
+  ::memset( &this->thr, 0, sizeof( this->thr ) );
+  this->next_timer_id = (uint64_t) this->sock_type << 56;
+  this->udp_sock_type = p.register_type( "aeron_udp" );
+}
+
+EvAeronDriver *
+EvAeronDriver::create_driver( EvPoll &p ) noexcept
+{
+  void * m = aligned_malloc( sizeof( EvAeronDriver ) );
+  if ( m == NULL ) {
+    perror( "alloc aeron driver" );
+    return NULL;
+  }
+  return new ( m ) EvAeronDriver( p );
+}
+
+/* a client asked the driver to terminate */
+void
+EvAeronDriver::termination_hook( void *me )
+{
+  ((EvAeronDriver *) me)->set_drv( DRV_FLAG_STOP );
+}
+
+bool
+EvAeronDriver::start_driver( const char *dir,  bool use_thread,
+                             int cpu ) noexcept
+{
+  int status = aeron_driver_context_init( &this->context );
+  if ( status == 0 && dir != NULL )
+    status = aeron_driver_context_set_dir( this->context, dir );
+  /* one agent for conductor, sender and receiver, the duty cycle is ours */
+  if ( status == 0 )
+    status = aeron_driver_context_set_threading_mode( this->context,
+                                                 AERON_THREADING_MODE_SHARED );
+  /* a stale dir left by a crash is removed, an active driver fails init */
+  if ( status == 0 )
+    status = aeron_driver_context_set_dir_delete_on_start( this->context,
+                                                           true );
+  if ( status == 0 )
+    status = aeron_driver_context_set_dir_delete_on_shutdown( this->context,
+                                                              true );
+  if ( status == 0 )
+    status = aeron_driver_context_set_driver_termination_hook( this->context,
+                                        EvAeronDriver::termination_hook, this );
+  /* the poll wakes on udp readiness with the other sockets, in addition to
+     the timer, the thread uses the default transport */
+  if ( status == 0 && ! use_thread && udp_driver == NULL ) {
+    const char * media = ::getenv( "AERON_UDP_CHANNEL_TRANSPORT_BINDINGS_MEDIA" );
+    udp_media = aeron_udp_channel_transport_bindings_load_media(
+                  media != NULL ? media : "default" );
+    if ( udp_media != NULL ) {
+      evpoll_udp.init_func               = udp_media->init_func;
+      evpoll_udp.close_func              = udp_media->close_func;
+      evpoll_udp.recvmmsg_func           = udp_media->recvmmsg_func;
+      evpoll_udp.sendmmsg_func           = udp_media->sendmmsg_func;
+      evpoll_udp.sendmsg_func            = udp_media->sendmsg_func;
+      evpoll_udp.get_so_rcvbuf_func      = udp_media->get_so_rcvbuf_func;
+      evpoll_udp.bind_addr_and_port_func = udp_media->bind_addr_and_port_func;
+      status = aeron_driver_context_set_udp_channel_transport_bindings(
+                 this->context, &evpoll_udp );
+      if ( status == 0 )
+        udp_driver = this;
+    }
+  }
+  if ( status == 0 )
+    status = aeron_driver_init( &this->driver, this->context );
+  if ( status == 0 )
+    status = aeron_driver_start( this->driver, true );
+  if ( status != 0 ) {
+    fprintf( stderr, "failed to start aeron driver: %s\n", aeron_errmsg() );
+    this->release_driver();
+    return false;
+  }
+  this->set_drv( DRV_FLAG_RUNNING );
+  /* the conductor checks its timers at this interval, the sender and receiver
+     heartbeats and status messages are multiples of it, an idle driver has
+     no timed work due sooner, so that bounds the idle poll interval */
+  this->max_poll_us =
+    aeron_driver_context_get_timer_interval_ns( this->context ) / 1000;
+  if ( this->max_poll_us < DRIVER_POLL_US )
+    this->max_poll_us = DRIVER_POLL_US;
+
+  int pfd = this->poll.get_null_fd();
+  this->PeerData::init_peer( pfd, NULL, "aeron_driver" );
+  this->sock_opts = kv::OPT_NO_POLL | kv::OPT_NO_CLOSE;
+  if ( this->poll.add_sock( this ) < 0 ) {
+    fprintf( stderr, "failed to add aeron driver\n" );
+    this->release_driver();
+    return false;
+  }
+  this->timer_id = ++this->next_timer_id;
+  if ( use_thread ) {
+    this->cpu = cpu;
+    this->set_drv( DRV_FLAG_THREAD );
+    if ( ::pthread_create( &this->thr, NULL, EvAeronDriver::thread_main,
+                           this ) != 0 ) {
+      perror( "pthread_create aeron driver" );
+      this->clear_drv( DRV_FLAG_THREAD );
+    }
+  }
+  /* without a thread, the poll runs the duty cycle */
+  if ( ! this->test_drv( DRV_FLAG_THREAD ) ) {
+    this->poll_us = DRIVER_POLL_US;
+    this->poll.add_timer_micros( this->fd, DRIVER_POLL_US, this->timer_id,
+                                 POLL_EVENT_ID );
+  }
+  return true;
+}
+
+int
+EvAeronDriver::do_work( void ) noexcept
+{
+  int work = aeron_driver_main_do_work( this->driver );
+  if ( work > 0 )
+    this->work_count++;
+  else
+    this->idle_count++;
+  return work;
+}
+
+uint32_t
+EvAeronDriver::run_work( void ) noexcept
+{
+  uint32_t i = 0;
+  if ( ! this->test_drv( DRV_FLAG_THREAD | DRV_FLAG_STOP ) ) {
+    for ( ; i < DRIVER_WORK_LIMIT; i++ )
+      if ( this->do_work() <= 0 )
+        break;
+  }
+  return i;
+}
+
+/* a new timer id, the old timer is dropped when it next expires, the
+   shutdown timer is not replaced */
+void
+EvAeronDriver::set_poll_interval( uint64_t us ) noexcept
+{
+  if ( us == this->poll_us || this->timer_id == 0 ||
+       this->test_drv( DRV_FLAG_THREAD | DRV_FLAG_STOP | DRV_FLAG_SHUTDOWN ) )
+    return;
+  this->poll_us  = us;
+  this->timer_id = ++this->next_timer_id;
+  this->poll.add_timer_micros( this->fd, us, this->timer_id, POLL_EVENT_ID );
+}
+
+bool
+EvAeronDriver::add_udp( int fd ) noexcept
+{
+  EvAeronUdp * u;
+  if ( fd < 0 )
+    return false;
+  if ( (uint32_t) fd >= this->udp_size ) {
+    uint32_t sz = ( (uint32_t) fd + 16 ) & ~(uint32_t) 15;
+    void   * p  = ::realloc( this->udp_tab, sz * sizeof( this->udp_tab[ 0 ] ) );
+    if ( p == NULL ) {
+      perror( "realloc udp_tab" );
+      return false;
+    }
+    this->udp_tab = (EvAeronUdp **) p;
+    ::memset( &this->udp_tab[ this->udp_size ], 0,
+              ( sz - this->udp_size ) * sizeof( this->udp_tab[ 0 ] ) );
+    this->udp_size = sz;
+  }
+  if ( this->udp_tab[ fd ] != NULL ) {
+    this->udp_tab[ fd ]->refs++;
+    return true;
+  }
+  /* a removed sock may still be referenced by the current dispatch, so they
+     are reused instead of freed until the driver is released */
+  if ( (u = this->udp_free) != NULL )
+    this->udp_free = u->next;
+  else {
+    void * m = aligned_malloc( sizeof( EvAeronUdp ) );
+    if ( m == NULL ) {
+      perror( "alloc aeron udp" );
+      return false;
+    }
+    u = new ( m ) EvAeronUdp( this->poll, this->udp_sock_type, *this );
+  }
+  u->next = NULL;
+  u->refs = 1;
+  u->PeerData::init_peer( fd, NULL, "aeron_udp" );
+  u->sock_opts = kv::OPT_NO_CLOSE;
+  if ( this->poll.add_sock( u ) < 0 ) {
+    fprintf( stderr, "failed to add aeron udp fd %d\n", fd );
+    u->next = this->udp_free;
+    this->udp_free = u;
+    return false;
+  }
+  this->udp_tab[ fd ] = u;
+  this->udp_count++;
+  return true;
+}
+
+void
+EvAeronDriver::remove_udp( int fd,  bool all ) noexcept
+{
+  EvAeronUdp * u;
+  if ( fd < 0 || (uint32_t) fd >= this->udp_size ||
+       (u = this->udp_tab[ fd ]) == NULL )
+    return;
+  if ( --u->refs > 0 && ! all )
+    return;
+  this->udp_tab[ fd ] = NULL;
+  this->udp_count--;
+  this->poll.remove_sock( u );
+  u->next = this->udp_free;
+  this->udp_free = u;
+}
+
+void
+EvAeronDriver::release_udp( void ) noexcept
+{
+  for ( uint32_t fd = 0; fd < this->udp_size; fd++ )
+    if ( this->udp_tab[ fd ] != NULL )
+      this->remove_udp( (int) fd, true );
+  while ( this->udp_free != NULL ) {
+    EvAeronUdp * u = this->udp_free;
+    this->udp_free = u->next;
+    ::free( u );
+  }
+  if ( this->udp_tab != NULL )
+    ::free( this->udp_tab );
+  this->udp_tab  = NULL;
+  this->udp_size = 0;
+  if ( udp_driver == this )
+    udp_driver = NULL;
+}
+
+/* duty cycle thread, idles with the driver idle strategy (AERON_SHARED_IDLE_
+   STRATEGY), which backs off from spinning to parking */
+void *
+EvAeronDriver::thread_main( void *me ) noexcept
+{
+  EvAeronDriver &_this = *(EvAeronDriver *) me;
+  if ( _this.cpu >= 0 ) {
+    cpu_set_t set;
+    CPU_ZERO( &set );
+    CPU_SET( _this.cpu, &set );
+    if ( ::pthread_setaffinity_np( ::pthread_self(), sizeof( set ),
+                                   &set ) != 0 )
+      fprintf( stderr, "failed to pin aeron driver to cpu %d\n", _this.cpu );
+  }
+  while ( ! _this.test_drv( DRV_FLAG_STOP ) )
+    aeron_driver_main_idle_strategy( _this.driver, _this.do_work() );
+  return NULL;
+}
+
+void
+EvAeronDriver::stop_thread( void ) noexcept
+{
+  this->set_drv( DRV_FLAG_STOP );
+  if ( this->test_drv( DRV_FLAG_THREAD ) ) {
+    ::pthread_join( this->thr, NULL );
+    this->clear_drv( DRV_FLAG_THREAD );
+  }
+}
+
+void
+EvAeronDriver::release_driver( void ) noexcept
+{
+  this->stop_thread();
+  if ( this->driver != NULL ) {
+    if ( aeron_driver_close( this->driver ) != 0 )
+      fprintf( stderr, "aeron_driver_close: %s\n", aeron_errmsg() );
+    this->driver = NULL;
+  }
+  if ( this->context != NULL ) {
+    if ( aeron_driver_context_close( this->context ) != 0 )
+      fprintf( stderr, "aeron_driver_context_close: %s\n", aeron_errmsg() );
+    this->context = NULL;
+  }
+  /* driver close removed the transports, unless it failed */
+  this->release_udp();
+  this->clear_drv( DRV_FLAG_RUNNING );
+}
+
+bool
+EvAeronDriver::timer_expire( uint64_t tid,  uint64_t event_id ) noexcept
+{
+  if ( tid != this->timer_id )
+    return false;
+  uint32_t work = this->run_work();
+  switch ( event_id ) {
+    case POLL_EVENT_ID: {
+      if ( this->test_drv( DRV_FLAG_STOP ) ) {
+        fprintf( stderr, "aeron driver terminated\n" );
+        return false;
+      }
+      uint64_t us = DRIVER_POLL_US;
+      if ( work == 0 ) {
+        us = this->poll_us * 2;
+        if ( us > this->max_poll_us )
+          us = this->max_poll_us;
+      }
+      if ( us == this->poll_us )
+        return true;
+      this->set_poll_interval( us );
+      return false;
+    }
+    case SHUTDOWN_EVENT_ID:
+      /* the client closes its streams with the driver still running */
+      if ( this->client != NULL && this->client->aeron != NULL &&
+           ++this->shutdown_count < DRIVER_SHUTDOWN_TICKS )
+        return true;
+      this->timer_id = 0;
+      this->push( EV_CLOSE );
+      return false;
+    default:
+      return false;
+  }
+}
+
+/* shutdown waits for the client, the shutdown timer closes the driver */
+void
+EvAeronDriver::process_shutdown( void ) noexcept
+{
+  if ( ! this->test_drv( DRV_FLAG_SHUTDOWN ) &&
+       this->client != NULL && this->client->aeron != NULL ) {
+    this->set_drv( DRV_FLAG_SHUTDOWN );
+    this->timer_id = ++this->next_timer_id;
+    this->shutdown_count = 1;
+    this->poll.add_timer_micros( this->fd, DRIVER_POLL_US, this->timer_id,
+                                 SHUTDOWN_EVENT_ID );
+  }
+  if ( this->test_drv( DRV_FLAG_SHUTDOWN ) )
+    this->pop( EV_SHUTDOWN );
+  else
+    this->pushpop( EV_CLOSE, EV_SHUTDOWN );
+}
+
+void
+EvAeronDriver::process_close( void ) noexcept
+{
+  this->timer_id = 0;
+  this->release_driver();
+}
+
+void EvAeronDriver::write( void ) noexcept {}
+void EvAeronDriver::read( void ) noexcept {}
+void EvAeronDriver::process( void ) noexcept {}
+void EvAeronDriver::release( void ) noexcept {}
+
+/* udp readable, the level triggered epoll reports it again if the duty
+   cycle limit leaves datagrams unread, the replies and naks which follow
+   are timed by the duty cycle, so the poll interval is reset */
+void
+EvAeronUdp::read( void ) noexcept
+{
+  this->pop( kv::EV_READ );
+  if ( this->drv.run_work() > 0 )
+    this->drv.set_poll_interval( DRIVER_POLL_US );
+}
+
+void EvAeronUdp::write( void ) noexcept {}
+void EvAeronUdp::process( void ) noexcept {}
+void EvAeronUdp::release( void ) noexcept {}
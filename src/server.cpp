@@ -6,6 +6,9 @@
 #include <signal.h>
 #include <pthread.h>
 #include <aekv/ev_aeron.h>
+#ifdef AEKV_HAVE_DRIVER
+#include <aekv/ev_aeron_driver.h>
+#endif
 #include <raikv/mainloop.h>
 
 using namespace rai;
@@ -20,17 +23,78 @@ struct Loop : public MainLoop<Args> {
   Loop( EvShm &m,  Args &args,  int num, bool (*ini)( void * ) ) :
     MainLoop<Args>( m, args, num, ini ) {}
 
- EvAeron * aeron_sv;
+ EvAeron       * aeron_sv;
+#ifdef AEKV_HAVE_DRIVER
+ EvAeronDriver * driver_sv;
+#endif
+
+  /* AEKV_DRIVER hosts the media driver: "poll" runs it from this loop,
+     "thread" on its own thread, a number on a thread pinned to that cpu,
+     the client and the driver both use AERON_DIR */
+  bool driver_init( void ) {
+    const char * mode = ::getenv( "AEKV_DRIVER" );
+#ifndef AEKV_HAVE_DRIVER
+    if ( mode != NULL ) {
+      fprintf( stderr, "AEKV_DRIVER=%s, built without the media driver\n",
+               mode );
+      return false;
+    }
+    return true;
+#else
+    this->driver_sv = NULL;
+    if ( mode == NULL )
+      return true;
+    this->driver_sv = EvAeronDriver::create_driver( this->poll );
+    if ( this->driver_sv == NULL )
+      return false;
+    if ( ::strcmp( mode, "poll" ) == 0 )
+      return this->driver_sv->start_driver( NULL, false, -1 );
+    if ( ::strcmp( mode, "thread" ) == 0 )
+      return this->driver_sv->start_driver( NULL, true, -1 );
+    return this->driver_sv->start_driver( NULL, true, ::atoi( mode ) );
+#endif
+  }
 
   bool aeron_init( void ) {
     this->aeron_sv = EvAeron::create_aeron( this->poll );
-    if ( this->aeron_sv != NULL )
-      return this->aeron_sv->start_aeron( NULL, "aeron:ipc", 100, "aeron:ipc", 100 );
-    return false;
+    if ( this->aeron_sv == NULL )
+      return false;
+    /* all peers must understand subject ids when enabled */
+    if ( ::getenv( "AEKV_SUBJECT_ID" ) != NULL )
+      this->aeron_sv->set_ae( EvAeron::AE_FLAG_SUBJ_ID );
+    /* size session slab for the expected peers, AEKV_HUGEPAGES maps it with
+       hugepages */
+    const char * max_sess = ::getenv( "AEKV_SESSION_MAX" );
+    if ( max_sess != NULL &&
+         ! this->aeron_sv->my_peers.reserve( (uint32_t) ::atoi( max_sess ),
+                                     ::getenv( "AEKV_HUGEPAGES" ) != NULL ) )
+      fprintf( stderr, "failed to reserve %s sessions\n", max_sess );
+    if ( ! this->aeron_sv->start_aeron( NULL, "aeron:ipc", 100, "aeron:ipc", 100 ) )
+      return false;
+#ifdef AEKV_HAVE_DRIVER
+    /* driver closes after the client */
+    if ( this->driver_sv != NULL )
+      this->driver_sv->client = this->aeron_sv;
+#endif
+    /* lower is faster failover, higher has fewer false timeouts */
+    const char * phi = ::getenv( "AEKV_PHI" );
+    if ( phi != NULL && ::atof( phi ) > 0 )
+      this->aeron_sv->my_peers.phi_threshold = ::atof( phi );
+    /* subs replayed to joining peers per 100us poll */
+    const char * budget = ::getenv( "AEKV_REPLAY_BUDGET" );
+    if ( budget != NULL && ::atoi( budget ) > 0 )
+      this->aeron_sv->replay_budget = (uint32_t) ::atoi( budget );
+    /* per peer counters and latency, json lines rewritten every 10 secs */
+    this->aeron_sv->stats_path = ::getenv( "AEKV_STATS" );
+    /* warm restart from subscription and peer state saved by last run */
+    const char * snap = ::getenv( "AEKV_SNAPSHOT" );
+    if ( snap != NULL && ! this->aeron_sv->open_snapshot( snap ) )
+      fprintf( stderr, "failed to open snapshot %s\n", snap );
+    return true;
   }
 
   bool init( void ) {
-    if ( this->aeron_init() )
+    if ( this->driver_init() && this->aeron_init() )
       return true;
     return false;
   }
@@ -0,0 +1,107 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <aekv/ev_aeron.h>
+#include <aekv/ev_aeron_coro.h>
+#include <raikv/mainloop.h>
+
+/* echo service with C++20 coroutines on the bridge, the messages published
+ * to ECHO are sent back to the reply, AEKV_REQUEST sends one request to
+ * ECHO and prints the reply, run one of each with a media driver */
+
+using namespace rai;
+using namespace aekv;
+using namespace kv;
+
+#if __cplusplus < 202002L || ! __has_include( <coroutine> )
+#error "aeron_coro needs -std=c++20 and <coroutine>"
+#endif
+
+static const char   echo_sub[]   = "ECHO",
+                    echo_inbox[] = "_INBOX.ECHO";
+static const uint16_t echo_len   = sizeof( echo_sub ) - 1,
+                      inbox_len  = sizeof( echo_inbox ) - 1;
+static const uint8_t  string_enc = 2; /* MD_STRING of raimd */
+
+static AeronTask
+echo( EvAeron &ae )
+{
+  for (;;) {
+    EvPublish * m = co_await AeronNextMsg( ae, echo_sub, echo_len );
+    if ( m == NULL )
+      break;
+    if ( m->reply_len == 0 )
+      continue;
+    /* the reply and msg are copied before the offer waits */
+    if ( ! co_await AeronOffer( ae, (const char *) m->reply, m->reply_len,
+                                m->msg, m->msg_len, m->msg_enc ) )
+      fprintf( stderr, "echo not sent\n" );
+  }
+}
+
+static AeronTask
+request( EvAeron &ae,  const char *msg )
+{
+  EvPublish * m = co_await AeronRequest( ae, echo_sub, echo_len, echo_inbox,
+                                         inbox_len, msg, ::strlen( msg ),
+                                         string_enc );
+  if ( m == NULL )
+    fprintf( stderr, "no reply\n" );
+  else
+    printf( "reply: %.*s\n", (int) m->msg_len, (const char *) m->msg );
+}
+
+struct Args : public MainLoopVars { /* argv[] parsed args */
+  Args() {}
+};
+
+struct Loop : public MainLoop<Args> {
+  Loop( EvShm &m,  Args &args,  int num, bool (*ini)( void * ) ) :
+    MainLoop<Args>( m, args, num, ini ) {}
+
+  EvAeron * aeron_sv;
+
+  bool aeron_init( void ) {
+    this->aeron_sv = EvAeron::create_aeron( this->poll );
+    if ( this->aeron_sv == NULL )
+      return false;
+    if ( ! this->aeron_sv->start_aeron( NULL, "aeron:ipc", 100, "aeron:ipc",
+                                        100 ) )
+      return false;
+    const char * req = ::getenv( "AEKV_REQUEST" );
+    if ( req == NULL ) {
+      this->aeron_sv->subscribe( echo_sub, echo_len );
+      echo( *this->aeron_sv );
+    }
+    else {
+      this->aeron_sv->subscribe( echo_inbox, inbox_len );
+      request( *this->aeron_sv, req );
+    }
+    return true;
+  }
+
+  bool init( void ) {
+    return this->aeron_init();
+  }
+
+  static bool initialize( void *me ) noexcept {
+    return ((Loop *) me)->init();
+  }
+};
+
+int
+main( int argc, const char *argv[] )
+{
+  EvShm shm;
+  Args  r;
+
+  if ( ! r.parse_args( argc, argv ) )
+    return 1;
+  if ( shm.open( r.map_name, r.db_num ) != 0 )
+    return 1;
+  Runner<Args, Loop> runner( r, shm, Loop::initialize );
+  if ( r.thr_error == 0 )
+    return 0;
+  return 1;
+}
@@ -218,7 +218,9 @@ int main(int argc, char **argv)
       exit( 1 );
     }
     aeron_properties_setenv( "AERON_THREADING_MODE", "SHARED" );
-    aeron_properties_setenv( "AERON_UDP_CHANNEL_TRANSPORT_BINDINGS_MEDIA", "myudp" );
+    /* -DAERON_UDP_CHANNEL_TRANSPORT_BINDINGS_MEDIA=aekv_udp_mmsg uses that */
+    if ( getenv( "AERON_UDP_CHANNEL_TRANSPORT_BINDINGS_MEDIA" ) == NULL )
+        aeron_properties_setenv( "AERON_UDP_CHANNEL_TRANSPORT_BINDINGS_MEDIA", "myudp" );
     poll_fd  = epoll_create1( 0 );
     timer_fd = timerfd_create( CLOCK_MONOTONIC, TFD_NONBLOCK );
     ts.it_interval.tv_sec  = 0;
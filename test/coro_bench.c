@@ -0,0 +1,298 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <aekv/coroutine.h>
+
+/* prints one json object per line:
+ * {"bench":"resume_yield","mode":"shared","arg":0,"ops":1000000,"ns_per_op":12.3} */
+
+static uint64_t iters = 1000000;
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static const char *mode_str(int mode) {
+  return mode == COROUTINE_SEPARATE_STACK ? "separate" : "shared";
+}
+
+static void report(const char *bench, const char *mode, uint64_t arg,
+                   uint64_t ops, uint64_t ns) {
+  printf("{\"bench\":\"%s\",\"mode\":\"%s\",\"arg\":%lu,\"ops\":%lu,"
+         "\"ns_per_op\":%.2f}\n", bench, mode, (unsigned long) arg,
+         (unsigned long) ops, ops ? (double) ns / (double) ops : 0.0);
+  fflush(stdout);
+}
+
+/* resume + yield round trip, the stack in use is depth bytes */
+struct depth_arg {
+  uint64_t n;
+  size_t   depth;
+};
+
+static void yield_loop(coroutine_t *co, uint64_t n) {
+  uint64_t i;
+  for (i = 0; i < n; i++)
+    coroutine_yield(co);
+}
+
+static void yield_depth(coroutine_t *co, void *ud) {
+  struct depth_arg *a = ud;
+  volatile char *buf = a->depth ? alloca(a->depth) : NULL;
+  size_t i;
+  for (i = 0; i < a->depth; i += 64)
+    buf[i] = (char) i;
+  yield_loop(co, a->n);
+}
+
+static void bench_resume_yield(int mode, size_t depth) {
+  schedule_t *S = coroutine_open_mode(0, mode);
+  struct depth_arg a = { iters, depth };
+  coroutine_t *co = coroutine_new(S, yield_depth, &a, "y");
+  uint64_t t;
+  coroutine_resume(co); /* touch stack before timing */
+  t = now_ns();
+  while (coroutine_status(co))
+    coroutine_resume(co);
+  t = now_ns() - t;
+  report(depth ? "switch_depth" : "resume_yield", mode_str(mode), depth,
+         iters, t);
+  coroutine_close(S);
+}
+
+/* new, first resume to completion and slot reuse */
+static void nop(coroutine_t *co, void *ud) {
+  (void) co; (void) ud;
+}
+
+static void bench_create(int mode) {
+  schedule_t *S = coroutine_open_mode(0, mode);
+  uint64_t i, n = iters / 4, t = now_ns();
+  for (i = 0; i < n; i++)
+    coroutine_resume(coroutine_new(S, nop, NULL, "c"));
+  t = now_ns() - t;
+  report("create_destroy", mode_str(mode), 0, n, t);
+  coroutine_close(S);
+}
+
+/* k coroutines yielding, dispatched by coroutine_run() */
+static void run_yield(coroutine_t *co, void *ud) {
+  yield_loop(co, *(uint64_t *) ud);
+}
+
+static void bench_run_queue(int mode, uint64_t k) {
+  schedule_t *S = coroutine_open_mode(0, mode);
+  uint64_t i, n = iters / k, ops = 0, t;
+  for (i = 0; i < k; i++)
+    coroutine_new(S, run_yield, &n, "r");
+  t = now_ns();
+  while ((i = coroutine_run(S)) > 0)
+    ops += i;
+  t = now_ns() - t;
+  report("run_queue", mode_str(mode), k, ops, t);
+  coroutine_close(S);
+}
+
+/* pairs hand off with wake and suspend, one switch per message */
+struct pp_arg {
+  coroutine_t *peer;
+  uint64_t     n;
+};
+
+static void ping_pong(coroutine_t *co, void *ud) {
+  struct pp_arg *a = ud;
+  uint64_t i;
+  for (i = 0; i < a->n; i++) {
+    coroutine_wake(a->peer);
+    coroutine_suspend(co);
+  }
+  coroutine_wake(a->peer);
+}
+
+static void bench_ping_pong(int mode, uint64_t pairs) {
+  schedule_t *S = coroutine_open_mode(0, mode);
+  struct pp_arg *a = calloc(pairs * 2, sizeof(a[0]));
+  coroutine_t **c = calloc(pairs * 2, sizeof(c[0]));
+  uint64_t i, ops = 0, t, n = iters / pairs / 2;
+  for (i = 0; i < pairs * 2; i++) {
+    a[i].n = n;
+    c[i] = coroutine_new(S, ping_pong, &a[i], "p");
+  }
+  for (i = 0; i < pairs * 2; i++)
+    a[i].peer = c[i ^ 1];
+  t = now_ns();
+  while ((i = coroutine_run(S)) > 0)
+    ops += i;
+  t = now_ns() - t;
+  report("ping_pong", mode_str(mode), pairs, ops, t);
+  coroutine_close(S);
+  free(a);
+  free(c);
+}
+
+/* work stealing pool, k coroutines yielding on nworkers threads */
+static void bench_pool(int nworkers, uint64_t k) {
+  coroutine_pool_t *P = coroutine_pool_open(nworkers, 0);
+  uint64_t i, n = iters / k, t;
+  char mode[ 32 ];
+  for (i = 0; i < k; i++)
+    coroutine_pool_new(P, run_yield, &n, "w", -1);
+  t = now_ns();
+  coroutine_pool_run(P);
+  t = now_ns() - t;
+  snprintf(mode, sizeof(mode), "pool%d", nworkers);
+  report("pool_yield", mode, k, n * k, t);
+  coroutine_pool_close(P);
+}
+
+/* producer and consumer pinned to different workers, a ring of 64, each
+ * side tests the ring and suspends, the other wakes it, a wake between the
+ * test and the suspend must not be lost or the pool hangs */
+#define PC_RING 64
+struct pc_arg {
+  coroutine_t      *prod, *cons;
+  volatile uint64_t head, tail;
+  uint64_t          n, sum, ring[PC_RING];
+};
+
+static void producer(coroutine_t *co, void *ud) {
+  struct pc_arg *a = ud;
+  uint64_t i;
+  for (i = 0; i < a->n; i++) {
+    while (a->tail - a->head == PC_RING)
+      coroutine_suspend(co);
+    a->ring[a->tail % PC_RING] = i;
+    __sync_synchronize();
+    a->tail++;
+    coroutine_wake(a->cons);
+  }
+}
+
+static void consumer(coroutine_t *co, void *ud) {
+  struct pc_arg *a = ud;
+  uint64_t i;
+  for (i = 0; i < a->n; i++) {
+    while (a->head == a->tail)
+      coroutine_suspend(co);
+    a->sum += a->ring[a->head % PC_RING];
+    __sync_synchronize();
+    a->head++;
+    coroutine_wake(a->prod);
+  }
+}
+
+static void bench_pool_prod_cons(void) {
+  coroutine_pool_t *P = coroutine_pool_open(2, 0);
+  struct pc_arg a;
+  uint64_t t;
+  memset(&a, 0, sizeof(a));
+  a.n    = iters / 10;
+  a.prod = coroutine_pool_new(P, producer, &a, "prod", 0);
+  a.cons = coroutine_pool_new(P, consumer, &a, "cons", 1);
+  t = now_ns();
+  coroutine_pool_run(P);
+  t = now_ns() - t;
+  if (a.sum != a.n * (a.n - 1) / 2) {
+    fprintf(stderr, "prod_cons sum %lu, expected %lu\n",
+            (unsigned long) a.sum, (unsigned long) (a.n * (a.n - 1) / 2));
+    exit(1);
+  }
+  report("pool_prod_cons", "pool2", PC_RING, a.n, t);
+  coroutine_pool_close(P);
+}
+
+/* baselines, an indirect call and a thread handoff with a condvar */
+static uint64_t call_count;
+static void __attribute__((noinline)) counted(void) { call_count++; }
+static void (*volatile call_fp)(void) = counted;
+
+static void bench_call(void) {
+  uint64_t i, t = now_ns();
+  for (i = 0; i < iters; i++)
+    call_fp();
+  t = now_ns() - t;
+  report("baseline_call", "none", 0, iters, t);
+}
+
+struct handoff {
+  pthread_mutex_t mu;
+  pthread_cond_t  cv;
+  uint64_t        turn, n;
+};
+
+static void *handoff_thr(void *p) {
+  struct handoff *h = p;
+  pthread_mutex_lock(&h->mu);
+  while (h->turn < h->n) {
+    while ((h->turn & 1) == 0)
+      pthread_cond_wait(&h->cv, &h->mu);
+    h->turn++;
+    pthread_cond_signal(&h->cv);
+  }
+  pthread_mutex_unlock(&h->mu);
+  return NULL;
+}
+
+static void bench_thread_handoff(void) {
+  struct handoff h;
+  pthread_t thr;
+  uint64_t t;
+  pthread_mutex_init(&h.mu, NULL);
+  pthread_cond_init(&h.cv, NULL);
+  h.turn = 0;
+  h.n    = iters / 20 * 2;
+  pthread_create(&thr, NULL, handoff_thr, &h);
+  t = now_ns();
+  pthread_mutex_lock(&h.mu);
+  while (h.turn < h.n) {
+    h.turn++;
+    pthread_cond_signal(&h.cv);
+    while ((h.turn & 1) != 0)
+      pthread_cond_wait(&h.cv, &h.mu);
+  }
+  pthread_mutex_unlock(&h.mu);
+  t = now_ns() - t;
+  pthread_join(thr, NULL);
+  report("baseline_thread_handoff", "none", 0, h.n / 2, t);
+}
+
+int main(int argc, char **argv) {
+  static const size_t depth[] = { 256, 1024, 4096, 16384, 65536 };
+  int mode, opt;
+  size_t i;
+
+  while ((opt = getopt(argc, argv, "hn:")) != -1) {
+    if (opt == 'n')
+      iters = strtoull(optarg, NULL, 0);
+    else {
+      fprintf(stderr, "%s [-n iterations]\n", argv[0]);
+      return opt == 'h' ? 0 : 1;
+    }
+  }
+  if (iters < 1000)
+    iters = 1000;
+  bench_call();
+  bench_thread_handoff();
+  for (mode = COROUTINE_SHARED_STACK; mode <= COROUTINE_SEPARATE_STACK;
+       mode++) {
+    bench_resume_yield(mode, 0);
+    for (i = 0; i < sizeof(depth) / sizeof(depth[0]); i++)
+      bench_resume_yield(mode, depth[i]);
+    bench_create(mode);
+    bench_run_queue(mode, 10);
+    bench_run_queue(mode, 1000);
+    bench_ping_pong(mode, 1);
+    bench_ping_pong(mode, 100);
+  }
+  bench_pool(1, 1000);
+  bench_pool(4, 1000);
+  bench_pool_prod_cons();
+  return 0;
+}
@@ -34,7 +34,7 @@ static void test(schedule_t *S) {
 }
 
 int main() {
-  schedule_t *S = coroutine_open();
+  schedule_t *S = coroutine_open(64 * 1024);
   test(S);
   coroutine_close(S);
 
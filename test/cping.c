@@ -331,7 +331,7 @@ int main(int argc, char **argv)
                             opt;
     memset( &cl, 0, sizeof( cl ) );
     memset( &dr, 0, sizeof( dr ) );
-    sched          = coroutine_open();
+    sched          = coroutine_open( 0 );
     cl.runner_coro = coroutine_new( sched, (coroutine_func_t) coro_runner, &cl, "runner" );
     cl.client_coro = coroutine_new( sched, (coroutine_func_t) coro_client, &cl, "client" );
     dr.driver_coro = coroutine_new( sched, (coroutine_func_t) coro_driver, &dr, "driver" );
@@ -63,6 +63,7 @@ const char usage_str[] =
     "    -w messages      number of warm up messages to send\n";
 
 #define MAX_MESSAGE_LENGTH (64 * 1024)
+#define CONDUCTOR_IDLE_NS (1000 * 1000)
 
 typedef struct {
   schedule_t *sched;
@@ -145,14 +146,22 @@ void send_ping_and_receive_pong(
     }
 }
 
+int sub_connected_or_stopped( void *sub )
+{
+    return aeron_subscription_is_connected( (aeron_subscription_t *) sub ) || !is_running();
+}
+
 void coro_runner( coroutine_t *coro, ping_client_t *cl )
 {
     aeron_agent_runner_t *runner = &cl->aeron->runner;
     runner->state = AERON_AGENT_STATE_MANUAL;
     while ( aeron_agent_is_running( runner ) )
     {
-        runner->do_work( runner->agent_state );
-        coroutine_yield( coro );
+        /* conductor parks when idle instead of spinning the scheduler */
+        if ( runner->do_work( runner->agent_state ) > 0 )
+            coroutine_yield( coro );
+        else
+            coroutine_sleep_ns( coro, CONDUCTOR_IDLE_NS );
     }
     runner->state = AERON_AGENT_STATE_STOPPED;
 }
@@ -186,7 +195,7 @@ void coro_client( coroutine_t *coro,  ping_client_t *cl )
             goto cleanup;
         }
 
-        coroutine_yield( coro );
+        coroutine_sleep_ns( coro, CONDUCTOR_IDLE_NS );
     }
 
     printf("Subscription channel status %" PRIu64 "\n", aeron_subscription_channel_status(cl->subscription));
@@ -214,19 +223,15 @@ void coro_client( coroutine_t *coro,  ping_client_t *cl )
             goto cleanup;
         }
 
-        coroutine_yield( coro );
+        coroutine_sleep_ns( coro, CONDUCTOR_IDLE_NS );
     }
 
     printf("Publication channel status %" PRIu64 "\n", aeron_exclusive_publication_channel_status(cl->publication));
 
-    while (!aeron_subscription_is_connected(cl->subscription))
+    coroutine_wait_cond( coro, sub_connected_or_stopped, cl->subscription );
+    if (!is_running())
     {
-        if (!is_running())
-        {
-            goto cleanup;
-        }
-
-        coroutine_yield( coro );
+        goto cleanup;
     }
 
     if ((cl->image = aeron_subscription_image_at_index(cl->subscription, 0)) == NULL)
@@ -281,7 +286,7 @@ int main(int argc, char **argv)
     int status = EXIT_FAILURE, opt;
 
     memset( &cl, 0, sizeof( cl ) );
-    cl.sched = coroutine_open();
+    cl.sched = coroutine_open( 0 );
     cl.r     = coroutine_new( cl.sched, (coroutine_func_t) coro_runner, &cl, "runner" );
     cl.c     = coroutine_new( cl.sched, (coroutine_func_t) coro_client, &cl, "client" );
 
@@ -399,8 +404,8 @@ int main(int argc, char **argv)
 
     while ( coroutine_status( cl.r ) && coroutine_status( cl.c ) )
     {
-        coroutine_resume( cl.r );
-        coroutine_resume( cl.c );
+        if ( coroutine_run( cl.sched ) == 0 )
+            coroutine_poll( cl.sched, 100 );
     }
 
 cleanup:
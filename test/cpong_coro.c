@@ -56,6 +56,8 @@ const char usage_str[] =
     "    -S stream-id     stream-id to use for pong channel\n"
     "    -s stream-id     stream-id to use for ping channel\n";
 
+#define CONDUCTOR_IDLE_NS (1000 * 1000)
+
 typedef struct {
   schedule_t *sched;
   coroutine_t *c, *r;
@@ -102,14 +104,22 @@ void ping_poll_handler(void *clientd, const uint8_t *buffer, size_t length, aero
     aeron_buffer_claim_commit(&buffer_claim);
 }
 
+int sub_connected_or_stopped( void *sub )
+{
+    return aeron_subscription_is_connected( (aeron_subscription_t *) sub ) || !is_running();
+}
+
 void coro_runner( coroutine_t *coro, pong_client_t *cl )
 {
     aeron_agent_runner_t *runner = &cl->aeron->runner;
     runner->state = AERON_AGENT_STATE_MANUAL;
     while ( aeron_agent_is_running( runner ) )
     {
-        runner->do_work( runner->agent_state );
-        coroutine_yield( coro );
+        /* conductor parks when idle instead of spinning the scheduler */
+        if ( runner->do_work( runner->agent_state ) > 0 )
+            coroutine_yield( coro );
+        else
+            coroutine_sleep_ns( coro, CONDUCTOR_IDLE_NS );
     }
     runner->state = AERON_AGENT_STATE_STOPPED;
 }
@@ -143,7 +153,7 @@ void coro_client( coroutine_t *coro,  pong_client_t *cl )
             goto cleanup;
         }
 
-        coroutine_yield( coro );
+        coroutine_sleep_ns( coro, CONDUCTOR_IDLE_NS );
     }
 
     printf("Subscription channel status %" PRIu64 "\n", aeron_subscription_channel_status(cl->subscription));
@@ -171,19 +181,15 @@ void coro_client( coroutine_t *coro,  pong_client_t *cl )
             goto cleanup;
         }
 
-        coroutine_yield( coro );
+        coroutine_sleep_ns( coro, CONDUCTOR_IDLE_NS );
     }
 
     printf("Publication channel status %" PRIu64 "\n", aeron_exclusive_publication_channel_status(cl->publication));
 
-    while (!aeron_subscription_is_connected(cl->subscription))
+    coroutine_wait_cond( coro, sub_connected_or_stopped, cl->subscription );
+    if (!is_running())
     {
-        if (!is_running())
-        {
-            goto cleanup;
-        }
-
-        coroutine_yield( coro );
+        goto cleanup;
     }
 
     if ((cl->image = aeron_subscription_image_at_index(cl->subscription, 0)) == NULL)
@@ -232,7 +238,7 @@ int main(int argc, char **argv)
     int status = EXIT_FAILURE, opt;
 
     memset( &cl, 0, sizeof( cl ) );
-    cl.sched = coroutine_open();
+    cl.sched = coroutine_open( 0 );
     cl.r     = coroutine_new( cl.sched, (coroutine_func_t) coro_runner, &cl, "runner" );
     cl.c     = coroutine_new( cl.sched, (coroutine_func_t) coro_client, &cl, "client" );
 
@@ -317,8 +323,8 @@ int main(int argc, char **argv)
 
     while ( coroutine_status( cl.r ) && coroutine_status( cl.c ) )
     {
-        coroutine_resume( cl.r );
-        coroutine_resume( cl.c );
+        if ( coroutine_run( cl.sched ) == 0 )
+            coroutine_poll( cl.sched, 100 );
     }
 
 cleanup:
@@ -0,0 +1,334 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <arpa/inet.h>
+#include <aekv/aeron_udp.h>
+extern "C" {
+#ifdef __GNUC__
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+#endif
+#include <aeronmd.h>
+#include "media/aeron_udp_channel_transport.h"
+#include "media/aeron_udp_transport_poller.h"
+#include "media/aeron_udp_channel_transport_bindings.h"
+#ifdef __GNUC__
+#pragma GCC diagnostic pop
+#endif
+}
+
+/* loopback test of the aekv_udp_mmsg bindings, the datagrams sent through
+ * the gso runs of sendmmsg and the gro buffers split by recvmmsg must keep
+ * the boundaries and the bytes of each datagram sent, exits 1 if not */
+
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+
+/* the default transport the bindings fall back to is plain sockets here,
+ * without a driver context, the driver lib is not linked */
+extern "C" {
+int
+aeron_udp_channel_transport_init( aeron_udp_channel_transport_t * transport,
+                                  struct sockaddr_storage * bind_addr,
+                                  struct sockaddr_storage *,  unsigned int,
+                                  uint8_t,  size_t,  size_t,
+                                  aeron_driver_context_t *,
+                                  aeron_udp_channel_transport_affinity_t )
+{
+  ::memset( transport, 0, sizeof( *transport ) );
+  transport->fd = ::socket( AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0 );
+  if ( transport->fd < 0 )
+    return -1;
+  if ( bind_addr != NULL &&
+       ::bind( transport->fd, (struct sockaddr *) bind_addr,
+               sizeof( struct sockaddr_in ) ) != 0 ) {
+    ::close( transport->fd );
+    return -1;
+  }
+  return 0;
+}
+
+int
+aeron_udp_channel_transport_close( aeron_udp_channel_transport_t * transport )
+{
+  ::close( transport->fd );
+  return 0;
+}
+
+int
+aeron_udp_channel_transport_recvmmsg( aeron_udp_channel_transport_t *,
+                                      struct mmsghdr *,  size_t,  int64_t *,
+                                      aeron_udp_transport_recv_func_t,
+                                      void * )
+{
+  return -1;
+}
+
+int
+aeron_udp_channel_transport_sendmmsg( aeron_udp_channel_transport_t * transport,
+                                      struct mmsghdr * msgvec,  size_t vlen )
+{
+  return ::sendmmsg( transport->fd, msgvec, vlen, 0 );
+}
+
+int
+aeron_udp_channel_transport_sendmsg( aeron_udp_channel_transport_t * transport,
+                                     struct msghdr * message )
+{
+  return ::sendmsg( transport->fd, message, 0 );
+}
+
+int aeron_udp_channel_transport_get_so_rcvbuf(
+  aeron_udp_channel_transport_t *,  size_t * ) { return 0; }
+int aeron_udp_channel_transport_bind_addr_and_port(
+  aeron_udp_channel_transport_t *,  char *,  size_t ) { return 0; }
+int aeron_udp_transport_poller_init( aeron_udp_transport_poller_t *,
+  aeron_driver_context_t *,
+  aeron_udp_channel_transport_affinity_t ) { return 0; }
+int aeron_udp_transport_poller_close(
+  aeron_udp_transport_poller_t * ) { return 0; }
+int aeron_udp_transport_poller_add( aeron_udp_transport_poller_t *,
+  aeron_udp_channel_transport_t * ) { return 0; }
+int aeron_udp_transport_poller_remove( aeron_udp_transport_poller_t *,
+  aeron_udp_channel_transport_t * ) { return 0; }
+int aeron_udp_transport_poller_poll( aeron_udp_transport_poller_t *,
+  struct mmsghdr *,  size_t,  int64_t *,  aeron_udp_transport_recv_func_t,
+  aeron_udp_channel_transport_recvmmsg_func_t,  void * ) { return 0; }
+}
+
+static const size_t MAX_DGRAMS = 64,
+                    MAX_SIZE   = 2048;
+
+/* the datagrams expected in order, each filled with its index */
+struct Expect {
+  size_t   len[ MAX_DGRAMS ],
+           count,    /* datagrams expected */
+           recv,     /* datagrams delivered */
+           errors;
+  uint8_t  seed;
+};
+
+static void
+recv_cb( aeron_udp_channel_data_paths_t *,  aeron_udp_channel_transport_t *,
+         void * clientd,  void *,  void *,  uint8_t * buf,  size_t len,
+         struct sockaddr_storage * )
+{
+  Expect & x = *(Expect *) clientd;
+  size_t   i = x.recv++;
+  uint8_t  c = (uint8_t) ( x.seed + i );
+  if ( i >= x.count ) {
+    fprintf( stderr, "extra datagram %lu len %lu\n", (unsigned long) i,
+             (unsigned long) len );
+    x.errors++;
+    return;
+  }
+  if ( len != x.len[ i ] ) {
+    fprintf( stderr, "datagram %lu len %lu, expected %lu\n",
+             (unsigned long) i, (unsigned long) len,
+             (unsigned long) x.len[ i ] );
+    x.errors++;
+  }
+  for ( size_t j = 0; j < len; j++ ) {
+    if ( buf[ j ] != c ) {
+      fprintf( stderr, "datagram %lu byte %lu is %u, expected %u\n",
+               (unsigned long) i, (unsigned long) j, buf[ j ], c );
+      x.errors++;
+      break;
+    }
+  }
+}
+
+/* recv until count datagrams or a timeout, returns the most delivered by
+ * a single recvmmsg call */
+static size_t
+recv_all( aeron_udp_channel_transport_t & rx,  Expect & x )
+{
+  size_t  most = 0;
+  int64_t bytes = 0;
+  for ( int spin = 0; x.recv < x.count && spin < 1000; spin++ ) {
+    int n = aekv_udp_mmsg.recvmmsg_func( &rx, NULL, 0, &bytes, recv_cb, &x );
+    if ( n < 0 ) {
+      fprintf( stderr, "recvmmsg failed\n" );
+      x.errors++;
+      break;
+    }
+    if ( (size_t) n > most )
+      most = (size_t) n;
+    if ( n == 0 )
+      ::usleep( 1000 );
+  }
+  /* nothing more should arrive */
+  ::usleep( 1000 );
+  aekv_udp_mmsg.recvmmsg_func( &rx, NULL, 0, &bytes, recv_cb, &x );
+  if ( x.recv != x.count ) {
+    fprintf( stderr, "recv %lu datagrams, expected %lu\n",
+             (unsigned long) x.recv, (unsigned long) x.count );
+    x.errors++;
+  }
+  return most;
+}
+
+static uint8_t data[ MAX_DGRAMS ][ MAX_SIZE ];
+
+static void
+fill( Expect & x )
+{
+  for ( size_t i = 0; i < x.count; i++ )
+    ::memset( data[ i ], (uint8_t) ( x.seed + i ), x.len[ i ] );
+  x.recv = 0;
+}
+
+/* sendmmsg of runs of equal sizes, broken by a short datagram which ends a
+ * run and by a larger one which starts the next */
+static size_t
+test_gso_split( aeron_udp_channel_transport_t & rx,
+                aeron_udp_channel_transport_t & tx,
+                struct sockaddr_in & dest )
+{
+  Expect         x;
+  struct iovec   iov[ MAX_DGRAMS ];
+  struct mmsghdr vec[ MAX_DGRAMS ];
+  size_t         i;
+  int            n;
+
+  ::memset( &x, 0, sizeof( x ) );
+  x.count = 40;
+  x.seed  = 1;
+  for ( i = 0; i < x.count; i++ ) {
+    x.len[ i ] = ( i == x.count - 1 ? 100 :
+                   i % 7 == 3       ? 500 :
+                   i % 11 == 5      ? 1472 : 1408 );
+  }
+  fill( x );
+  for ( i = 0; i < x.count; i++ ) {
+    iov[ i ].iov_base = data[ i ];
+    iov[ i ].iov_len  = x.len[ i ];
+    ::memset( &vec[ i ], 0, sizeof( vec[ i ] ) );
+    vec[ i ].msg_hdr.msg_name    = &dest;
+    vec[ i ].msg_hdr.msg_namelen = sizeof( dest );
+    vec[ i ].msg_hdr.msg_iov     = &iov[ i ];
+    vec[ i ].msg_hdr.msg_iovlen  = 1;
+  }
+  n = aekv_udp_mmsg.sendmmsg_func( &tx, vec, x.count );
+  if ( n != (int) x.count ) {
+    fprintf( stderr, "gso sendmmsg sent %d of %lu\n", n,
+             (unsigned long) x.count );
+    x.errors++;
+  }
+  for ( i = 0; i < x.count; i++ ) {
+    if ( vec[ i ].msg_len != x.len[ i ] ) {
+      fprintf( stderr, "gso msg_len %lu is %u, expected %lu\n",
+               (unsigned long) i, vec[ i ].msg_len,
+               (unsigned long) x.len[ i ] );
+      x.errors++;
+    }
+  }
+  recv_all( rx, x );
+  printf( "gso_split: %lu datagrams, %lu errors\n", (unsigned long) x.recv,
+          (unsigned long) x.errors );
+  return x.errors;
+}
+
+/* one gso sendmsg of 64 segments, the last short, arrives as one gro buffer
+ * which recvmmsg splits back into the 64 datagrams */
+static size_t
+test_gro_split( aeron_udp_channel_transport_t & rx,  struct sockaddr_in & dest )
+{
+  Expect        x;
+  struct iovec  iov[ MAX_DGRAMS ];
+  struct msghdr h;
+  union {
+    char        buf[ CMSG_SPACE( sizeof( uint16_t ) ) ];
+    size_t      align;
+  } ctl;
+  uint16_t      gso_size = 1000;
+  int           fd, gro = 0;
+  socklen_t     len = sizeof( gro );
+  size_t        i, most;
+
+  ::memset( &x, 0, sizeof( x ) );
+  x.count = MAX_DGRAMS;
+  x.seed  = 0x80;
+  for ( i = 0; i < x.count; i++ )
+    x.len[ i ] = ( i == x.count - 1 ? 300 : gso_size );
+  fill( x );
+  for ( i = 0; i < x.count; i++ ) {
+    iov[ i ].iov_base = data[ i ];
+    iov[ i ].iov_len  = x.len[ i ];
+  }
+  ::memset( &h, 0, sizeof( h ) );
+  ::memset( &ctl, 0, sizeof( ctl ) );
+  h.msg_name       = &dest;
+  h.msg_namelen    = sizeof( dest );
+  h.msg_iov        = iov;
+  h.msg_iovlen     = x.count;
+  h.msg_control    = ctl.buf;
+  h.msg_controllen = sizeof( ctl.buf );
+  struct cmsghdr * c = CMSG_FIRSTHDR( &h );
+  c->cmsg_level = SOL_UDP;
+  c->cmsg_type  = UDP_SEGMENT;
+  c->cmsg_len   = CMSG_LEN( sizeof( gso_size ) );
+  ::memcpy( CMSG_DATA( c ), &gso_size, sizeof( gso_size ) );
+
+  fd = ::socket( AF_INET, SOCK_DGRAM, 0 );
+  if ( ::sendmsg( fd, &h, 0 ) < 0 ) {
+    perror( "gso sendmsg" );
+    printf( "gro_split: skipped, no UDP_SEGMENT\n" );
+    ::close( fd );
+    return 0;
+  }
+  ::close( fd );
+  most = recv_all( rx, x );
+  /* recvmmsg gets at most 32 datagrams, more than that came from one */
+  if ( ::getsockopt( rx.fd, SOL_UDP, UDP_GRO, &gro, &len ) == 0 && gro != 0 &&
+       most <= 32 ) {
+    fprintf( stderr, "gro on, but at most %lu datagrams per recv\n",
+             (unsigned long) most );
+    x.errors++;
+  }
+  printf( "gro_split: %lu datagrams, gro %d, %lu per recv, %lu errors\n",
+          (unsigned long) x.recv, gro, (unsigned long) most,
+          (unsigned long) x.errors );
+  return x.errors;
+}
+
+int
+main( void )
+{
+  aeron_udp_channel_transport_t rx, tx;
+  struct sockaddr_in            addr;
+  socklen_t                     addrlen = sizeof( addr );
+  size_t                        errors = 0;
+
+  ::memset( &addr, 0, sizeof( addr ) );
+  addr.sin_family      = AF_INET;
+  addr.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+  if ( aekv_udp_mmsg.init_func( &rx, (struct sockaddr_storage *) &addr, NULL,
+                                0, 0, 0, 0, NULL,
+                      AERON_UDP_CHANNEL_TRANSPORT_AFFINITY_RECEIVER ) < 0 ||
+       aekv_udp_mmsg.init_func( &tx, NULL, NULL, 0, 0, 0, 0, NULL,
+                      AERON_UDP_CHANNEL_TRANSPORT_AFFINITY_SENDER ) < 0 ) {
+    perror( "init" );
+    return 1;
+  }
+  /* bound to an ephemeral port */
+  ::getsockname( rx.fd, (struct sockaddr *) &addr, &addrlen );
+  errors += test_gso_split( rx, tx, addr );
+  errors += test_gro_split( rx, addr );
+  aekv_udp_mmsg.close_func( &tx );
+  aekv_udp_mmsg.close_func( &rx );
+  return errors == 0 ? 0 : 1;
+}
@@ -0,0 +1,408 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <aekv/aeron_udp.h>
+extern "C" {
+#ifdef __GNUC__
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+#endif
+#include <aeronmd.h>
+#include "media/aeron_udp_channel_transport.h"
+#include "media/aeron_udp_transport_poller.h"
+#include "media/aeron_udp_channel_transport_bindings.h"
+#ifdef __GNUC__
+#pragma GCC diagnostic pop
+#endif
+}
+
+/* loopback test of the aekv_udp_uring poller, the multishot recv delivers
+ * each datagram once, in order, is armed again after it runs out of
+ * buffers, stops delivering when the transport is removed while armed, and
+ * the ring fd is readable when recvs complete, exits 1 if not */
+
+/* the default transport and poller are plain sockets here, without a
+ * driver context, the driver lib is not linked */
+extern "C" {
+size_t aeron_driver_context_get_mtu_length( aeron_driver_context_t * )
+{
+  return 0;
+}
+
+int
+aeron_udp_channel_transport_init( aeron_udp_channel_transport_t * transport,
+                                  struct sockaddr_storage * bind_addr,
+                                  struct sockaddr_storage *,  unsigned int,
+                                  uint8_t,  size_t,  size_t,
+                                  aeron_driver_context_t *,
+                                  aeron_udp_channel_transport_affinity_t )
+{
+  ::memset( transport, 0, sizeof( *transport ) );
+  transport->fd = ::socket( AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0 );
+  if ( transport->fd < 0 )
+    return -1;
+  if ( bind_addr != NULL &&
+       ::bind( transport->fd, (struct sockaddr *) bind_addr,
+               sizeof( struct sockaddr_in ) ) != 0 ) {
+    ::close( transport->fd );
+    return -1;
+  }
+  return 0;
+}
+
+int
+aeron_udp_channel_transport_close( aeron_udp_channel_transport_t * transport )
+{
+  ::close( transport->fd );
+  return 0;
+}
+
+int
+aeron_udp_channel_transport_recvmmsg( aeron_udp_channel_transport_t *,
+                                      struct mmsghdr *,  size_t,  int64_t *,
+                                      aeron_udp_transport_recv_func_t,
+                                      void * )
+{
+  return -1;
+}
+
+int
+aeron_udp_channel_transport_sendmmsg( aeron_udp_channel_transport_t * transport,
+                                      struct mmsghdr * msgvec,  size_t vlen )
+{
+  return ::sendmmsg( transport->fd, msgvec, vlen, 0 );
+}
+
+int
+aeron_udp_channel_transport_sendmsg( aeron_udp_channel_transport_t * transport,
+                                     struct msghdr * message )
+{
+  return ::sendmsg( transport->fd, message, 0 );
+}
+
+int aeron_udp_channel_transport_get_so_rcvbuf(
+  aeron_udp_channel_transport_t *,  size_t * ) { return 0; }
+int aeron_udp_channel_transport_bind_addr_and_port(
+  aeron_udp_channel_transport_t *,  char *,  size_t ) { return 0; }
+int aeron_udp_transport_poller_init( aeron_udp_transport_poller_t *,
+  aeron_driver_context_t *,
+  aeron_udp_channel_transport_affinity_t ) { return 0; }
+int aeron_udp_transport_poller_close(
+  aeron_udp_transport_poller_t * ) { return 0; }
+int aeron_udp_transport_poller_add( aeron_udp_transport_poller_t *,
+  aeron_udp_channel_transport_t * ) { return 0; }
+int aeron_udp_transport_poller_remove( aeron_udp_transport_poller_t *,
+  aeron_udp_channel_transport_t * ) { return 0; }
+/* only called when the bindings fell back to the default poller */
+int aeron_udp_transport_poller_poll( aeron_udp_transport_poller_t *,
+  struct mmsghdr *,  size_t,  int64_t *,  aeron_udp_transport_recv_func_t,
+  aeron_udp_channel_transport_recvmmsg_func_t,  void * ) { return -1; }
+}
+
+/* the provided buffers of a poller ring */
+static const size_t URING_BUF_COUNT = 256,
+                    MAX_SIZE        = 1408;
+
+/* the datagrams expected in order, datagram i has len( i ) bytes of
+ * seed + i */
+struct Expect {
+  size_t  count,    /* datagrams expected */
+          recv,     /* datagrams delivered */
+          errors,
+          size;     /* the largest, smaller by i % 7 * 32 */
+  uint8_t seed;
+
+  size_t len( size_t i ) const { return this->size - ( i % 7 ) * 32; }
+};
+
+static void
+recv_cb( aeron_udp_channel_data_paths_t *,  aeron_udp_channel_transport_t *,
+         void * clientd,  void *,  void *,  uint8_t * buf,  size_t len,
+         struct sockaddr_storage * addr )
+{
+  Expect & x = *(Expect *) clientd;
+  size_t   i = x.recv++;
+  uint8_t  c = (uint8_t) ( x.seed + i );
+  if ( i >= x.count ) {
+    fprintf( stderr, "extra datagram %lu len %lu\n", (unsigned long) i,
+             (unsigned long) len );
+    x.errors++;
+    return;
+  }
+  if ( len != x.len( i ) ) {
+    fprintf( stderr, "datagram %lu len %lu, expected %lu\n",
+             (unsigned long) i, (unsigned long) len,
+             (unsigned long) x.len( i ) );
+    x.errors++;
+  }
+  if ( addr->ss_family != AF_INET ) {
+    fprintf( stderr, "datagram %lu from family %u\n", (unsigned long) i,
+             (unsigned) addr->ss_family );
+    x.errors++;
+  }
+  for ( size_t j = 0; j < len; j++ ) {
+    if ( buf[ j ] != c ) {
+      fprintf( stderr, "datagram %lu byte %lu is %u, expected %u\n",
+               (unsigned long) i, (unsigned long) j, buf[ j ], c );
+      x.errors++;
+      break;
+    }
+  }
+}
+
+namespace {
+struct Loop {
+  aeron_udp_channel_transport_t rx, tx;
+  aeron_udp_transport_poller_t  poller;
+  struct sockaddr_in            addr;
+  int64_t                       bytes;
+
+  int poll( Expect &x ) {
+    return aekv_udp_uring.poller_poll_func( &this->poller, NULL, 0,
+                                            &this->bytes, recv_cb, NULL, &x );
+  }
+  /* poll until the count is delivered or a timeout, the last poll should
+   * find nothing more */
+  void poll_all( Expect &x ) {
+    for ( int spin = 0; x.recv < x.count && spin < 1000; spin++ ) {
+      int n = this->poll( x );
+      if ( n < 0 ) {
+        fprintf( stderr, "poll failed\n" );
+        x.errors++;
+        break;
+      }
+      if ( n == 0 )
+        ::usleep( 1000 );
+    }
+    ::usleep( 1000 );
+    this->poll( x );
+    if ( x.recv != x.count ) {
+      fprintf( stderr, "recv %lu datagrams, expected %lu\n",
+               (unsigned long) x.recv, (unsigned long) x.count );
+      x.errors++;
+    }
+  }
+  /* datagrams first .. first + n of x, with sendto() */
+  void send( Expect &x,  size_t first,  size_t n ) {
+    uint8_t buf[ MAX_SIZE ];
+    for ( size_t i = first; i < first + n; i++ ) {
+      ::memset( buf, (uint8_t) ( x.seed + i ), x.len( i ) );
+      if ( ::sendto( this->tx.fd, buf, x.len( i ), 0,
+                     (struct sockaddr *) &this->addr,
+                     sizeof( this->addr ) ) != (ssize_t) x.len( i ) ) {
+        perror( "sendto" );
+        x.errors++;
+      }
+    }
+  }
+};
+}
+
+/* batches sent with the linked sqes of uring_sendmmsg, the recv is not
+ * polled until each batch is sent */
+static size_t
+test_recv( Loop &l )
+{
+  static uint8_t data[ 16 ][ MAX_SIZE ];
+  Expect         x;
+  struct iovec   iov[ 16 ];
+  struct mmsghdr vec[ 16 ];
+  size_t         i, j, k;
+
+  ::memset( &x, 0, sizeof( x ) );
+  x.count = 1000;
+  x.size  = MAX_SIZE;
+  x.seed  = 1;
+  for ( i = 0; i < x.count; i += k ) {
+    k = ( x.count - i < 16 ? x.count - i : 16 );
+    for ( j = 0; j < k; j++ ) {
+      ::memset( data[ j ], (uint8_t) ( x.seed + i + j ), x.len( i + j ) );
+      iov[ j ].iov_base = data[ j ];
+      iov[ j ].iov_len  = x.len( i + j );
+      ::memset( &vec[ j ], 0, sizeof( vec[ j ] ) );
+      vec[ j ].msg_hdr.msg_name    = &l.addr;
+      vec[ j ].msg_hdr.msg_namelen = sizeof( l.addr );
+      vec[ j ].msg_hdr.msg_iov     = &iov[ j ];
+      vec[ j ].msg_hdr.msg_iovlen  = 1;
+    }
+    int n = aekv_udp_uring.sendmmsg_func( &l.tx, vec, k );
+    if ( n != (int) k ) {
+      fprintf( stderr, "sendmmsg sent %d of %lu\n", n, (unsigned long) k );
+      x.errors++;
+      break;
+    }
+    for ( int spin = 0; x.recv < i + k && spin < 1000; spin++ )
+      if ( l.poll( x ) == 0 )
+        ::usleep( 100 );
+  }
+  l.poll_all( x );
+  printf( "recv: %lu datagrams, %lu errors\n", (unsigned long) x.recv,
+          (unsigned long) x.errors );
+  return x.errors;
+}
+
+/* more datagrams than buffers arrive before a poll, the recv ends with
+ * ENOBUFS after the buffers are used, the rest wait in the socket until
+ * the poll arms the recv again */
+static size_t
+test_enobufs( Loop &l )
+{
+  Expect x;
+  int    first;
+
+  ::memset( &x, 0, sizeof( x ) );
+  x.count = URING_BUF_COUNT + 100;
+  x.size  = 256;
+  x.seed  = 0x40;
+  l.send( x, 0, x.count );
+  first = l.poll( x );
+  if ( first < 0 || (size_t) first > URING_BUF_COUNT ) {
+    fprintf( stderr, "first poll %d, more than the buffers\n", first );
+    x.errors++;
+  }
+  l.poll_all( x );
+  printf( "enobufs: %lu datagrams, first poll %d, %lu errors\n",
+          (unsigned long) x.recv, first, (unsigned long) x.errors );
+  return x.errors;
+}
+
+/* the ring fd is not ready when idle and is ready after a recv completes,
+ * the socket is drained by the recv, so it is not */
+static size_t
+test_ready( Loop &l,  int ring_fd )
+{
+  Expect             x;
+  struct epoll_event ev;
+  int                ep = ::epoll_create1( 0 ), n, ready = 0;
+
+  ::memset( &x, 0, sizeof( x ) );
+  x.count = 5;
+  x.size  = 256;
+  x.seed  = 0x20;
+  ::memset( &ev, 0, sizeof( ev ) );
+  ev.events = EPOLLIN;
+  ::epoll_ctl( ep, EPOLL_CTL_ADD, ring_fd, &ev );
+  for ( size_t i = 0; i < x.count; i++ ) {
+    l.poll( x );
+    if ( ::epoll_wait( ep, &ev, 1, 0 ) != 0 ) {
+      fprintf( stderr, "ring fd ready when idle\n" );
+      x.errors++;
+    }
+    l.send( x, i, 1 );
+    if ( ::epoll_wait( ep, &ev, 1, 1000 ) != 1 ) {
+      fprintf( stderr, "ring fd not ready after a recv\n" );
+      x.errors++;
+    }
+    else {
+      ready++;
+    }
+    n = l.poll( x );
+    if ( n != 1 ) {
+      fprintf( stderr, "poll after ready %d, expected 1\n", n );
+      x.errors++;
+    }
+  }
+  l.poll_all( x );
+  ::close( ep );
+  printf( "ready: %d of %lu, %lu errors\n", ready, (unsigned long) x.count,
+          (unsigned long) x.errors );
+  return x.errors;
+}
+
+/* removed while the recv is armed, nothing is delivered after, and the
+ * transport added again gets the datagrams which arrive after */
+static size_t
+test_remove( Loop &l )
+{
+  Expect x, none;
+
+  ::memset( &x, 0, sizeof( x ) );
+  ::memset( &none, 0, sizeof( none ) );
+  x.size = none.size = 256;
+  x.seed = none.seed = 0x60;
+
+  /* armed and idle, the cancel ends it */
+  l.poll( none );
+  aekv_udp_uring.poller_remove_func( &l.poller, &l.rx );
+  for ( int i = 0; i < 10; i++ )
+    l.poll( none );
+  /* the socket is not read, these wait for the add */
+  x.count = 3;
+  l.send( x, 0, 3 );
+  for ( int i = 0; i < 10; i++ ) {
+    l.poll( none );
+    ::usleep( 100 );
+  }
+  aekv_udp_uring.poller_add_func( &l.poller, &l.rx );
+  l.poll_all( x );
+
+  /* with completions in the cq, removed and added before they are reaped,
+   * the old recv has them, the new recv gets only what arrives after */
+  none.seed = (uint8_t) ( x.seed + x.count );
+  l.send( none, 0, 5 );
+  ::usleep( 1000 );
+  aekv_udp_uring.poller_remove_func( &l.poller, &l.rx );
+  aekv_udp_uring.poller_add_func( &l.poller, &l.rx );
+  for ( int i = 0; i < 10; i++ )
+    l.poll( none );
+  x.seed  = (uint8_t) ( none.seed + 5 );
+  x.recv  = 0;
+  x.count = 3;
+  l.send( x, 0, 3 );
+  l.poll_all( x );
+  if ( none.recv != 0 ) {
+    fprintf( stderr, "%lu datagrams delivered after remove\n",
+             (unsigned long) none.recv );
+    x.errors++;
+  }
+  printf( "remove: %lu errors\n", (unsigned long) ( x.errors + none.errors ) );
+  return x.errors + none.errors;
+}
+
+int
+main( void )
+{
+  Loop      l;
+  socklen_t addrlen = sizeof( l.addr );
+  int       rcvbuf  = 1024 * 1024, ring_fd;
+  size_t    errors  = 0;
+
+  ::memset( &l, 0, sizeof( l ) );
+  l.addr.sin_family      = AF_INET;
+  l.addr.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+  if ( aekv_udp_uring.init_func( &l.rx, (struct sockaddr_storage *) &l.addr,
+                                 NULL, 0, 0, 0, 0, NULL,
+                       AERON_UDP_CHANNEL_TRANSPORT_AFFINITY_RECEIVER ) < 0 ||
+       aekv_udp_uring.init_func( &l.tx, NULL, NULL, 0, 0, 0, 0, NULL,
+                       AERON_UDP_CHANNEL_TRANSPORT_AFFINITY_SENDER ) < 0 ) {
+    perror( "init" );
+    return 1;
+  }
+  /* bound to an ephemeral port, the enobufs test queues in the socket */
+  ::getsockname( l.rx.fd, (struct sockaddr *) &l.addr, &addrlen );
+  ::setsockopt( l.rx.fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof( rcvbuf ) );
+  aekv_udp_uring.poller_init_func( &l.poller, NULL,
+                                   AERON_UDP_CHANNEL_TRANSPORT_AFFINITY_RECEIVER );
+  ring_fd = aekv_udp_uring_poller_fd( &l.poller );
+  if ( ring_fd < 0 ) {
+    printf( "skipped, no io_uring\n" );
+  }
+  else {
+    aekv_udp_uring.poller_add_func( &l.poller, &l.rx );
+    errors += test_recv( l );
+    errors += test_enobufs( l );
+    errors += test_ready( l, ring_fd );
+    errors += test_remove( l );
+    aekv_udp_uring.poller_remove_func( &l.poller, &l.rx );
+  }
+  aekv_udp_uring.poller_close_func( &l.poller );
+  aekv_udp_uring.close_func( &l.tx );
+  aekv_udp_uring.close_func( &l.rx );
+  return errors == 0 ? 0 : 1;
+}